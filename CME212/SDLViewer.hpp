@@ -15,6 +15,8 @@
 #include <string>
 #include <cassert>
 #include <algorithm>
+#include <utility>
+#include <type_traits>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_opengl.h>
@@ -57,6 +59,159 @@ struct DefaultPosition {
 };
 
 
+/** @class IndexNodeMap
+ * @brief Node map for add_nodes()/add_edges() keyed by node.index().
+ *
+ * SDLViewer::empty_node_map() returns one of these for any graph whose nodes
+ * have an index() method, so each lookup is an array access instead of a
+ * std::map search. Nodes whose slot is already taken by a different node
+ * (e.g., nodes of a second graph added to the same map) go to a std::map, so
+ * the behavior is the same as with a std::map node map.
+ */
+template <typename NODE>
+class IndexNodeMap {
+ public:
+  typedef NODE key_type;
+
+  /** Construct an empty map with room for nodes of index < @a n. */
+  explicit IndexNodeMap(std::size_t n = 0)
+      : nodes_(n), vertex_(n, none) {
+  }
+
+  /** Map @a n to vertex @a v unless @a n is already mapped.
+   * @return The vertex of @a n and whether it was inserted. */
+  std::pair<unsigned, bool> insert(const NODE& n, unsigned v) {
+    std::size_t i = n.index();
+    if (i >= vertex_.size()) {
+      nodes_.resize(i + 1);
+      vertex_.resize(i + 1, none);
+    }
+    if (vertex_[i] == none) {
+      nodes_[i] = n;
+      vertex_[i] = v;
+      return {v, true};
+    }
+    if (nodes_[i] == n)
+      return {vertex_[i], false};
+    auto r = overflow_.insert(std::make_pair(n, v));
+    return {r.first->second, r.second};
+  }
+
+  /** If @a n is mapped, set @a v to its vertex and return true. */
+  bool find(const NODE& n, unsigned& v) const {
+    std::size_t i = n.index();
+    if (i < vertex_.size() && vertex_[i] != none && nodes_[i] == n) {
+      v = vertex_[i];
+      return true;
+    }
+    auto it = overflow_.find(n);
+    if (it == overflow_.end())
+      return false;
+    v = it->second;
+    return true;
+  }
+
+  /** Remove all nodes, keeping the capacity. */
+  void clear() {
+    std::fill(vertex_.begin(), vertex_.end(), none);
+    overflow_.clear();
+  }
+
+ private:
+  enum : unsigned { none = unsigned(-1) };
+  std::vector<NODE> nodes_;
+  std::vector<unsigned> vertex_;
+  std::map<NODE, unsigned> overflow_;
+};
+
+namespace detail {
+
+// True if NODE has an index() method
+template <typename NODE, typename = void>
+struct has_index : std::false_type {};
+template <typename NODE>
+struct has_index<NODE, decltype(void(std::declval<const NODE&>().index()))>
+    : std::true_type {};
+
+// Uniform insert/find over std::map-like node maps and IndexNodeMap
+template <typename Map, typename NODE>
+std::pair<unsigned, bool> node_map_insert(Map& m, const NODE& n, unsigned v) {
+  auto r = m.insert(typename Map::value_type(n, v));
+  return {r.first->second, r.second};
+}
+template <typename NODE>
+std::pair<unsigned, bool> node_map_insert(IndexNodeMap<NODE>& m,
+                                          const NODE& n, unsigned v) {
+  return m.insert(n, v);
+}
+
+template <typename Map, typename NODE>
+bool node_map_find(const Map& m, const NODE& n, unsigned& v) {
+  auto it = m.find(n);
+  if (it == m.end())
+    return false;
+  v = it->second;
+  return true;
+}
+template <typename NODE>
+bool node_map_find(const IndexNodeMap<NODE>& m, const NODE& n, unsigned& v) {
+  return m.find(n, v);
+}
+
+} // namespace detail
+
+
+/** @class RenderThrottle
+ * @brief Decides which iterations of a loop are worth drawing.
+ *
+ * due() is called once per iteration and returns true at most once every
+ * @a frame_interval calls and at most @a max_fps times per wall-clock second,
+ * so a fast solver or integrator doesn't spend its time feeding the viewer
+ * frames the screen can't show. A @a max_fps of zero disables the wall-clock
+ * limit.
+ *
+ * @code
+ * CME212::RenderThrottle throttle(1, 30);
+ * for (...) {
+ *   step();
+ *   if (throttle.due()) viewer.update_positions(g.node_begin(), g.node_end());
+ * }
+ * @endcode
+ */
+class RenderThrottle {
+ public:
+  explicit RenderThrottle(unsigned frame_interval = 1, double max_fps = 60)
+      : frame_interval_(std::max(frame_interval, 1u)),
+        min_seconds_(max_fps > 0 ? 1.0 / max_fps : 0.0),
+        count_(0), first_(true) {
+  }
+
+  /** Return true if this iteration should be drawn, and start a new frame. */
+  bool due() {
+    if (first_) {
+      first_ = false;
+      return start_frame();
+    }
+    if (++count_ < frame_interval_ || clock_.seconds() < min_seconds_)
+      return false;
+    return start_frame();
+  }
+
+ private:
+  bool start_frame() {
+    count_ = 0;
+    clock_.start();
+    return true;
+  }
+
+  unsigned frame_interval_;
+  double min_seconds_;
+  unsigned count_;
+  bool first_;
+  Clock clock_;
+};
+
+
 /** SDLViewer class to view points and edges
  */
 class SDLViewer {
@@ -89,6 +244,20 @@ class SDLViewer {
   // Currently displayed label
   std::string label_;
 
+  // Which of coords_, colors_ and edges_ changed since the last upload
+  enum { COORDS_DIRTY = 1, COLORS_DIRTY = 2, EDGES_DIRTY = 4 };
+  unsigned dirty_;
+
+  // Buffer objects mirroring coords_, colors_ and edges_ on the GPU, and the
+  // number of bytes allocated for each. Zero ids if buffer objects aren't
+  // supported, in which case render() draws straight from the vectors.
+  GLuint buffer_[3];
+  std::size_t buffer_bytes_[3];
+  PFNGLGENBUFFERSPROC gl_gen_buffers_;
+  PFNGLBINDBUFFERPROC gl_bind_buffer_;
+  PFNGLBUFFERDATAPROC gl_buffer_data_;
+  PFNGLBUFFERSUBDATAPROC gl_buffer_sub_data_;
+
   struct safe_lock {
     SDLViewer* v_;
     bool ok_;
@@ -117,7 +286,10 @@ class SDLViewer {
     /** Constructor */
   SDLViewer()
       : surface_(nullptr), event_thread_(nullptr), lock_(nullptr),
-        render_requested_(false) {
+        render_requested_(false), dirty_(0), buffer_{0, 0, 0},
+        buffer_bytes_{0, 0, 0}, gl_gen_buffers_(nullptr),
+        gl_bind_buffer_(nullptr), gl_buffer_data_(nullptr),
+        gl_buffer_sub_data_(nullptr) {
   }
 
   /** Destructor - Waits until the event thread exits, then cleans up
@@ -164,6 +336,7 @@ class SDLViewer {
       colors_.clear();
       edges_.clear();
       label_.clear();
+      dirty_ = COORDS_DIRTY | COLORS_DIRTY | EDGES_DIRTY;
     }
     request_render();
   }
@@ -197,6 +370,7 @@ class SDLViewer {
 
       // Set all nodes to be white
       colors_ = std::vector<Color>(coords_.size(), Color(1,1,1));
+      dirty_ = COORDS_DIRTY | COLORS_DIRTY | EDGES_DIRTY;
     }
 
     request_render();
@@ -227,12 +401,13 @@ class SDLViewer {
       // Clear the data
       coords_.clear();
       edges_.clear();
-      std::map<size_type, unsigned> nodemap;
+      size_type num_nodes = g.num_nodes();
+      std::vector<unsigned> nodemap(num_nodes);
 
       // Insert the nodes and record mapping
-      size_type num_nodes = g.num_nodes();
       for (size_type i = 0; i < num_nodes; ++i) {
         node_type n = g.node(i);
+        assert(n.index() < num_nodes);
         nodemap[n.index()] = coords_.size();
         coords_.push_back(n.position());
       }
@@ -244,24 +419,31 @@ class SDLViewer {
       size_type num_edges = g.num_edges();
       for (size_type i = 0; i < num_edges; ++i) {
         edge_type e = g.edge(i);
-        auto it1 = nodemap.find(e.node1().index());
-        auto it2 = nodemap.find(e.node2().index());
-        if (it1 != nodemap.end() && it2 != nodemap.end()) {
-          edges_.push_back(it1->second);
-          edges_.push_back(it2->second);
-        }
+        edges_.push_back(nodemap[e.node1().index()]);
+        edges_.push_back(nodemap[e.node2().index()]);
       }
+      dirty_ = COORDS_DIRTY | COLORS_DIRTY | EDGES_DIRTY;
     }
 
     request_render();
   }
 
+  /** The node map type empty_node_map() returns for graph type G:
+   * IndexNodeMap if G::node_type has an index() method, otherwise
+   * std::map<G::node_type, unsigned>. */
+  template <typename G>
+  using node_map_type = typename std::conditional<
+    detail::has_index<typename G::node_type>::value,
+    IndexNodeMap<typename G::node_type>,
+    std::map<typename G::node_type, unsigned>>::type;
+
   /** Return an empty node map designed for the input graph.
    *
-   * Node maps are passed to, and modified by, add_nodes() and add_edges(). */
+   * Node maps are passed to, and modified by, add_nodes() and add_edges().
+   * Any type with the std::map<node_type, unsigned> interface also works. */
   template <typename G>
-  std::map<typename G::node_type, unsigned> empty_node_map(const G&) const {
-    return std::map<typename G::node_type, unsigned>();
+  node_map_type<G> empty_node_map(const G& g) const {
+    return make_node_map(g, detail::has_index<typename G::node_type>());
   }
 
   /** Add the nodes in the range [first, last) to the display.
@@ -312,16 +494,16 @@ class SDLViewer {
       for (; first != last; ++first) {
         // Get node and record the index mapping
         auto n = *first;
-        auto r = node_map.insert(typename Map::value_type(n,coords_.size()));
+        auto r = detail::node_map_insert(node_map, n, coords_.size());
         if (r.second) {   // new node was inserted
           coords_.push_back(position_function(n));
           colors_.push_back(color_function(n));
         } else {          // node already exists and not updated
-          unsigned index = r.first->second;
-          coords_[index] = position_function(n);
-          colors_[index] = color_function(n);
+          coords_[r.first] = position_function(n);
+          colors_[r.first] = color_function(n);
         }
       }
+      dirty_ |= COORDS_DIRTY | COLORS_DIRTY;
     }
 
     request_render();
@@ -343,18 +525,77 @@ class SDLViewer {
       for (; first != last; ++first) {
 
         auto edge = *first;
-        auto n1 = node_map.find(edge.node1());
-        auto n2 = node_map.find(edge.node2());
-        if (n1 != node_map.end() && n2 != node_map.end()) {
-          edges_.push_back(n1->second);
-          edges_.push_back(n2->second);
+        unsigned n1, n2;
+        if (detail::node_map_find(node_map, edge.node1(), n1) &&
+            detail::node_map_find(node_map, edge.node2(), n2)) {
+          edges_.push_back(n1);
+          edges_.push_back(n2);
         }
       }
+      dirty_ |= EDGES_DIRTY;
+    }
+
+    request_render();
+  }
+
+  /** Overwrite the positions and colors of nodes already on display.
+   * @param[in] color_function Returns a Color for each node.
+   * @param[in] position_function Returns a Point for each node.
+   * @pre The nodes in [first, last) are the first last - first nodes added
+   *      by add_nodes() or draw_graph(), in the same order.
+   *
+   * The k-th node of the range replaces vertex k. Unlike add_nodes() there
+   * is no node map lookup and the edges are left alone, so redrawing a graph
+   * whose topology didn't change costs one pass over its nodes.
+   *
+   * Complexity: O(last - first). */
+  template <typename InputIterator, typename ColorFn, typename PointFn>
+  void update_nodes(InputIterator first, InputIterator last,
+                    ColorFn color_function, PointFn position_function) {
+    // Lock for data update
+    { safe_lock mutex(this);
+
+      for (unsigned index = 0; first != last; ++first, ++index) {
+        assert(index < coords_.size());
+        auto n = *first;
+        coords_[index] = position_function(n);
+        colors_[index] = color_function(n);
+      }
+      dirty_ |= COORDS_DIRTY | COLORS_DIRTY;
     }
 
     request_render();
   }
 
+  /** Overwrite the positions of nodes already on display, keeping colors.
+   * @param[in] position_function Returns a Point for each node.
+   * @pre As for update_nodes().
+   *
+   * Complexity: O(last - first). */
+  template <typename InputIterator, typename PointFn>
+  void update_positions(InputIterator first, InputIterator last,
+                        PointFn position_function) {
+    // Lock for data update
+    { safe_lock mutex(this);
+
+      for (unsigned index = 0; first != last; ++first, ++index) {
+        assert(index < coords_.size());
+        coords_[index] = position_function(*first);
+      }
+      dirty_ |= COORDS_DIRTY;
+    }
+
+    request_render();
+  }
+
+  /** Overwrite the positions of nodes already on display with
+   * node.position(), keeping colors.
+   * @pre As for update_nodes(). */
+  template <typename InputIterator>
+  void update_positions(InputIterator first, InputIterator last) {
+    return update_positions(first, last, DefaultPosition());
+  }
+
   /** Set a string label to display "green LCD" style. */
   void set_label(const std::string& str) {
     safe_lock mutex(this);
@@ -413,6 +654,17 @@ class SDLViewer {
 
  private:
 
+  template <typename G>
+  IndexNodeMap<typename G::node_type> make_node_map(const G& g,
+                                                     std::true_type) const {
+    return IndexNodeMap<typename G::node_type>(g.num_nodes());
+  }
+  template <typename G>
+  std::map<typename G::node_type, unsigned> make_node_map(const G&,
+                                                           std::false_type) const {
+    return std::map<typename G::node_type, unsigned>();
+  }
+
   /** Initialize the SDL Window
    */
   void init() {
@@ -461,6 +713,34 @@ class SDLViewer {
     glEnable(GL_FOG);
     glFogi(GL_FOG_MODE, GL_EXP);
     glFogf(GL_FOG_DENSITY, 0.3);
+
+    // Buffer objects are core since OpenGL 1.5; fall back to client-side
+    // arrays if the driver doesn't expose them
+    gl_gen_buffers_ = reinterpret_cast<PFNGLGENBUFFERSPROC>(
+        SDL_GL_GetProcAddress("glGenBuffers"));
+    gl_bind_buffer_ = reinterpret_cast<PFNGLBINDBUFFERPROC>(
+        SDL_GL_GetProcAddress("glBindBuffer"));
+    gl_buffer_data_ = reinterpret_cast<PFNGLBUFFERDATAPROC>(
+        SDL_GL_GetProcAddress("glBufferData"));
+    gl_buffer_sub_data_ = reinterpret_cast<PFNGLBUFFERSUBDATAPROC>(
+        SDL_GL_GetProcAddress("glBufferSubData"));
+    if (gl_gen_buffers_ && gl_bind_buffer_ && gl_buffer_data_
+        && gl_buffer_sub_data_)
+      gl_gen_buffers_(3, buffer_);
+    dirty_ = COORDS_DIRTY | COLORS_DIRTY | EDGES_DIRTY;
+  }
+
+  /** Copy @a bytes bytes at @a data to buffer object @a k, bound to
+   * @a target. Reuses the allocation when the size didn't change, so a
+   * frame that only moved the nodes costs one glBufferSubData. */
+  void upload(int k, GLenum target, const void* data, std::size_t bytes) {
+    gl_bind_buffer_(target, buffer_[k]);
+    if (bytes == buffer_bytes_[k]) {
+      gl_buffer_sub_data_(target, 0, bytes, data);
+    } else {
+      gl_buffer_data_(target, bytes, data, GL_DYNAMIC_DRAW);
+      buffer_bytes_[k] = bytes;
+    }
   }
 
   /** Static event loop wrapper for thread creation
@@ -661,23 +941,46 @@ class SDLViewer {
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_COLOR_ARRAY);
 
-    // Define the vertex interpreter
-    glVertexPointer(Point::size(), gltype<typename Point::value_type>::value,
-                    0, coords_.data());
+    // With buffer objects the pointers below are offsets into the buffers,
+    // which are only re-sent when the data changed
+    const bool vbo = buffer_[0] != 0;
+    const void* coords = coords_.data();
+    const void* colors = colors_.data();
+    const void* edges = edges_.data();
+    if (vbo) {
+      if (dirty_ & COLORS_DIRTY)
+        upload(1, GL_ARRAY_BUFFER, colors, colors_.size() * sizeof(Color));
+      if (dirty_ & COORDS_DIRTY)
+        upload(0, GL_ARRAY_BUFFER, coords, coords_.size() * sizeof(Point));
+      if (dirty_ & EDGES_DIRTY)
+        upload(2, GL_ELEMENT_ARRAY_BUFFER, edges,
+               edges_.size() * sizeof(unsigned));
+      coords = colors = edges = nullptr;
+      dirty_ = 0;
+    }
 
     // Define the color interpreter
-    glColorPointer(3, gltype<typename Color::value_type>::value,
-                   0, colors_.data());
+    if (vbo) gl_bind_buffer_(GL_ARRAY_BUFFER, buffer_[1]);
+    glColorPointer(3, gltype<typename Color::value_type>::value, 0, colors);
+
+    // Define the vertex interpreter
+    if (vbo) gl_bind_buffer_(GL_ARRAY_BUFFER, buffer_[0]);
+    glVertexPointer(Point::size(), gltype<typename Point::value_type>::value,
+                    0, coords);
 
     // Draw the points
     glPointSize(1.5);
     glDrawArrays(GL_POINTS, 0, coords_.size());
 
     // Draw the lines
+    if (vbo) gl_bind_buffer_(GL_ELEMENT_ARRAY_BUFFER, buffer_[2]);
     glLineWidth(1);
-    glDrawElements(GL_LINES, edges_.size(),
-                   gltype<unsigned>::value, edges_.data());
+    glDrawElements(GL_LINES, edges_.size(), gltype<unsigned>::value, edges);
 
+    if (vbo) {
+      gl_bind_buffer_(GL_ARRAY_BUFFER, 0);
+      gl_bind_buffer_(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
     glDisableClientState(GL_COLOR_ARRAY);
     glDisableClientState(GL_VERTEX_ARRAY);
 
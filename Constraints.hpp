@@ -0,0 +1,328 @@
+#pragma once
+/** @file Constraints.hpp
+ * @brief Obstacle constraints on a MassSpringSystem, composed at compile time
+ *   and applied in one parallel pass over the nodes near the obstacles.
+ *
+ * Constraints are expressions built like the forces of MassSpring.hpp,
+ *
+ *   auto obstacles = PlaneObstacle(-0.75)
+ *                  + SphereObstacle(Point(0.5, 0.5, -0.5), 0.15);
+ *   ConstraintPass<decltype(obstacles)> constrain(obstacles);
+ *   constrain(system, searcher);
+ *
+ * Every obstacle reports a box outside of which it leaves nodes alone. The
+ * pass asks a SpaceSearcher for the nodes in those boxes and runs the whole
+ * expression on them only, so its cost follows the number of nodes near an
+ * obstacle rather than the size of the mesh.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <omp.h>
+
+#include "CME212/Point.hpp"
+#include "CME212/BoundingBox.hpp"
+
+#include "MassSpring.hpp"
+#include "Profile.hpp"
+
+/** @class ConstraintExpr
+ * @brief Curiously Recurring Template Pattern for constraint expressions.
+ *
+ * A constraint expression is anything that inherits from ConstraintExpr<E>
+ * and implements
+ * concept E {
+ *   template <typename S>
+ *   void operator()(S& s, unsigned i) const;
+ *   template <typename F>
+ *   void for_each_bounds(F f) const;
+ * }
+ * where operator() corrects the position and velocity of node i of the
+ * system s, and for_each_bounds() calls f(const Box3D&) with boxes that
+ * together hold every node operator() may change.
+ */
+template <typename E>
+struct ConstraintExpr {
+  const E& derived() const {
+    return static_cast<const E&>(*this);
+  }
+  template <typename S>
+  void operator()(S& s, unsigned i) const {
+    derived()(s, i);
+  }
+  template <typename F>
+  void for_each_bounds(F f) const {
+    derived().for_each_bounds(f);
+  }
+};
+
+/** Two constraint expressions, applied one after the other */
+template <typename E1, typename E2>
+struct ConstraintSeq : public ConstraintExpr<ConstraintSeq<E1, E2>> {
+  ConstraintSeq(const E1& a, const E2& b)
+      : a_(a), b_(b) {
+  }
+  template <typename S>
+  void operator()(S& s, unsigned i) const {
+    a_(s, i);
+    b_(s, i);
+  }
+  template <typename F>
+  void for_each_bounds(F f) const {
+    a_.for_each_bounds(f);
+    b_.for_each_bounds(f);
+  }
+ private:
+  E1 a_;
+  E2 b_;
+};
+
+/** Apply @a a, then @a b */
+template <typename E1, typename E2>
+ConstraintSeq<E1, E2> operator+(const ConstraintExpr<E1>& a,
+                                const ConstraintExpr<E2>& b) {
+  return ConstraintSeq<E1, E2>(a.derived(), b.derived());
+}
+
+/** The floor z = z0. Nodes below it are lifted onto it and lose their
+ * vertical velocity. */
+struct PlaneObstacle : public ConstraintExpr<PlaneObstacle> {
+  explicit PlaneObstacle(double z)
+      : z_(z) {
+  }
+  template <typename S>
+  void operator()(S& s, unsigned i) const {
+    if (s.position(i).z < z_) {
+      s.position(i).z = z_;
+      s.velocity(i).z = 0;
+    }
+  }
+  template <typename F>
+  void for_each_bounds(F f) const {
+    const double inf = std::numeric_limits<double>::infinity();
+    f(Box3D(Point(-inf, -inf, -inf), Point(inf, inf, z_)));
+  }
+ private:
+  double z_;
+};
+
+/** A solid sphere. Nodes inside it are moved to the nearest point of its
+ * surface and lose their radial velocity. */
+struct SphereObstacle : public ConstraintExpr<SphereObstacle> {
+  SphereObstacle(const Point& c, double r)
+      : c_(c), r_(r) {
+  }
+  template <typename S>
+  void operator()(S& s, unsigned i) const {
+    Point d = s.position(i) - c_;
+    double len = norm(d);
+    if (len < r_ && len > 0) {
+      Point R = d / len;
+      s.velocity(i) -= dot(s.velocity(i), R) * R;
+      s.position(i) = c_ + r_ * R;
+    }
+  }
+  template <typename F>
+  void for_each_bounds(F f) const {
+    f(Box3D(c_ - Point(r_), c_ + Point(r_)));
+  }
+ private:
+  Point c_;
+  double r_;
+};
+
+/** A solid axis-aligned box. Nodes inside it are moved to the nearest face
+ * and lose their velocity across that face. */
+struct BoxObstacle : public ConstraintExpr<BoxObstacle> {
+  explicit BoxObstacle(const Box3D& box)
+      : box_(box) {
+  }
+  template <typename S>
+  void operator()(S& s, unsigned i) const {
+    Point& x = s.position(i);
+    if (!box_.contains(x))
+      return;
+    // The face nearest to x
+    int axis = 0;
+    double best = std::numeric_limits<double>::infinity(), to = 0;
+    for (int d = 0; d < 3; ++d) {
+      if (x[d] - box_.min()[d] < best) {
+        best = x[d] - box_.min()[d];
+        axis = d;
+        to = box_.min()[d];
+      }
+      if (box_.max()[d] - x[d] < best) {
+        best = box_.max()[d] - x[d];
+        axis = d;
+        to = box_.max()[d];
+      }
+    }
+    x[axis] = to;
+    s.velocity(i)[axis] = 0;
+  }
+  template <typename F>
+  void for_each_bounds(F f) const {
+    f(box_);
+  }
+ private:
+  Box3D box_;
+};
+
+
+namespace detail {
+
+/** The system index of a SpaceSearcher item: the item itself, or its
+ * index() for nodes. */
+inline unsigned item_index(unsigned i) {
+  return i;
+}
+template <typename N>
+unsigned item_index(const N& n) {
+  return n.index();
+}
+
+} // end namespace detail
+
+/** @class ConstraintPass
+ * @brief Applies a constraint expression to the nodes of a MassSpringSystem
+ *   that lie inside its bounds.
+ *
+ * The candidate list is kept between calls so steady-state passes don't
+ * allocate.
+ */
+template <typename E>
+class ConstraintPass {
+ public:
+  typedef unsigned size_type;
+
+  explicit ConstraintPass(const ConstraintExpr<E>& c)
+      : c_(c.derived()) {
+  }
+
+  /** Apply the constraints to the free nodes of @a s near an obstacle.
+   * @param[in] searcher A SpaceSearcher over the nodes of @a s, as indices
+   *                     or as nodes of the graph @a s was built from,
+   *                     refreshed to the current positions.
+   *
+   * Nodes are gathered from the positions before the pass: a node that one
+   * constraint pushes into the bounds of another, and wasn't there before,
+   * is seen by that one at the next call. Fixed nodes are left alone.
+   *
+   * Complexity: O(c log(n) + k), where k is the number of candidates and c
+   * the number of Morton cells visited; the corrections run in parallel.
+   */
+  template <typename Searcher>
+  void operator()(MassSpringSystem& s, const Searcher& searcher) {
+    CME212_PROFILE_SCOPE("ms.constraints");
+    const Box3D domain = searcher.bounding_box();
+    candidates_.clear();
+    unsigned boxes = 0;
+    c_.for_each_bounds([&](const Box3D& b) {
+      // Clip the box to the searcher's domain
+      Point lo = b.min(), hi = b.max();
+      for (int d = 0; d < 3; ++d) {
+        lo[d] = std::max(lo[d], domain.min()[d]);
+        hi[d] = std::min(hi[d], domain.max()[d]);
+        if (lo[d] > hi[d])
+          return;
+      }
+      Box3D bb(lo, hi);
+      auto end = searcher.end(bb);
+      for (auto it = searcher.begin(bb); it != end; ++it)
+        candidates_.push_back(detail::item_index(*it));
+      ++boxes;
+    });
+    // Overlapping boxes may hold the same node twice
+    if (boxes > 1) {
+      std::sort(candidates_.begin(), candidates_.end());
+      candidates_.erase(std::unique(candidates_.begin(), candidates_.end()),
+                        candidates_.end());
+    }
+
+    const long k = candidates_.size();
+    CME212_PROFILE_COUNT("ms.constraint_candidates", k);
+    #pragma omp parallel for schedule(static)
+    for (long j = 0; j < k; ++j) {
+      const size_type i = candidates_[j];
+      if (!s.is_fixed(i))
+        c_(s, i);
+    }
+  }
+
+  /** The nodes visited by the last pass. */
+  const std::vector<size_type>& candidates() const {
+    return candidates_;
+  }
+
+ private:
+  E c_;
+  std::vector<size_type> candidates_;
+};
+
+
+/** @class SelfCollisionPass
+ * @brief Keeps the nodes of a MassSpringSystem from running into each other.
+ *
+ * Node i collides with every node whose squared distance is below 0.9
+ * times its shortest squared spring length, and loses its velocity
+ * component towards each of them in turn.
+ * The new velocities are written to a buffer, Jacobi style, and copied back
+ * once every node is done, so no thread reads a velocity another is
+ * changing.
+ */
+class SelfCollisionPass {
+ public:
+  typedef unsigned size_type;
+
+  /** Correct the velocities of @a s.
+   * @param[in] searcher A SpaceSearcher over the nodes of @a s, as indices
+   *                     or as nodes of the graph @a s was built from,
+   *                     refreshed to the current positions. Only read.
+   *
+   * Complexity: O(n + number of springs + k), in parallel, where k is the
+   * number of node pairs in the Morton cells that meet the collision balls.
+   */
+  template <typename Searcher>
+  void operator()(MassSpringSystem& s, const Searcher& searcher) {
+    CME212_PROFILE_SCOPE("ms.collisions");
+    typedef typename Searcher::value_type item_type;
+    const size_type n = s.size();
+    r2_.resize(n);
+    v_.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < n; ++i) {
+      const Point& xi = s.position(i);
+      double r2 = s.spring_begin(i) < s.spring_end(i)
+                ? std::numeric_limits<double>::max() : 0;
+      for (size_type k = s.spring_begin(i); k < s.spring_end(i); ++k)
+        r2 = std::min(r2, normSq(s.position(s.spring_node(k)) - xi));
+      r2_[i] = 0.9 * r2;
+      v_[i] = s.velocity(i);
+    }
+
+    // All visits for node i run on one thread, and write only v_[i]
+    const MassSpringSystem& cs = s;
+    searcher.radius_query_all(
+        [&](const item_type& a) {
+          return std::sqrt(r2_[detail::item_index(a)]);
+        },
+        [&](const item_type& a, const item_type& b) {
+          const size_type i = detail::item_index(a), j = detail::item_index(b);
+          Point r = cs.position(i) - cs.position(j);
+          double l2 = normSq(r);
+          if (i != j && l2 < r2_[i])
+            v_[i] -= (dot(r, v_[i]) / l2) * r;
+        });
+
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < n; ++i)
+      s.velocity(i) = v_[i];
+  }
+
+ private:
+  // Squared collision radius and corrected velocity of each node
+  std::vector<double> r2_;
+  std::vector<Point> v_;
+};
@@ -0,0 +1,432 @@
+#pragma once
+/** @file Distributed.hpp
+ * @brief MPI halo exchange on the subdomains of Partition.hpp, and the
+ *   mass-spring step and Poisson CG solve on top of it.
+ *
+ * Every process keeps one subdomain of the graph. Its own nodes are updated
+ * locally, its ghosts are copies refreshed from their owners by a
+ * HaloExchange. Exchanges are split into begin() and end(), so the interior
+ * nodes, which read no ghost, are computed while the messages travel:
+ *
+ *   MassSpringSystem local_system(local, is_fixed);
+ *   DistributedMassSpring system(local_system, sub);
+ *   t = system.step(t, system.adaptive_dt(), force);
+ *
+ * Needs MPI: build with -DCME212_USE_MPI and mpicxx, see the Makefile.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <type_traits>
+#include <omp.h>
+#include <mpi.h>
+
+#include "CME212/Point.hpp"
+
+#include "Partition.hpp"
+#include "MassSpring.hpp"
+#include "Profile.hpp"
+
+namespace detail {
+
+/** The Assign of GraphSymmetricMatrix::mult_rows for w = A v, without
+ * needing MTL here. */
+struct assign_copy {
+  static void apply(double& a, double b) {
+    a = b;
+  }
+};
+
+} // end namespace detail
+
+/** Return the smallest @a x over the processes of @a comm. */
+inline double all_min(double x, MPI_Comm comm = MPI_COMM_WORLD) {
+  MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_DOUBLE, MPI_MIN, comm);
+  return x;
+}
+
+/** Return the sum of @a x over the processes of @a comm. */
+inline double all_sum(double x, MPI_Comm comm = MPI_COMM_WORLD) {
+  MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_DOUBLE, MPI_SUM, comm);
+  return x;
+}
+
+/** Replace @a x[0, @a count) by their sums over the processes of @a comm,
+ * in one reduction. */
+inline void all_sum(double* x, int count, MPI_Comm comm = MPI_COMM_WORLD) {
+  MPI_Allreduce(MPI_IN_PLACE, x, count, MPI_DOUBLE, MPI_SUM, comm);
+}
+
+/** @class HaloExchange
+ * @brief Sends the values of a subdomain's own nodes to the neighbors that
+ *   hold them as ghosts, and receives the values of its own ghosts.
+ *
+ * T is sent as raw bytes, so it must be trivially copyable and the same
+ * type on every process. Concurrent exchanges on one communicator need
+ * different tags. The buffers are kept between exchanges.
+ */
+template <typename T>
+class HaloExchange {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "HaloExchange sends T as bytes");
+ public:
+  typedef Subdomain::size_type size_type;
+
+  HaloExchange(const Subdomain& sub, int tag = 0,
+               MPI_Comm comm = MPI_COMM_WORLD)
+      : sub_(&sub), tag_(tag), comm_(comm),
+        send_(sub.send_ids().size()), recv_(sub.num_ghosts()) {
+  }
+
+  /** Start the exchange: post the receives, pack get(l) for every own node
+   * l some neighbor needs, and post the sends.
+   * @param[in] get Called as get(l) -> T for own local nodes l, in parallel.
+   *                Only nodes in 0 <= l < sub.num_boundary() are asked.
+   */
+  template <typename Get>
+  void begin(Get get) {
+    CME212_PROFILE_SCOPE("halo.begin");
+    assert(requests_.empty());
+    const Subdomain& s = *sub_;
+    const size_type first = s.num_owned();
+    for (size_type k = 0; k < s.neighbors().size(); ++k) {
+      requests_.push_back(MPI_REQUEST_NULL);
+      MPI_Irecv(recv_.data() + (s.recv_begin(k) - first),
+                bytes(s.recv_end(k) - s.recv_begin(k)), MPI_BYTE,
+                s.neighbors()[k], tag_, comm_, &requests_.back());
+    }
+    const long m = send_.size();
+    const size_type* ids = s.send_ids().data();
+    #pragma omp parallel for schedule(static)
+    for (long j = 0; j < m; ++j)
+      send_[j] = get(ids[j]);
+    for (size_type k = 0; k < s.neighbors().size(); ++k) {
+      requests_.push_back(MPI_REQUEST_NULL);
+      MPI_Isend(send_.data() + s.send_begin(k),
+                bytes(s.send_end(k) - s.send_begin(k)), MPI_BYTE,
+                s.neighbors()[k], tag_, comm_, &requests_.back());
+    }
+  }
+
+  /** Wait for the exchange started by begin() and hand over the ghosts.
+   * @param[in] set Called as set(l, value) for every ghost l,
+   *                num_owned() <= l < size(), in parallel.
+   */
+  template <typename Set>
+  void end(Set set) {
+    CME212_PROFILE_SCOPE("halo.wait");
+    MPI_Waitall(requests_.size(), requests_.data(), MPI_STATUSES_IGNORE);
+    requests_.clear();
+    const size_type first = sub_->num_owned();
+    const long m = recv_.size();
+    #pragma omp parallel for schedule(static)
+    for (long j = 0; j < m; ++j)
+      set(first + j, recv_[j]);
+  }
+
+ private:
+  static int bytes(size_type count) {
+    return int(count * sizeof(T));
+  }
+
+  const Subdomain* sub_;
+  int tag_;
+  MPI_Comm comm_;
+  std::vector<T> send_;
+  std::vector<T> recv_;
+  std::vector<MPI_Request> requests_;
+};
+
+/** Collect get(l) of the own nodes of every process on @a root, by global
+ * index.
+ * @param[in] n The number of nodes of the whole graph.
+ * @return On @a root, a vector of size @a n, empty elsewhere.
+ *
+ * A collective call: every process of @a comm must make it.
+ */
+template <typename T, typename Get>
+std::vector<T> gather_globally(const Subdomain& sub, unsigned n, Get get,
+                               int root = 0, MPI_Comm comm = MPI_COMM_WORLD) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "gather_globally sends T as bytes");
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  const unsigned m = sub.num_owned();
+  std::vector<unsigned> ids(m);
+  std::vector<T> values(m);
+  for (unsigned l = 0; l < m; ++l) {
+    ids[l] = sub.global_index(l);
+    values[l] = get(l);
+  }
+
+  std::vector<int> counts(size), offsets(size + 1, 0);
+  int count = m;
+  MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, root, comm);
+  for (int p = 0; p < size; ++p)
+    offsets[p + 1] = offsets[p] + counts[p];
+  std::vector<unsigned> all_ids(rank == root ? offsets[size] : 0);
+  MPI_Gatherv(ids.data(), m, MPI_UNSIGNED, all_ids.data(), counts.data(),
+              offsets.data(), MPI_UNSIGNED, root, comm);
+  std::vector<int> byte_counts(size), byte_offsets(size);
+  for (int p = 0; p < size; ++p) {
+    byte_counts[p] = counts[p] * sizeof(T);
+    byte_offsets[p] = offsets[p] * sizeof(T);
+  }
+  std::vector<T> all_values(rank == root ? offsets[size] : 0);
+  MPI_Gatherv(values.data(), m * sizeof(T), MPI_BYTE, all_values.data(),
+              byte_counts.data(), byte_offsets.data(), MPI_BYTE, root, comm);
+
+  std::vector<T> result;
+  if (rank == root) {
+    assert(all_ids.size() == n);
+    result.resize(n);
+    for (unsigned k = 0; k < all_ids.size(); ++k)
+      result[all_ids[k]] = all_values[k];
+  }
+  return result;
+}
+
+
+/** @class DistributedMassSpring
+ * @brief Steps the MassSpringSystem of one subdomain's local graph together
+ *   with those of the other processes.
+ *
+ * The system must be built from Subdomain::local_graph(), with the same
+ * forces and fixed nodes on every process. After every step its own nodes
+ * match those of the undistributed system up to summation order, and its
+ * ghosts are copies of their owners' nodes. test_distributed checks this on
+ * grid1.
+ */
+class DistributedMassSpring {
+ public:
+  typedef MassSpringSystem::size_type size_type;
+
+  DistributedMassSpring(MassSpringSystem& s, const Subdomain& sub,
+                        MPI_Comm comm = MPI_COMM_WORLD)
+      : s_(&s), sub_(&sub), comm_(comm),
+        state_(sub, 0, comm), velocity_(sub, 1, comm) {
+    assert(s.size() == sub.size());
+  }
+
+  MassSpringSystem& system() {
+    return *s_;
+  }
+
+  /** MassSpringSystem::step() of the whole system.
+   * @return t + dt
+   *
+   * The own nodes with ghost neighbors go first and are sent off, the
+   * interior nodes are computed while they travel.
+   *
+   * Complexity: O(own nodes + their springs), in parallel, and one halo
+   * exchange.
+   */
+  template <typename E>
+  double step(double t, double dt, const ForceExpr<E>& force) {
+    CME212_PROFILE_SCOPE("ms.step");
+    MassSpringSystem& s = *s_;
+    s.prepare(force);
+    s.step_range(t, dt, force, 0, sub_->num_boundary());
+    state_.begin([&s](size_type l) {
+      return State{s.next_position(l), s.velocity(l)};
+    });
+    s.step_range(t, dt, force, sub_->num_boundary(), sub_->num_owned());
+    s.swap_positions();
+    state_.end([&s](size_type l, const State& x) {
+      s.position(l) = x.x;
+      s.velocity(l) = x.v;
+    });
+    return t + dt;
+  }
+
+  /** MassSpringSystem::stable_dt() of the whole system. Every spring is
+   * in the rows of the processes that own its nodes, so the smallest bound
+   * over the processes is the undistributed one. */
+  double stable_dt(double cfl = 0.5) const {
+    return all_min(s_->stable_dt(cfl), comm_);
+  }
+
+  /** MassSpringSystem::adaptive_dt() of the whole system, the same way. */
+  double adaptive_dt(double cfl = 0.5, double max_move = 0.1) const {
+    return all_min(s_->adaptive_dt(cfl, max_move), comm_);
+  }
+
+  /** Run @a collisions, e.g. a SelfCollisionPass, on the local system and
+   * refresh the velocities of the ghosts.
+   *
+   * Own nodes collide with own nodes and ghosts, so a collision is missed
+   * only between two nodes of different processes that are not connected
+   * by a spring but closer than their shortest springs.
+   */
+  template <typename Pass, typename Searcher>
+  void collide(Pass& collisions, const Searcher& searcher) {
+    MassSpringSystem& s = *s_;
+    collisions(s, searcher);
+    velocity_.begin([&s](size_type l) { return s.velocity(l); });
+    velocity_.end([&s](size_type l, const Point& v) { s.velocity(l) = v; });
+  }
+
+  /** Run @a constraints, e.g. a ConstraintPass, on the local system and
+   * refresh the positions and velocities of the ghosts.
+   *
+   * Ghosts near an obstacle are corrected here too, but only their owners'
+   * corrections are kept.
+   */
+  template <typename Pass, typename Searcher>
+  void constrain(Pass& constraints, const Searcher& searcher) {
+    MassSpringSystem& s = *s_;
+    constraints(s, searcher);
+    state_.begin([&s](size_type l) {
+      return State{s.position(l), s.velocity(l)};
+    });
+    state_.end([&s](size_type l, const State& x) {
+      s.position(l) = x.x;
+      s.velocity(l) = x.v;
+    });
+  }
+
+  /** Collect the positions and velocities of all nodes into @a g, the
+   * whole graph, on @a root. A collective call. */
+  template <typename G>
+  void store(G& g, int root = 0) const {
+    const MassSpringSystem& s = *s_;
+    std::vector<State> all = gather_globally<State>(*sub_, g.num_nodes(),
+        [&s](size_type l) { return State{s.position(l), s.velocity(l)}; },
+        root, comm_);
+    for (size_type i = 0; i < all.size(); ++i) {
+      auto node = g.node(i);
+      node.position() = all[i].x;
+      node.value().vel = all[i].v;
+    }
+  }
+
+ private:
+  struct State {
+    Point x;
+    Point v;
+  };
+
+  MassSpringSystem* s_;
+  const Subdomain* sub_;
+  MPI_Comm comm_;
+  HaloExchange<State> state_;
+  HaloExchange<Point> velocity_;
+};
+
+
+/** @class DistributedMatrix
+ * @brief y = A x for the rows of a subdomain's own nodes, A being any
+ *   matrix with mult_rows() and diagonal(), like GraphSymmetricMatrix, of
+ *   the subdomain's local graph.
+ *
+ * Vectors are indexed like the local graph. Own rows of the local matrix
+ * see all of their neighbors, so they are the rows of the matrix of the
+ * whole graph; ghost rows are never used.
+ */
+template <typename Matrix>
+class DistributedMatrix {
+ public:
+  typedef Subdomain::size_type size_type;
+
+  DistributedMatrix(const Matrix& A, const Subdomain& sub,
+                    MPI_Comm comm = MPI_COMM_WORLD)
+      : A_(&A), sub_(&sub), comm_(comm), halo_(sub, 2, comm) {
+  }
+
+  const Subdomain& subdomain() const {
+    return *sub_;
+  }
+  MPI_Comm comm() const {
+    return comm_;
+  }
+
+  /** Set the own entries of @a y to (A x) and the ghosts of @a x to their
+   * owners' values: the ghosts of @a x are filled in while the interior
+   * rows are computed, then the rows next to them.
+   * @pre @a x and @a y have sub.size() entries */
+  void mult(std::vector<double>& x, std::vector<double>& y) {
+    CME212_PROFILE_SCOPE("poisson.matvec");
+    const Subdomain& s = *sub_;
+    halo_.begin([&x](size_type l) { return x[l]; });
+    A_->mult_rows(x, y, detail::assign_copy(), s.num_boundary(),
+                  s.num_owned());
+    halo_.end([&x](size_type l, double v) { x[l] = v; });
+    A_->mult_rows(x, y, detail::assign_copy(), 0, s.num_boundary());
+  }
+
+  double diagonal(size_type l) const {
+    return A_->diagonal(l);
+  }
+
+ private:
+  const Matrix* A_;
+  const Subdomain* sub_;
+  MPI_Comm comm_;
+  HaloExchange<double> halo_;
+};
+
+/** Solve A @a x = @a b on the whole graph by Jacobi preconditioned CG.
+ * @param[in,out] x The initial guess, then the solution, at the own nodes.
+ * @param[in]     b The right-hand side at the own nodes.
+ * @param[in] rtol  Stop once the residual is below rtol times norm(b).
+ * @return The number of iterations.
+ *
+ * A collective call. The multigrid and IC(0) preconditioners of
+ * GraphSymmetricMatrix.hpp sweep the rows in order, which doesn't
+ * distribute; the diagonal one needs no communication. Each iteration
+ * takes two reductions: p.q, then r.r and r.z together.
+ */
+template <typename Matrix>
+int distributed_cg(DistributedMatrix<Matrix>& A, std::vector<double>& x,
+                   const std::vector<double>& b, double rtol, int max_iter) {
+  CME212_PROFILE_SCOPE("poisson.cg");
+  const Subdomain& sub = A.subdomain();
+  const long n = sub.num_owned();
+  assert(x.size() == sub.size() and b.size() >= size_t(n));
+  std::vector<double> r(n), z(n), p(sub.size()), q(sub.size()), inv_diag(n);
+  auto dot = [&](const std::vector<double>& u, const std::vector<double>& v) {
+    double sum = 0;
+    #pragma omp parallel for schedule(static) reduction(+:sum)
+    for (long i = 0; i < n; ++i)
+      sum += u[i] * v[i];
+    return all_sum(sum, A.comm());
+  };
+
+  A.mult(x, q);
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; ++i) {
+    inv_diag[i] = 1.0 / A.diagonal(i);
+    r[i] = b[i] - q[i];
+    z[i] = p[i] = inv_diag[i] * r[i];
+  }
+  // sums[0] = r.r, sums[1] = r.z, reduced together
+  double sums[2] = {dot(r, r), dot(r, z)};
+  const double stop = rtol * rtol * dot(b, b);
+  int iter = 0;
+  profile::LapTimer lap("poisson.cg_iteration");
+  for (; iter < max_iter and sums[0] > stop; ++iter) {
+    A.mult(p, q);
+    const double rz = sums[1];
+    const double alpha = rz / dot(p, q);
+    double rr = 0, rz_next = 0;
+    #pragma omp parallel for schedule(static) reduction(+:rr,rz_next)
+    for (long i = 0; i < n; ++i) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * q[i];
+      z[i] = inv_diag[i] * r[i];
+      rr += r[i] * r[i];
+      rz_next += r[i] * z[i];
+    }
+    sums[0] = rr;
+    sums[1] = rz_next;
+    all_sum(sums, 2, A.comm());
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i)
+      p[i] = z[i] + (sums[1] / rz) * p[i];
+    lap.lap();
+  }
+  return iter;
+}
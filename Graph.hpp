@@ -6,15 +6,18 @@
  */
 
 #include <algorithm>
+#include <array>
 #include <vector>
 #include <map>
 #include <cassert>
+#include <cstdint>
 #include <thrust/iterator/transform_iterator.h>
 #include <thrust/iterator/counting_iterator.h>
 #include <thrust/functional.h>
 
 #include "CME212/Util.hpp"
 #include "CME212/Point.hpp"
+#include "RowArena.hpp"
 
 
 /** @class Graph
@@ -54,7 +57,7 @@ public:
   typedef NodeIterator node_iterator;
 
   /** Type of edge iterators, which iterate over all graph edges. */
-  class EdgeIterator;
+  struct EdgeIterator;
   /** Synonym for EdgeIterator */
   typedef EdgeIterator edge_iterator;
 
@@ -70,11 +73,81 @@ public:
 
 
 private:
-   /** A vector of all nodes' positions, and the element's index is the node_id_. */
-   std::vector<std::pair<Point*, node_value_type>> nodes_;
+   /** A contiguous vector of all nodes' positions, indexed by node_id_. */
+   std::vector<Point> positions_;
+
+   /** A contiguous vector of all nodes' values, indexed by node_id_. */
+   std::vector<node_value_type> values_;
+
+   /** A node's connections: (neighbor id, edge value) pairs. */
+   typedef std::pair<size_type, edge_value_type> adj_type;
+
+   /** Every node's connections, row i holding those of node i. The rows
+    *  are cut from a few large pages rather than being a vector each, so
+    *  building a large graph with add_edge doesn't make millions of small
+    *  allocations. Empty while frozen. */
+   RowArena<adj_type> adjacency_;
+
+   /** Capacity given to new rows, see reserve(). */
+   size_type row_reserve_;
+
+   /** Compressed sparse row copy of adjacency_, valid only while frozen_.
+    *  The connections of node i are stored, in the same order as in
+    *  adjacency_[i], at positions [csr_offsets_[i], csr_offsets_[i+1]) of
+    *  csr_neighbors_ and csr_values_. */
+   bool frozen_;
+   std::vector<size_type> csr_offsets_;
+   std::vector<size_type> csr_neighbors_;
+   std::vector<edge_value_type> csr_values_;
+
+   /** Return the number of connections of node @a n. */
+   size_type adj_size(size_type n) const {
+     if(frozen_) return csr_offsets_[n + 1] - csr_offsets_[n];
+     return adjacency_[n].size();
+   }
+
+   /** Return the id of the @a k-th node adjacent to node @a n. */
+   size_type adj_node(size_type n, size_type k) const {
+     if(frozen_) return csr_neighbors_[csr_offsets_[n] + k];
+     return adjacency_[n][k].first;
+   }
 
-   /** A vector storing every node's connections. */
-   std::vector<std::vector<std::pair<size_type, edge_value_type>>> adjacency_;
+   /** Return the value of the @a k-th edge incident to node @a n. */
+   edge_value_type& adj_value(size_type n, size_type k) {
+     if(frozen_) return csr_values_[csr_offsets_[n] + k];
+     return adjacency_[n][k].second;
+   }
+
+   const edge_value_type& adj_value(size_type n, size_type k) const {
+     if(frozen_) return csr_values_[csr_offsets_[n] + k];
+     return adjacency_[n][k].second;
+   }
+
+   /** The number of undirected edges, maintained by every topology change. */
+   size_type num_edges_;
+
+   /** Edge index: edge(i) connects node edge_table_[i].first to its
+    *  edge_table_[i].second-th neighbor. Rebuilt lazily after the topology
+    *  has changed, which is what edge_table_valid_ tracks. */
+   mutable std::vector<std::pair<size_type, size_type>> edge_table_;
+   mutable bool edge_table_valid_;
+
+   /** Return the edge index, rebuilding it first if it is stale.
+    *  Edges are listed by increasing node1, and each undirected edge
+    *  appears once, from its lower-indexed endpoint. */
+   const std::vector<std::pair<size_type, size_type>>& edge_table() const {
+     if(!edge_table_valid_){
+       edge_table_.clear();
+       edge_table_.reserve(num_edges_);
+       for(size_type i = 0; i < size(); ++i){
+         for(size_type k = 0; k < adj_size(i); ++k){
+           if(i < adj_node(i, k)) edge_table_.push_back(std::make_pair(i, k));
+         }
+       }
+       edge_table_valid_ = true;
+     }
+     return edge_table_;
+   }
 
  public:
 
@@ -86,8 +159,10 @@ private:
   /** Construct an empty graph. */
   Graph()
   // Initialize the private attributes of a graph,with no nodes and no edges.
-    : nodes_(std::vector<std::pair<Point*, node_value_type>>(0)),
-    adjacency_(std::vector<std::vector<std::pair<size_type, edge_value_type>>>(0)){
+    : positions_(std::vector<Point>(0)),
+    values_(std::vector<node_value_type>(0)),
+    adjacency_(), row_reserve_(0),
+    frozen_(false), num_edges_(0), edge_table_valid_(false){
 
   }
 
@@ -128,13 +203,13 @@ private:
     /** Return this node's position, whcih can be modified.*/
     Point& position(){
       assert(this->graph_ != NULL);
-      return *((*graph_).nodes_[node_id_].first);
+      return (*graph_).positions_[node_id_];
     }
 
     /** Return this node's position. */
     const Point& position() const{
       assert(this->graph_ != NULL);
-      return *((*graph_).nodes_[node_id_].first);
+      return (*graph_).positions_[node_id_];
     }
 
     /** Return this node's index, a number in the range [0, graph_size_). */
@@ -181,7 +256,7 @@ private:
      */
     node_value_type& value(){
       assert(this->graph_ != NULL);
-      return (*graph_).nodes_[node_id_].second;
+      return (*graph_).values_[node_id_];
     }
 
     /** Non-const version of this node's value,
@@ -189,14 +264,14 @@ private:
      */
     const node_value_type& value() const {
       assert(this->graph_ != NULL);
-      return (*graph_).nodes_[node_id_].second;
+      return (*graph_).values_[node_id_];
     }
 
     /** Take a look at the adjacency table,
      *  return the number of nodes adjacent to the current node.
      */
     size_type degree() const{
-      return graph_->adjacency_[node_id_].size();
+      return graph_->adj_size(node_id_);
     }
 
     /** Return the incident-iterator related to the current node.
@@ -215,7 +290,7 @@ private:
      *  edge of the incident iterator.
      */
     incident_iterator edge_end() const {
-      size_type incnum = graph_->adjacency_[node_id_].size();
+      size_type incnum = graph_->adj_size(node_id_);
       incident_iterator ii = IncidentIterator(graph_, node_id_, incnum);
       return ii;
     }
@@ -229,7 +304,7 @@ private:
    * Complexity: O(1).
    */
   size_type size() const {
-    return nodes_.size();
+    return positions_.size();
   }
 
   /** Synonym for size(). */
@@ -246,16 +321,7 @@ private:
    * Complexity: O(1) amortized operations.
    */
   Node add_node(const Point& position) {
-    Point *curpoint = new Point;
-    *curpoint = position;
-    node_value_type innervalue = node_value_type();
-    std::pair<Point*, node_value_type> curnode(curpoint, innervalue);
-    nodes_.push_back(curnode);
-    /** Update the attributes of graph. */
-    std::vector<std::pair<size_type, edge_value_type>> curadj;
-    adjacency_.push_back(curadj);
-    return Node(this, size() - 1);
-    return Node();
+    return add_node(position, node_value_type());
   }
 
   /** Add a node to the graph, returning the added node.
@@ -268,13 +334,15 @@ private:
    * Complexity: O(1) amortized operations.
    */
   Node add_node(const Point& position, const node_value_type& innervalue) {
-    Point *curpoint = new Point;
-    *curpoint = position;
-    std::pair<Point*, node_value_type> curnode(curpoint, innervalue);
-    nodes_.push_back(curnode);
-    /** Update the attributes of graph. */
-    std::vector<std::pair<size_type, edge_value_type>> curadj;
-    adjacency_.push_back(curadj);
+    positions_.push_back(position);
+    values_.push_back(innervalue);
+    /** Update the attributes of graph. A frozen graph just gets an empty row. */
+    if(frozen_){
+      csr_offsets_.push_back(csr_offsets_.back());
+    }
+    else{
+      adjacency_.add_row(row_reserve_);
+    }
     return Node(this, size() - 1);
     return Node();
   }
@@ -317,10 +385,15 @@ private:
   void remove_node(const Node& n){
     assert(has_node(n));
     auto g = n.graph_;
+    g->thaw();
+    g->num_edges_ -= n.degree();
+    g->edge_table_valid_ = false;
     auto nid = n.node_id_;
     auto lid = g->size() - 1;
-    g->nodes_[nid] = g->nodes_[lid];
-    g->nodes_.pop_back();
+    g->positions_[nid] = g->positions_[lid];
+    g->positions_.pop_back();
+    g->values_[nid] = g->values_[lid];
+    g->values_.pop_back();
     for(size_type i = 0; i < g->adjacency_[nid].size(); ++i){
       size_type oid = g->adjacency_[nid][i].first;
       for(size_type j = 0; j < g->adjacency_[oid].size(); ++j){
@@ -330,8 +403,10 @@ private:
         }
       }
     }
-    g->adjacency_[nid] = g->adjacency_[lid];
-    g->adjacency_.pop_back();
+    g->adjacency_.swap_rows(nid, lid);
+    g->adjacency_.pop_row();
+    // If n was the last node there is nothing left to renumber.
+    if(nid == lid) return;
     for(size_type i = 0; i < g->adjacency_[nid].size(); ++i){
       size_type loid = g->adjacency_[nid][i].first;
       for(size_type j = 0; j < g->adjacency_[loid].size(); ++j){
@@ -350,6 +425,108 @@ private:
     return n_it;
   }
 
+  /** Remove every node for which @a pred returns true, and its edges.
+   * @param[in] pred Callable as pred(node_type) -> bool. It is evaluated
+   *                 once per node, possibly concurrently, before anything
+   *                 is removed.
+   * @return The old to new index map: result[i] is the new index of the
+   *         node that had index i, or size_type(-1) if it was removed.
+   * @post The remaining nodes keep their relative order, values and edges.
+   *
+   * Unlike repeated remove_node, nodes are only compacted once and every
+   * adjacency row is filtered and renumbered in a single parallel pass. The
+   * frozen state is kept. Invalidates all outstanding Node and Edge objects
+   * and iterators.
+   *
+   * Complexity: O(num_nodes() + num_edges()).
+   */
+  template <typename Pred>
+  std::vector<size_type> remove_nodes_if(Pred pred) {
+    const size_type n = size();
+    const size_type removed = size_type(-1);
+    std::vector<size_type> new_id(n);
+    #pragma omp parallel for schedule(static)
+    for(size_type i = 0; i < n; ++i){
+      new_id[i] = pred(node(i)) ? removed : 0;
+    }
+    size_type m = 0;
+    for(size_type i = 0; i < n; ++i){
+      if(new_id[i] != removed) new_id[i] = m++;
+    }
+    if(m == n) return new_id;
+
+    for(size_type i = 0; i < n; ++i){
+      if(new_id[i] != removed && new_id[i] != i){
+        positions_[new_id[i]] = positions_[i];
+        values_[new_id[i]] = values_[i];
+      }
+    }
+    positions_.resize(m);
+    values_.resize(m);
+
+    if(frozen_){
+      // Kept neighbors of each kept node, then compacted rows.
+      std::vector<size_type> offsets(m + 1, 0);
+      #pragma omp parallel for schedule(static)
+      for(size_type i = 0; i < n; ++i){
+        if(new_id[i] == removed) continue;
+        size_type d = 0;
+        for(size_type p = csr_offsets_[i]; p < csr_offsets_[i + 1]; ++p){
+          d += (new_id[csr_neighbors_[p]] != removed);
+        }
+        offsets[new_id[i] + 1] = d;
+      }
+      for(size_type i = 0; i < m; ++i){
+        offsets[i + 1] += offsets[i];
+      }
+      std::vector<size_type> neighbors(offsets[m]);
+      std::vector<edge_value_type> edge_values(offsets[m]);
+      #pragma omp parallel for schedule(static)
+      for(size_type i = 0; i < n; ++i){
+        if(new_id[i] == removed) continue;
+        size_type q = offsets[new_id[i]];
+        for(size_type p = csr_offsets_[i]; p < csr_offsets_[i + 1]; ++p){
+          size_type j = new_id[csr_neighbors_[p]];
+          if(j == removed) continue;
+          neighbors[q] = j;
+          edge_values[q] = csr_values_[p];
+          ++q;
+        }
+      }
+      csr_offsets_.swap(offsets);
+      csr_neighbors_.swap(neighbors);
+      csr_values_.swap(edge_values);
+      num_edges_ = csr_offsets_[m] / 2;
+    } else {
+      size_type total = 0;
+      #pragma omp parallel for schedule(static) reduction(+:total)
+      for(size_type i = 0; i < n; ++i){
+        auto row = adjacency_[i];
+        if(new_id[i] == removed){
+          // Its block is freed by the resize below, which isn't thread safe.
+          row.clear();
+          continue;
+        }
+        size_type d = 0;
+        for(auto& adj : row){
+          size_type j = new_id[adj.first];
+          if(j != removed) row[d++] = std::make_pair(j, adj.second);
+        }
+        row.resize(d);
+        total += d;
+      }
+      for(size_type i = 0; i < n; ++i){
+        if(new_id[i] != removed && new_id[i] != i){
+          adjacency_.swap_rows(new_id[i], i);
+        }
+      }
+      adjacency_.resize(m);
+      num_edges_ = total / 2;
+    }
+    edge_table_valid_ = false;
+    return new_id;
+  }
+
   //
   // EDGES
   //
@@ -379,7 +556,7 @@ private:
 
   size_type Node2Id() const{
     assert(this->graph_ != NULL);
-    return graph_->adjacency_[node1_id_][node2_vecid_].first;
+    return graph_->adj_node(node1_id_, node2_vecid_);
   }
 
   /** Return a node of this Edge */
@@ -432,7 +609,7 @@ private:
    */
   edge_value_type& value(){
     assert(this->graph_ != NULL);
-    return (*graph_).adjacency_[node1_id_][node2_vecid_].second;
+    return (*graph_).adj_value(node1_id_, node2_vecid_);
   }
 
   /** Const version of this edge's value,
@@ -440,7 +617,7 @@ private:
    */
    const edge_value_type& value() const{
      assert(this->graph_ != NULL);
-     return (*graph_).adjacency_[node1_id_][node2_vecid_].second;
+     return (*graph_).adj_value(node1_id_, node2_vecid_);
    }
 
   double length() const{
@@ -448,10 +625,10 @@ private:
   }
 
   Edge dual() const{
-    size_type node2id = graph_->adjacency_[node1_id_][node2_vecid_].first;
+    size_type node2id = graph_->adj_node(node1_id_, node2_vecid_);
     size_type p = 0;
-    for(; p < graph_->adjacency_[node2id].size(); ++p){
-      if(graph_->adjacency_[node2id][p].first == node1_id_){
+    for(; p < graph_->adj_size(node2id); ++p){
+      if(graph_->adj_node(node2id, p) == node1_id_){
         return Edge(graph_, node2id, p);
       }
     }
@@ -467,21 +644,21 @@ private:
    * Complexity: O(1)
    */
   size_type num_edges() const {
-    size_type numedges = 0;
-    for(auto i : adjacency_){
-      numedges += i.size();
-    }
-    return numedges/2;
+    return num_edges_;
   }
 
   /** Return the edge with index @a i.
    * @pre 0 <= @a i < num_edges()
    *
-   * Complexity: O(1)
+   * Complexity: O(1), plus a one-off O(num_nodes() + num_edges()) rebuild of
+   * the edge index on the first call after the topology has changed. The
+   * rebuild is not thread safe; edge_begin() performs it up front, so
+   * parallel loops over [edge_begin(), edge_end()) are fine.
    */
    Edge edge(size_type i) const {
      assert(i < num_edges());
-     return *std::next(edge_begin(), i);
+     const auto& et = edge_table();
+     return Edge(this, et[i].first, et[i].second);
    }
 
   /** Test whether two nodes are connected by an edge.
@@ -498,7 +675,7 @@ private:
     size_type deg = a.degree();
 
     for(size_type i = 0; i < deg; ++i){
-      if(adjacency_[aid][i].first == bid) return true;
+      if(adj_node(aid, i) == bid) return true;
     }
     return false;
   }
@@ -524,8 +701,11 @@ private:
     size_type deg = a.degree();
 
     for(size_type i = 0; i < deg; ++i){
-      if(adjacency_[aid][i].first == bid) return Edge(this, aid, i);
+      if(adj_node(aid, i) == bid) return Edge(this, aid, i);
     }
+    thaw();
+    ++num_edges_;
+    edge_table_valid_ = false;
 
     /** If there isn't such an edge, create one, update the attributes of the graph,
      * then return this newly created edge. */
@@ -549,6 +729,9 @@ private:
     */
   bool remove_edge(const Node& a, const Node& b){
     if(!has_edge(a, b)) return false;
+    thaw();
+    --num_edges_;
+    edge_table_valid_ = false;
     size_type aid = a.node_id_;
     size_type bid = b.node_id_;
     for(size_type i = 0; i < adjacency_[aid].size(); ++i){
@@ -572,13 +755,16 @@ private:
     return remove_edge(n1, n2);
   }
 
-  /** Use edge_iterator to remove edge and return an edge_iterator,
-    * which should be fixed after removing.
+  /** Use edge_iterator to remove edge and return an edge_iterator
+    * to the edge following it.
+    *
+    * Removal only swaps entries after the removed one in the adjacency, so
+    * the rebuilt edge index keeps every edge before @a e_it in place and the
+    * same position now refers to the next remaining edge.
     */
   edge_iterator remove_edge(edge_iterator e_it){
     auto e = *e_it;
     remove_edge(e);
-    e_it.fix();
     return e_it;
   }
 
@@ -589,8 +775,269 @@ private:
    * Invalidates all outstanding Node and Edge objects.
    */
   void clear() {
-    nodes_.clear();
+    positions_.clear();
+    values_.clear();
     adjacency_.clear();
+    num_edges_ = 0;
+    edge_table_valid_ = false;
+    frozen_ = false;
+    csr_offsets_.clear();
+    csr_neighbors_.clear();
+    csr_values_.clear();
+  }
+
+  /** Make room for @a nodes nodes with about @a avg_degree incident edges
+   * each, so that building the graph with add_node and add_edge doesn't
+   * reallocate as it grows.
+   * @post Rows of nodes added from now on, and rows rebuilt by thaw(), start
+   *       with room for @a avg_degree connections.
+   *
+   * Rows of an unfrozen graph that are created with room for their edges
+   * are laid out in node order, as in the frozen layout.
+   *
+   * Complexity: O(num_nodes()) amortized operations.
+   */
+  void reserve(size_type nodes, size_type avg_degree = 0) {
+    positions_.reserve(nodes);
+    values_.reserve(nodes);
+    row_reserve_ = avg_degree;
+    if(frozen_){
+      csr_offsets_.reserve(nodes + 1);
+    }
+    else{
+      adjacency_.reserve(nodes, std::size_t(nodes) * avg_degree);
+      for(size_type i = 0; i < size(); ++i){
+        adjacency_[i].reserve(avg_degree);
+      }
+    }
+  }
+
+  /** Replace the contents of this graph with a tetrahedral mesh.
+   * @param[in] points       Node positions; node i is at @a points[i]
+   * @param[in] tets         Four node indices per tetrahedron
+   * @param[in] edge_pattern Pairs of tet corners (0-3) to connect. The
+   *                         default connects all six pairs.
+   * @pre Every index in @a tets is less than @a points.size().
+   * @post num_nodes() == @a points.size() and the edges are exactly the
+   *       distinct pairs given by @a edge_pattern over all @a tets, with
+   *       default node and edge values.
+   * @post is_frozen() == true
+   *
+   * Equivalent to clear() followed by add_node for every point and add_edge
+   * for every pattern pair of every tet, without the per-edge duplicate
+   * scans: candidate edges are bucketed by their smaller node with a
+   * counting sort, each bucket is sorted and deduplicated in parallel, and
+   * the CSR arrays are filled at their exact sizes.
+   *
+   * Complexity: O(num_nodes() + T + E log(max degree)) for
+   * T == tets.size() * edge_pattern.size() and E == num_edges().
+   */
+  void build_from_tets(const std::vector<Point>& points,
+                       const std::vector<std::array<size_type, 4>>& tets,
+                       const std::vector<std::pair<int, int>>& edge_pattern
+                         = {{0,1}, {0,2}, {0,3}, {1,2}, {1,3}, {2,3}}) {
+    clear();
+    const size_type n = points.size();
+    positions_ = points;
+    values_.assign(n, node_value_type());
+
+    // Bucket every candidate edge (a, b), a < b, under a.
+    std::vector<size_type> start(n + 1, 0);
+    for(auto& t : tets){
+      for(auto& pr : edge_pattern){
+        size_type a = t[pr.first], b = t[pr.second];
+        assert(a < n && b < n);
+        if(a != b) ++start[std::min(a, b) + 1];
+      }
+    }
+    for(size_type i = 0; i < n; ++i){
+      start[i + 1] += start[i];
+    }
+    std::vector<size_type> bucket(start[n]);
+    std::vector<size_type> fill(start.begin(), start.end() - 1);
+    for(auto& t : tets){
+      for(auto& pr : edge_pattern){
+        size_type a = t[pr.first], b = t[pr.second];
+        if(a < b) bucket[fill[a]++] = b;
+        else if(b < a) bucket[fill[b]++] = a;
+      }
+    }
+
+    // Sort and deduplicate each bucket: node i's neighbors above i.
+    std::vector<size_type> upper(n);
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(size_type i = 0; i < n; ++i){
+      auto first = bucket.begin() + start[i], last = bucket.begin() + start[i + 1];
+      std::sort(first, last);
+      upper[i] = std::unique(first, last) - first;
+    }
+
+    // Row i holds its neighbors below i, then the ones above, both sorted.
+    std::vector<size_type> lower(n, 0);
+    for(size_type a = 0; a < n; ++a){
+      for(size_type k = 0; k < upper[a]; ++k){
+        ++lower[bucket[start[a] + k]];
+      }
+    }
+    csr_offsets_.assign(n + 1, 0);
+    for(size_type i = 0; i < n; ++i){
+      csr_offsets_[i + 1] = csr_offsets_[i] + lower[i] + upper[i];
+    }
+    num_edges_ = csr_offsets_[n] / 2;
+    csr_neighbors_.resize(csr_offsets_[n]);
+    csr_values_.assign(csr_offsets_[n], edge_value_type());
+    #pragma omp parallel for schedule(static)
+    for(size_type i = 0; i < n; ++i){
+      std::copy(bucket.begin() + start[i], bucket.begin() + start[i] + upper[i],
+                csr_neighbors_.begin() + csr_offsets_[i] + lower[i]);
+    }
+    // Visiting a in increasing order keeps the lower parts sorted.
+    std::vector<size_type> cursor(csr_offsets_.begin(), csr_offsets_.end() - 1);
+    for(size_type a = 0; a < n; ++a){
+      for(size_type k = 0; k < upper[a]; ++k){
+        csr_neighbors_[cursor[bucket[start[a] + k]]++] = a;
+      }
+    }
+    // The per-node vectors stay empty while frozen.
+    adjacency_.clear();
+    frozen_ = true;
+  }
+
+  /** Pack the adjacency into a compressed sparse row layout.
+   * @post is_frozen() == true
+   *
+   * Use this once the topology stops changing: incident and edge iteration
+   * then walk a few contiguous arrays instead of one vector per node. Nodes,
+   * edges, their values and outstanding iterators are unaffected. Any call
+   * that changes the topology (add_edge of a new edge, remove_edge,
+   * remove_node) transparently thaws the graph first; add_node does not.
+   *
+   * Complexity: O(num_nodes() + num_edges()).
+   */
+  void freeze() {
+    if(frozen_) return;
+    size_type n = size();
+    csr_offsets_.assign(n + 1, 0);
+    for(size_type i = 0; i < n; ++i){
+      csr_offsets_[i + 1] = csr_offsets_[i] + adjacency_[i].size();
+    }
+    csr_neighbors_.resize(csr_offsets_[n]);
+    csr_values_.resize(csr_offsets_[n]);
+    for(size_type i = 0; i < n; ++i){
+      size_type p = csr_offsets_[i];
+      for(auto& adj : adjacency_[i]){
+        csr_neighbors_[p] = adj.first;
+        csr_values_[p] = adj.second;
+        ++p;
+      }
+    }
+    // Release the per-node vectors, the CSR arrays are now the only copy.
+    RowArena<adj_type>().swap(adjacency_);
+    frozen_ = true;
+  }
+
+  /** Unpack a frozen graph back into per-node adjacency vectors.
+   * @post is_frozen() == false
+   *
+   * Complexity: O(num_nodes() + num_edges()).
+   */
+  void thaw() {
+    if(!frozen_) return;
+    size_type n = size();
+    adjacency_.reserve(n, csr_offsets_[n]);
+    for(size_type i = 0; i < n; ++i){
+      adjacency_.add_row(std::max(csr_offsets_[i + 1] - csr_offsets_[i],
+                                  row_reserve_));
+      for(size_type p = csr_offsets_[i]; p < csr_offsets_[i + 1]; ++p){
+        adjacency_[i].push_back(std::make_pair(csr_neighbors_[p], csr_values_[p]));
+      }
+    }
+    frozen_ = false;
+    std::vector<size_type>().swap(csr_offsets_);
+    std::vector<size_type>().swap(csr_neighbors_);
+    std::vector<edge_value_type>().swap(csr_values_);
+  }
+
+  /** Return true if the adjacency is currently stored in CSR form. */
+  bool is_frozen() const {
+    return frozen_;
+  }
+
+  /** Renumber the nodes: the node with old index @a order[i] gets index i.
+   * @pre @a order is a permutation of [0, num_nodes())
+   * @post For all i, node(i) has the position, value and incident edges
+   *       (with their values) of the old node(@a order[i]).
+   *
+   * Positions, values and adjacency rows are gathered in one pass and every
+   * neighbor id is remapped on the way, with each row sorted by neighbor so
+   * incident iteration walks memory in order too. The frozen state is kept.
+   * Invalidates all outstanding Node and Edge objects and iterators.
+   *
+   * Complexity: O(num_nodes() + num_edges() log(max degree)).
+   */
+  void reorder(const std::vector<size_type>& order) {
+    const size_type n = size();
+    assert(order.size() == n);
+    // rank[old id] == new id
+    std::vector<size_type> rank(n, size_type(-1));
+    for(size_type i = 0; i < n; ++i){
+      assert(order[i] < n && rank[order[i]] == size_type(-1));
+      rank[order[i]] = i;
+    }
+
+    std::vector<Point> positions(n);
+    std::vector<node_value_type> values(n);
+    #pragma omp parallel for
+    for(size_type i = 0; i < n; ++i){
+      positions[i] = positions_[order[i]];
+      values[i] = values_[order[i]];
+    }
+    positions_.swap(positions);
+    values_.swap(values);
+
+    auto by_node = [](const adj_type& a, const adj_type& b){
+      return a.first < b.first;
+    };
+    if(frozen_){
+      std::vector<size_type> offsets(n + 1, 0);
+      for(size_type i = 0; i < n; ++i){
+        offsets[i + 1] = offsets[i] + adj_size(order[i]);
+      }
+      std::vector<size_type> neighbors(offsets[n]);
+      std::vector<edge_value_type> edge_values(offsets[n]);
+      #pragma omp parallel
+      {
+        std::vector<adj_type> row;
+        #pragma omp for schedule(static)
+        for(size_type i = 0; i < n; ++i){
+          row.clear();
+          for(size_type p = csr_offsets_[order[i]]; p < csr_offsets_[order[i] + 1]; ++p){
+            row.push_back(adj_type(rank[csr_neighbors_[p]], csr_values_[p]));
+          }
+          std::sort(row.begin(), row.end(), by_node);
+          size_type p = offsets[i];
+          for(auto& adj : row){
+            neighbors[p] = adj.first;
+            edge_values[p] = adj.second;
+            ++p;
+          }
+        }
+      }
+      csr_offsets_.swap(offsets);
+      csr_neighbors_.swap(neighbors);
+      csr_values_.swap(edge_values);
+    } else {
+      adjacency_.permute(order);
+      #pragma omp parallel for
+      for(size_type i = 0; i < n; ++i){
+        auto row = adjacency_[i];
+        for(auto& adj : row){
+          adj.first = rank[adj.first];
+        }
+        std::sort(row.begin(), row.end(), by_node);
+      }
+    }
+    edge_table_valid_ = false;
   }
 
   //
@@ -629,77 +1076,33 @@ private:
   // Edge Iterator
   //
 
-  /** @class Graph::EdgeIterator
-   * @brief Iterator class for edges. A forward iterator. */
-  class EdgeIterator: private totally_ordered <EdgeIterator> {
-  private:
-    /** Store the pointer to graph and the edgeindex to get access to the edges
-     *  and iterate through.
-     */
+  /** The functor which takes the edge index and returns the corresponding edge */
+  struct whatedge : public thrust::unary_function<size_type, edge_type>{
     Graph* graph_;
-    size_type center_;
-    size_type outid_;
-
-    /** Construct a valid EdgeIterator. */
-    EdgeIterator(const Graph* graph, size_type center, size_type outid)
-      : graph_(const_cast<Graph*>(graph)), center_(center), outid_(outid){}
-   public:
-    // These type definitions help us use STL's iterator_traits.
-    /** Element type. */
-    typedef Edge value_type;
-    /** Type of pointers to elements. */
-    typedef Edge* pointer;
-    /** Type of references to elements. */
-    typedef Edge& reference;
-    /** Iterator category. */
-    typedef std::input_iterator_tag iterator_category;
-    /** Difference between iterators */
-    typedef std::ptrdiff_t difference_type;
-
-    /** Construct an invalid EdgeIterator. */
-    EdgeIterator() {
-    }
-
-    Edge operator*() const {
-      return Edge(graph_, center_, outid_);
-    }
-
-    EdgeIterator& operator++() {
-      ++outid_;
-      fix();
-      return *this;
+    whatedge(const Graph* graph) : graph_(const_cast<Graph*>(graph)) {}
+    edge_type operator()(size_type i) const {
+      return graph_->edge(i);
     }
-
-    bool operator==(const EdgeIterator& ei) const {
-      return (graph_ == ei. graph_ and center_ == ei.center_ and outid_ == outid_);
-    }
-
-    void fix() {
-      while (center_ < graph_->adjacency_.size()) {
-        while (outid_ < graph_->adjacency_[center_].size()) {
-          if (center_ < graph_->adjacency_[center_][outid_].first) {
-            return;
-          }
-          ++outid_;
-        }
-        ++center_;
-        outid_ = 0;
-      }
-      return;
-    }
-
-    friend class Graph;
+  };
+  /** @struct Graph::EdgeIterator
+   * @brief Iterator class for edges. A random access iterator over the
+   *        edge index, so it can be handed to parallel algorithms. */
+  struct EdgeIterator : thrust::transform_iterator<whatedge, thrust::counting_iterator<size_type>, Edge> {
+    using EdgeIterator::transform_iterator::transform_iterator;
+    EdgeIterator(const graph_type* g, size_type uid)
+      : EdgeIterator::transform_iterator(thrust::make_counting_iterator(uid), whatedge(g)){}
   };
 
-  // Iterate the first edge.
+  // Iterate the first edge. Also brings the edge index up to date.
   edge_iterator edge_begin() const {
-    edge_iterator ei = EdgeIterator(this, 0, 0);
+    edge_table();
+    edge_iterator ei = EdgeIterator(this, 0);
     return ei;
   }
 
   // Iterate the last edge.
   edge_iterator edge_end() const {
-    edge_iterator ei = EdgeIterator(this, this->adjacency_.size(), 0);
+    edge_iterator ei = EdgeIterator(this, num_edges());
     return ei;
   }
 
@@ -757,6 +1160,285 @@ private:
 
   };
 
+  //
+  // Views
+  //
+
+  /** @class Graph::View
+   * @brief The subgraph induced by the nodes satisfying a predicate.
+   *
+   * Made by Graph::view(). The predicate is evaluated once, into one bit per
+   * node; iterating the view then skips 64 filtered-out nodes per word and
+   * never hands out an edge with a filtered-out endpoint. Nodes and edges of
+   * a view are those of the graph, so their values can be changed through it.
+   *
+   * A view is a snapshot: it is invalidated by any change to the graph's
+   * nodes or edges, like an outstanding Node.
+   */
+  class View {
+   public:
+    class NodeIterator;
+    class EdgeIterator;
+    typedef NodeIterator node_iterator;
+    typedef EdgeIterator edge_iterator;
+
+    /** Return true if node @a i of the graph is in this view. */
+    bool contains(size_type i) const {
+      assert(i < graph_->size());
+      return (bits_[i / 64] >> (i % 64)) & 1;
+    }
+    bool contains(const Node& n) const {
+      return n.graph_ == graph_ and contains(n.node_id_);
+    }
+
+    /** Return the number of nodes in this view. Complexity: O(1). */
+    size_type num_nodes() const {
+      return num_nodes_;
+    }
+    size_type size() const {
+      return num_nodes_;
+    }
+
+    /** Return the number of edges with both nodes in this view.
+     * Complexity: O(sum of the degrees of the view's nodes), in parallel. */
+    size_type num_edges() const {
+      size_type count = 0;
+      #pragma omp parallel for schedule(dynamic, 64) reduction(+:count)
+      for(size_type w = 0; w < bits_.size(); ++w){
+        for(uint64_t b = bits_[w]; b; b &= b - 1){
+          size_type u = 64 * w + __builtin_ctzll(b);
+          for(size_type k = 0; k < graph_->adj_size(u); ++k){
+            size_type v = graph_->adj_node(u, k);
+            count += (u < v and contains(v));
+          }
+        }
+      }
+      return count;
+    }
+
+    /** @class Graph::View::NodeIterator
+     * @brief Forward iterator over the nodes of a view, by increasing index. */
+    class NodeIterator : private equality_comparable<NodeIterator> {
+     public:
+      typedef Node value_type;
+      typedef Node* pointer;
+      typedef Node& reference;
+      typedef std::forward_iterator_tag iterator_category;
+      typedef std::ptrdiff_t difference_type;
+
+      /** Construct an invalid NodeIterator. */
+      NodeIterator() : view_(nullptr), word_(0), bits_(0) {
+      }
+
+      Node operator*() const {
+        return view_->graph_->node(index());
+      }
+
+      NodeIterator& operator++() {
+        bits_ &= bits_ - 1;
+        if(bits_ == 0) seek(word_ + 1);
+        return *this;
+      }
+
+      bool operator==(const NodeIterator& it) const {
+        return view_ == it.view_ and word_ == it.word_ and bits_ == it.bits_;
+      }
+
+     private:
+      friend class View;
+      const View* view_;
+      // Current word of the bitmap, and its bits not visited yet
+      size_type word_;
+      uint64_t bits_;
+
+      NodeIterator(const View* view, size_type word)
+          : view_(view), word_(word), bits_(0) {
+        seek(word);
+      }
+
+      size_type index() const {
+        return 64 * word_ + __builtin_ctzll(bits_);
+      }
+
+      /** Move to the first node at or after word @a w. */
+      void seek(size_type w) {
+        const auto& bits = view_->bits_;
+        while(w < bits.size() and bits[w] == 0) ++w;
+        word_ = w;
+        bits_ = w < bits.size() ? bits[w] : 0;
+      }
+    };
+
+    /** @class Graph::View::EdgeIterator
+     * @brief Forward iterator over the edges with both nodes in a view.
+     *
+     * Each edge is visited once, from its lower-indexed node, as
+     * Graph::edge_iterator does. */
+    class EdgeIterator : private equality_comparable<EdgeIterator> {
+     public:
+      typedef Edge value_type;
+      typedef Edge* pointer;
+      typedef Edge& reference;
+      typedef std::forward_iterator_tag iterator_category;
+      typedef std::ptrdiff_t difference_type;
+
+      /** Construct an invalid EdgeIterator. */
+      EdgeIterator() : k_(0) {
+      }
+
+      Edge operator*() const {
+        return Edge(node_.view_->graph_, node_.index(), k_);
+      }
+
+      EdgeIterator& operator++() {
+        ++k_;
+        settle();
+        return *this;
+      }
+
+      bool operator==(const EdgeIterator& it) const {
+        return node_ == it.node_ and k_ == it.k_;
+      }
+
+     private:
+      friend class View;
+      NodeIterator node_;
+      size_type k_;
+
+      EdgeIterator(const NodeIterator& node) : node_(node), k_(0) {
+        settle();
+      }
+
+      /** Advance to the first edge at or after (node_, k_) in the view. */
+      void settle() {
+        const View* v = node_.view_;
+        const Graph* g = v->graph_;
+        while(node_.word_ < v->bits_.size()){
+          size_type u = node_.index();
+          for(; k_ < g->adj_size(u); ++k_){
+            size_type w = g->adj_node(u, k_);
+            if(u < w and v->contains(w)) return;
+          }
+          ++node_;
+          k_ = 0;
+        }
+      }
+    };
+
+    node_iterator node_begin() const {
+      return NodeIterator(this, 0);
+    }
+    node_iterator node_end() const {
+      return NodeIterator(this, bits_.size());
+    }
+    edge_iterator edge_begin() const {
+      return EdgeIterator(node_begin());
+    }
+    edge_iterator edge_end() const {
+      return EdgeIterator(node_end());
+    }
+
+    /** Copy this view into a new, compact graph.
+     * @return A frozen graph with num_nodes() nodes and num_edges() edges,
+     *         whose node k is the k-th node of this view (by increasing
+     *         index in the original graph), with the same position and value,
+     *         and whose edges keep their values.
+     *
+     * Complexity: O(num_nodes() of the graph + sum of the degrees of the
+     * view's nodes), in parallel.
+     */
+    Graph subgraph() const {
+      // new id of node i: the number of view nodes before it
+      std::vector<size_type> rank(bits_.size() + 1, 0);
+      for(size_type w = 0; w < bits_.size(); ++w){
+        rank[w + 1] = rank[w] + __builtin_popcountll(bits_[w]);
+      }
+      auto new_id = [this, &rank](size_type i){
+        uint64_t below = bits_[i / 64] & ((uint64_t(1) << (i % 64)) - 1);
+        return rank[i / 64] + size_type(__builtin_popcountll(below));
+      };
+
+      Graph sub;
+      const size_type m = num_nodes_;
+      sub.positions_.resize(m);
+      sub.values_.resize(m);
+      sub.csr_offsets_.assign(m + 1, 0);
+      #pragma omp parallel for schedule(dynamic, 64)
+      for(size_type w = 0; w < bits_.size(); ++w){
+        size_type q = rank[w];
+        for(uint64_t b = bits_[w]; b; b &= b - 1, ++q){
+          size_type u = 64 * w + __builtin_ctzll(b);
+          sub.positions_[q] = graph_->positions_[u];
+          sub.values_[q] = graph_->values_[u];
+          size_type d = 0;
+          for(size_type k = 0; k < graph_->adj_size(u); ++k){
+            d += contains(graph_->adj_node(u, k));
+          }
+          sub.csr_offsets_[q + 1] = d;
+        }
+      }
+      for(size_type q = 0; q < m; ++q){
+        sub.csr_offsets_[q + 1] += sub.csr_offsets_[q];
+      }
+      sub.csr_neighbors_.resize(sub.csr_offsets_[m]);
+      sub.csr_values_.resize(sub.csr_offsets_[m]);
+      // Renumbering keeps the order of each row
+      #pragma omp parallel for schedule(dynamic, 64)
+      for(size_type w = 0; w < bits_.size(); ++w){
+        size_type q = rank[w];
+        for(uint64_t b = bits_[w]; b; b &= b - 1, ++q){
+          size_type u = 64 * w + __builtin_ctzll(b);
+          size_type p = sub.csr_offsets_[q];
+          for(size_type k = 0; k < graph_->adj_size(u); ++k){
+            size_type v = graph_->adj_node(u, k);
+            if(!contains(v)) continue;
+            sub.csr_neighbors_[p] = new_id(v);
+            sub.csr_values_[p] = graph_->adj_value(u, k);
+            ++p;
+          }
+        }
+      }
+      sub.num_edges_ = sub.csr_offsets_[m] / 2;
+      sub.frozen_ = true;
+      return sub;
+    }
+
+   private:
+    friend class Graph;
+    const Graph* graph_;
+    std::vector<uint64_t> bits_;
+    size_type num_nodes_;
+
+    template <typename Pred>
+    View(const Graph* graph, Pred pred)
+        : graph_(graph), bits_((graph->size() + 63) / 64, 0), num_nodes_(0) {
+      const size_type n = graph->size();
+      size_type count = 0;
+      // One thread per word, so the bitmap needs no atomics
+      #pragma omp parallel for schedule(static) reduction(+:count)
+      for(size_type w = 0; w < bits_.size(); ++w){
+        uint64_t b = 0;
+        for(size_type i = 64 * w; i < std::min(n, 64 * w + 64); ++i){
+          if(pred(graph->node(i))) b |= uint64_t(1) << (i % 64);
+        }
+        bits_[w] = b;
+        count += __builtin_popcountll(b);
+      }
+      num_nodes_ = count;
+    }
+  };
+
+  /** Return the view of the nodes n for which @a pred(n) is true, and of
+   * the edges between them.
+   * @param[in] pred Called once per node, concurrently from several threads.
+   *
+   * Complexity: O(num_nodes()) calls to @a pred, in parallel.
+   */
+  template <typename Pred>
+  View view(Pred pred) const {
+    return View(this, pred);
+  }
+
 };
 
 #endif // CME212_GRAPH_HPP
@@ -0,0 +1,242 @@
+#pragma once
+/** @file GraphSearch.hpp
+ * @brief Parallel breadth-first search and Dijkstra over a Graph.
+ *
+ * GraphSearch copies the adjacency of a graph into compressed rows once, so
+ * that many searches on the same graph (e.g. multi-source reachability jobs)
+ * don't go through the Node/Edge proxies for every neighbor:
+ *
+ *   GraphSearch<GraphType> search(graph);
+ *   std::vector<int> hops = search.bfs({a.index(), b.index()});
+ *   std::vector<double> dist = search.dijkstra(a.index());
+ *
+ * A GraphSearch is a snapshot: build a new one after changing the graph.
+ */
+
+#include <vector>
+#include <queue>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+#include <omp.h>
+
+/** @class GraphSearch
+ * @brief Shortest path searches on a snapshot of the adjacency of a G.
+ */
+template <typename G>
+class GraphSearch {
+ public:
+  typedef typename G::size_type size_type;
+
+  /** Distance of nodes that can't be reached from any source. */
+  enum : int { unreachable = -1 };
+
+  /** Snapshot the adjacency and edge lengths of @a g.
+   * Complexity: O(g.num_nodes() + g.num_edges()), in parallel. */
+  explicit GraphSearch(const G& g)
+      : num_nodes_(g.num_nodes()), offsets_(num_nodes_ + 1, 0) {
+    for (size_type i = 0; i < num_nodes_; ++i)
+      offsets_[i + 1] = offsets_[i] + g.node(i).degree();
+    neighbors_.resize(offsets_[num_nodes_]);
+    lengths_.resize(offsets_[num_nodes_]);
+    // Edges are only materialized for the rows one thread owns
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (size_type i = 0; i < num_nodes_; ++i) {
+      auto n = g.node(i);
+      std::size_t k = offsets_[i];
+      for (auto it = n.edge_begin(); it != n.edge_end(); ++it, ++k) {
+        auto e = *it;
+        neighbors_[k] = e.node2().index();
+        lengths_[k] = e.length();
+      }
+    }
+  }
+
+  size_type num_nodes() const {
+    return num_nodes_;
+  }
+
+  /** Return the number of edges from every node to its nearest source.
+   * @param[in] sources Indices of the source nodes, which get distance 0.
+   * @return A vector @a d of size num_nodes(), with d[i] the length of the
+   *         shortest path (in edges) from any source to node i, or
+   *         unreachable if there is none.
+   *
+   * Level-synchronous and direction-optimizing: a level expands the frontier
+   * top-down (each frontier node claims its unvisited neighbors) while it is
+   * small, and switches to bottom-up (each unvisited node looks for a parent
+   * in a frontier bitmap) once the edges out of the frontier outnumber a
+   * fraction of the edges left to explore. Both steps run in parallel.
+   *
+   * Complexity: O(num_nodes() + num_edges()); the bottom-up levels usually
+   * look at far fewer edges than that.
+   */
+  std::vector<int> bfs(const std::vector<size_type>& sources) const {
+    // Switching thresholds of Beamer, Asanovic and Patterson (SC'12), with
+    // alpha lowered from 14: the low, even degrees of a mesh make bottom-up
+    // steps pay off only once the frontier holds a larger share of the edges.
+    const double alpha = 4, beta = 24;
+
+    std::vector<int> dist(num_nodes_, int(unreachable));
+    std::vector<size_type> frontier;
+    for (size_type s : sources) {
+      assert(s < num_nodes_);
+      if (dist[s] == unreachable) {
+        dist[s] = 0;
+        frontier.push_back(s);
+      }
+    }
+
+    // Edges out of the frontier, and edges not looked at yet
+    std::size_t scout_count = 0;
+    for (size_type s : frontier)
+      scout_count += degree(s);
+    std::size_t edges_to_check = neighbors_.size();
+
+    std::vector<uint64_t> in_frontier, in_next;
+    for (int level = 0; !frontier.empty(); ) {
+      if (scout_count > edges_to_check / alpha) {
+        // Bottom-up while the frontier grows or stays large
+        in_frontier.assign((num_nodes_ + 63) / 64, 0);
+        for (size_type v : frontier)
+          in_frontier[v / 64] |= uint64_t(1) << (v % 64);
+        std::size_t awake = frontier.size(), old_awake;
+        do {
+          old_awake = awake;
+          awake = bottom_up_step(level++, dist, in_frontier, in_next);
+          in_frontier.swap(in_next);
+        } while (awake >= old_awake || awake > num_nodes_ / beta);
+        frontier.clear();
+        for (size_type v = 0; v < num_nodes_; ++v)
+          if (in_frontier[v / 64] >> (v % 64) & 1)
+            frontier.push_back(v);
+        scout_count = 1;
+      } else {
+        edges_to_check -= std::min(edges_to_check, scout_count);
+        scout_count = top_down_step(level++, dist, frontier);
+      }
+    }
+    return dist;
+  }
+
+  /** Single source version of bfs(). */
+  std::vector<int> bfs(size_type source) const {
+    return bfs(std::vector<size_type>(1, source));
+  }
+
+  /** Return the length of the shortest path from every node to its nearest
+   * source, with edges weighted by Edge::length().
+   * @return A vector @a d of size num_nodes(), with d[i] the distance, or
+   *         infinity if node i can't be reached.
+   *
+   * Dijkstra's algorithm with a binary heap.
+   * Complexity: O((num_nodes() + num_edges()) log(num_nodes())).
+   */
+  std::vector<double> dijkstra(const std::vector<size_type>& sources) const {
+    typedef std::pair<double, size_type> item_type;
+    std::vector<double> dist(num_nodes_,
+                             std::numeric_limits<double>::infinity());
+    std::priority_queue<item_type, std::vector<item_type>,
+                        std::greater<item_type>> heap;
+    for (size_type s : sources) {
+      assert(s < num_nodes_);
+      dist[s] = 0;
+      heap.push(item_type(0, s));
+    }
+    while (!heap.empty()) {
+      item_type top = heap.top();
+      heap.pop();
+      size_type u = top.second;
+      if (top.first > dist[u])
+        continue;  // stale entry
+      for (std::size_t k = offsets_[u]; k < offsets_[u + 1]; ++k) {
+        double d = top.first + lengths_[k];
+        size_type v = neighbors_[k];
+        if (d < dist[v]) {
+          dist[v] = d;
+          heap.push(item_type(d, v));
+        }
+      }
+    }
+    return dist;
+  }
+
+  /** Single source version of dijkstra(). */
+  std::vector<double> dijkstra(size_type source) const {
+    return dijkstra(std::vector<size_type>(1, source));
+  }
+
+ private:
+  std::size_t degree(size_type i) const {
+    return offsets_[i + 1] - offsets_[i];
+  }
+
+  /** Give the unvisited neighbors of @a frontier distance @a level + 1 and
+   * replace @a frontier by them. Nodes are claimed with a compare-and-swap,
+   * so each lands in the new frontier once.
+   * @return The number of edges out of the new frontier. */
+  std::size_t top_down_step(int level, std::vector<int>& dist,
+                            std::vector<size_type>& frontier) const {
+    std::vector<size_type> next;
+    std::size_t scout_count = 0;
+    // The many small frontiers of a mesh aren't worth waking the threads for
+    #pragma omp parallel reduction(+:scout_count) if(frontier.size() > 1024)
+    {
+      std::vector<size_type> mine;
+      #pragma omp for schedule(dynamic, 64) nowait
+      for (std::size_t k = 0; k < frontier.size(); ++k) {
+        size_type u = frontier[k];
+        for (std::size_t j = offsets_[u]; j < offsets_[u + 1]; ++j) {
+          size_type v = neighbors_[j];
+          if (dist[v] == unreachable
+              && __sync_bool_compare_and_swap(&dist[v], int(unreachable), level + 1)) {
+            mine.push_back(v);
+            scout_count += degree(v);
+          }
+        }
+      }
+      #pragma omp critical
+      next.insert(next.end(), mine.begin(), mine.end());
+    }
+    frontier.swap(next);
+    return scout_count;
+  }
+
+  /** Give every unvisited node with a neighbor in @a in_frontier distance
+   * @a level + 1 and mark it in @a in_next. One thread owns each 64-node
+   * word of @a in_next, so no atomics are needed.
+   * @return The number of nodes in the new frontier. */
+  std::size_t bottom_up_step(int level, std::vector<int>& dist,
+                             const std::vector<uint64_t>& in_frontier,
+                             std::vector<uint64_t>& in_next) const {
+    const std::size_t words = in_frontier.size();
+    in_next.assign(words, 0);
+    std::size_t count = 0;
+    #pragma omp parallel for reduction(+:count) schedule(dynamic, 16)
+    for (std::size_t w = 0; w < words; ++w) {
+      uint64_t bits = 0;
+      size_type last = std::min<size_type>(64 * (w + 1), num_nodes_);
+      for (size_type v = 64 * w; v < last; ++v) {
+        if (dist[v] != unreachable)
+          continue;
+        for (std::size_t j = offsets_[v]; j < offsets_[v + 1]; ++j) {
+          size_type u = neighbors_[j];
+          if (in_frontier[u / 64] >> (u % 64) & 1) {
+            dist[v] = level + 1;
+            bits |= uint64_t(1) << (v % 64);
+            ++count;
+            break;
+          }
+        }
+      }
+      in_next[w] = bits;
+    }
+    return count;
+  }
+
+  size_type num_nodes_;
+  std::vector<std::size_t> offsets_;
+  std::vector<size_type> neighbors_;
+  std::vector<double> lengths_;
+};
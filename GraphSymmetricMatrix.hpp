@@ -0,0 +1,750 @@
+#pragma once
+/** @file GraphSymmetricMatrix.hpp
+ * @brief The graph Laplacian of a Graph with identity boundary rows, as an
+ *   MTL matrix, and the ITL preconditioners for it.
+ *
+ * Used by poisson.cpp to solve the Poisson problem by CG, and by
+ * benchmark.cpp to time the assembly and the solve.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cassert>
+#include <omp.h>
+
+#include <boost/numeric/mtl/mtl.hpp>
+#include <boost/numeric/itl/itl.hpp>
+
+#include "Graph.hpp"
+#include "Profile.hpp"
+
+/** Allocator whose resize() leaves plain values uninitialized, so that the
+ *  first write, from a parallel loop, decides which NUMA node owns a page. */
+template <typename T>
+struct first_touch_allocator : std::allocator<T> {
+  template <typename U>
+  struct rebind { typedef first_touch_allocator<U> other; };
+  first_touch_allocator() = default;
+  template <typename U>
+  first_touch_allocator(const first_touch_allocator<U>&) {}
+  /** Default construction does nothing. */
+  template <typename U>
+  void construct(U*) {}
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new((void*)p) U(std::forward<Args>(args)...);
+  }
+};
+
+/* GraphSymmetricMatrix which is implemented by graph.
+ * Boundary rows are the identity, interior rows are the graph Laplacian
+ * (degree on the diagonal, -1 for every interior neighbor), so the matrix
+ * is symmetric positive definite as CG and IC(0) require. */
+class GraphSymmetricMatrix {
+
+public:
+  /** Only the positions and edges of the graph are used. */
+  typedef Graph<char,char> graph_type;
+  typedef graph_type::node_type node_type;
+  /** 32-bit row pointers and column indices halve the index traffic. */
+  typedef unsigned index_type;
+
+  /** Construct the matrix of @a graph with the boundary rows given by
+   *  @a on_boundary, called as on_boundary(node) -> bool once per node,
+   *  here. Call tosparse() or tostencil() before using it. */
+  template <typename BoundaryPred>
+  GraphSymmetricMatrix(graph_type* graph, BoundaryPred on_boundary)
+  // Initialize the private attributes of a graph,with no nodes and no edges.
+    : graph_(graph), matrix_free_(false){
+    const size_t n = num_rows();
+    boundary_.resize(n);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; ++i){
+      boundary_[i] = on_boundary(graph_->node(i));
+    }
+  }
+
+  double element(size_t i, size_t j){
+    // double h = (*(graph_->edge_begin())).length();
+    if(i == j and boundary_[i]) return 1.0;
+    if(i != j and (boundary_[i] or boundary_[j])) return 0;
+    else{
+      if(i == j) return double(graph_->node(i).degree());
+      auto n1 = graph_->node(i);
+      auto n2 = graph_->node(j);
+      if(graph_->has_edge(n1, n2)) return -1.0;
+      else return 0.0;
+    }
+  }
+
+  /** Helper function to perform multiplication . Allows for delayed
+    * evaluation of results .
+    * Assign :: apply (a , b ) resolves to an assignment operation such as
+    * a += b , a -= b , or a = b .
+    * @pre @a size ( v ) == size ( w ) */
+  template <typename VectorIn, typename VectorOut, typename Assign>
+  void mult(const VectorIn& v, VectorOut& w, Assign) const{
+    CME212_PROFILE_SCOPE("poisson.matvec");
+    const index_type s = graph_->size();
+    assert(mtl::size(v) == s);
+    assert(mtl::size(w) == s);
+    mult_rows(v, w, Assign(), 0, s);
+  }
+
+  /** The rows [@a first, @a last) of mult(): only w[i] with first <= i <
+   * last is assigned, and only the v[j] of their columns are read. Lets a
+   * distributed product do the rows that don't need remote values while
+   * those are on their way.
+   * @pre @a first <= @a last <= num_rows() */
+  template <typename VectorIn, typename VectorOut, typename Assign>
+  void mult_rows(const VectorIn& v, VectorOut& w, Assign,
+                 index_type first, index_type last) const{
+    assert(first <= last and last <= graph_->size());
+    const index_type* indp = indp_.data();
+    const index_type* indi = indi_.data();
+    const double* elem = elem_.data();
+    if(matrix_free_){
+      // Entries from the stencil: degree on the diagonal, -1 per interior
+      // neighbor, identity rows on the boundary.
+      const char* bnd = boundary_.data();
+      #pragma omp parallel for schedule(static)
+      for(index_type i = first; i < last; ++i){
+        double current = v[i];
+        if(not bnd[i]){
+          double sum = 0;
+          #pragma omp simd reduction(+:sum)
+          for(index_type j = indp[i]; j < indp[i+1]; ++j){
+            sum += bnd[indi[j]] ? 0.0 : v[indi[j]];
+          }
+          current = double(indp[i+1] - indp[i]) * current - sum;
+        }
+        Assign::apply(w[i], current);
+      }
+      return;
+    }
+    // Rows are split statically, the same way tosparse() first touched
+    // them, so each thread streams the part of the matrix it owns.
+    #pragma omp parallel for schedule(static)
+    for(index_type i = first; i < last; ++i){
+      double current = 0;
+      #pragma omp simd reduction(+:current)
+      for(index_type j = indp[i]; j < indp[i+1]; ++j){
+        current += v[indi[j]] * elem[j];
+      }
+      Assign::apply(w[i], current);
+    }
+  }
+
+  /* * Matvec forwards to MTL ’s lazy m at _ c ve c _ mu l t ip l i er operator */
+  template <typename Vector>
+  mtl::vec::mat_cvec_multiplier<GraphSymmetricMatrix, Vector>
+  operator *(const Vector& v) const{
+    return {*this, v};
+  }
+  /* Construct a sparse matrix using the graph's feature.
+   * Same entries as element(i, j), but every row only visits the incident
+   * edges of its node and the boundary is looked up once per node, so the
+   * assembly is O(N + E) and the rows are filled in parallel. */
+  void tosparse(){
+    CME212_PROFILE_SCOPE("poisson.assembly");
+    assert(graph_ != NULL);
+    const size_t n = num_rows();
+    const array_type<char>& on_boundary = boundary_;
+    matrix_free_ = false;
+
+    // A boundary row only has its diagonal, an interior row also has a
+    // -1.0 for every interior neighbor. A zero diagonal is not stored.
+    indp_.resize(n + 1);
+    indp_[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; ++i){
+      auto node = graph_->node(i);
+      size_t count = (on_boundary[i] or node.degree() != 0);
+      if(not on_boundary[i]){
+        for(auto e = node.edge_begin(); e != node.edge_end(); ++e){
+          count += not on_boundary[(*e).node2().index()];
+        }
+      }
+      indp_[i + 1] = count;
+    }
+    for(size_t i = 0; i < n; ++i){
+      indp_[i + 1] += indp_[i];
+    }
+
+    // Not initialized by resize: the static loop below touches each page
+    // first from the thread that later multiplies those rows.
+    indi_.resize(indp_[n]);
+    elem_.resize(indp_[n]);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; ++i){
+      auto node = graph_->node(i);
+      size_t p = indp_[i];
+      if(on_boundary[i] or node.degree() != 0) indi_[p++] = i;
+      if(not on_boundary[i]){
+        for(auto e = node.edge_begin(); e != node.edge_end(); ++e){
+          size_t j = (*e).node2().index();
+          if(not on_boundary[j]) indi_[p++] = j;
+        }
+      }
+      // Columns in increasing order, as element(i, j) would produce them
+      std::sort(indi_.begin() + indp_[i], indi_.begin() + indp_[i + 1]);
+      double diag = on_boundary[i] ? 1.0 : double(node.degree());
+      for(size_t q = indp_[i]; q < indp_[i + 1]; ++q){
+        elem_[q] = (indi_[q] == i) ? diag : -1.0;
+      }
+    }
+  }
+
+  /* Prepare a matrix-free product instead of assembling the matrix.
+   * Every row of A is known from the graph: only the neighbor ids of the
+   * interior nodes (32 bits each) and one boundary flag per node are kept,
+   * with no value array, which about halves the memory traffic of mult.
+   * row_ptr(), col_ind() and values() are not available in this mode. */
+  void tostencil(){
+    CME212_PROFILE_SCOPE("poisson.assembly");
+    assert(graph_ != NULL);
+    const size_t n = num_rows();
+    matrix_free_ = true;
+    array_type<double>().swap(elem_);
+
+    // The degree of an interior node is the length of its row.
+    indp_.resize(n + 1);
+    indp_[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; ++i){
+      indp_[i + 1] = boundary_[i] ? 0 : graph_->node(i).degree();
+    }
+    for(size_t i = 0; i < n; ++i){
+      indp_[i + 1] += indp_[i];
+    }
+    indi_.resize(indp_[n]);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; ++i){
+      if(boundary_[i]) continue;
+      auto node = graph_->node(i);
+      size_t p = indp_[i];
+      for(auto e = node.edge_begin(); e != node.edge_end(); ++e){
+        indi_[p++] = (*e).node2().index();
+      }
+    }
+  }
+
+  /** Return true when mult works from the stencil, see tostencil(). */
+  bool matrix_free() const{
+    return matrix_free_;
+  }
+
+  /** Return the diagonal entry of row @a i.
+   * @pre tosparse() or tostencil() has been called */
+  double diagonal(size_t i) const{
+    if(boundary_[i]) return 1.0;
+    if(matrix_free_) return double(indp_[i+1] - indp_[i]);
+    return double(graph_->node(i).degree());
+  }
+
+  size_t num_rows() const{
+    return graph_->size();
+  }
+
+  size_t num_cols() const{
+    return graph_->size();
+  }
+
+  size_t m_size() const{
+    return graph_->size() * graph_->size();
+  }
+
+  /** The CSR arrays built by tosparse(): the entries of row i are
+   *  values()[k] in column col_ind()[k] for row_ptr()[i] <= k < row_ptr()[i+1],
+   *  with columns in increasing order.
+   * @pre not matrix_free() */
+  const index_type* row_ptr() const{
+    return indp_.data();
+  }
+  const index_type* col_ind() const{
+    return indi_.data();
+  }
+  const double* values() const{
+    return elem_.data();
+  }
+
+private:
+  template <typename T>
+  using array_type = std::vector<T, first_touch_allocator<T>>;
+
+  graph_type* graph_;
+  bool matrix_free_;
+  array_type<char> boundary_;
+  array_type<double> elem_;
+  array_type<index_type> indp_;
+  array_type<index_type> indi_;
+};
+
+/* * The number of rows in the matrix . */
+inline std::size_t num_rows(const GraphSymmetricMatrix& A){
+  return A.num_rows();
+}
+
+/* * The number of columns in the matrix . */
+inline std::size_t num_cols(const GraphSymmetricMatrix& A){
+  return A.num_cols();
+}
+
+/* * The number of elements in the matrix . */
+inline std::size_t size(const GraphSymmetricMatrix& A){
+  return A.m_size();
+}
+
+/* * Traits that MTL uses to determine properties of our IdentityMatrix . */
+namespace mtl {
+  namespace ashape {
+    /* * Define IdentityMatrix to be a non - scalar type . */
+    template <>
+      struct ashape_aux <GraphSymmetricMatrix> {
+      typedef nonscal type ;
+      };
+  } // end namespace ashape
+
+  /* * IdentityMatrix implements the Collection concept
+  * with value_type and size_type */
+  template <>
+  struct Collection <GraphSymmetricMatrix> {
+    typedef double value_type ;
+    typedef unsigned size_type ;
+  };
+} // end namespace mtl
+
+namespace itl {
+  namespace pc {
+
+  /** Jacobi preconditioner for GraphSymmetricMatrix: M = diag(A).
+   *  Used like the itl::pc types, e.g. itl::cg(A, x, b, P, iter). */
+  class graph_diagonal {
+  public:
+    /** Invert the diagonal of @a A.
+     * @pre A.tosparse() or A.tostencil() has been called */
+    explicit graph_diagonal(const GraphSymmetricMatrix& A)
+      : inv_diag_(A.num_rows(), 0.0) {
+      CME212_PROFILE_SCOPE("poisson.pc_setup");
+      #pragma omp parallel for schedule(static)
+      for(size_t i = 0; i < inv_diag_.size(); ++i){
+        double d = A.diagonal(i);
+        inv_diag_[i] = (d != 0) ? 1.0 / d : 0.0;
+      }
+    }
+
+    /** Compute @a x = M^{-1} @a b. */
+    template <typename VectorIn, typename VectorOut>
+    void solve(const VectorIn& b, VectorOut& x) const{
+      CME212_PROFILE_SCOPE("poisson.pc_solve");
+      const size_t n = inv_diag_.size();
+      #pragma omp parallel for schedule(static)
+      for(size_t i = 0; i < n; ++i){
+        x[i] = inv_diag_[i] * b[i];
+      }
+    }
+
+    /** M is symmetric, so the adjoint solve is the same. */
+    template <typename VectorIn, typename VectorOut>
+    void adjoint_solve(const VectorIn& b, VectorOut& x) const{
+      solve(b, x);
+    }
+
+  private:
+    std::vector<double> inv_diag_;
+  };
+
+  /** Incomplete Cholesky preconditioner for GraphSymmetricMatrix:
+   *  M = L L^T where L has the sparsity of the lower triangle of A.
+   *
+   *  The triangular solves are serial, but on the Laplacian IC(0) cuts the
+   *  CG iteration count by far more than the lost parallelism costs.
+   *  Renumbering the graph with rcm_order first keeps the fill local. */
+  class graph_ic_0 {
+  public:
+    /** Factor @a A.
+     * @pre A.tosparse() has been called and A is symmetric positive
+     *      definite with nonzero diagonal, not A.matrix_free() */
+    explicit graph_ic_0(const GraphSymmetricMatrix& A)
+      : n_(A.num_rows()), lp_(n_ + 1, 0), diag_(n_) {
+      CME212_PROFILE_SCOPE("poisson.pc_setup");
+      assert(not A.matrix_free());
+      const auto* indp = A.row_ptr();
+      const auto* indi = A.col_ind();
+      const double* elem = A.values();
+      // Strictly lower part of each row, columns in increasing order.
+      for(size_t i = 0; i < n_; ++i){
+        lp_[i+1] = lp_[i];
+        for(auto k = indp[i]; k < indp[i+1] and indi[k] < i; ++k){
+          li_.push_back(indi[k]);
+          lv_.push_back(elem[k]);
+          ++lp_[i+1];
+        }
+      }
+      for(size_t i = 0; i < n_; ++i){
+        double d = 0;
+        for(auto k = indp[i]; k < indp[i+1]; ++k){
+          if(indi[k] == i) d = elem[k];
+        }
+        // L_ij = (A_ij - sum_{m<j} L_im L_jm) / L_jj over the kept pattern
+        for(size_t k = lp_[i]; k < lp_[i+1]; ++k){
+          size_t j = li_[k];
+          double s = lv_[k];
+          size_t a = lp_[i], b = lp_[j];
+          while(a < k and b < lp_[j+1]){
+            if(li_[a] < li_[b]) ++a;
+            else if(li_[b] < li_[a]) ++b;
+            else s -= lv_[a++] * lv_[b++];
+          }
+          lv_[k] = s / diag_[j];
+          d -= lv_[k] * lv_[k];
+        }
+        assert(d > 0);
+        diag_[i] = std::sqrt(d);
+      }
+    }
+
+    /** Compute @a x = (L L^T)^{-1} @a b. */
+    template <typename VectorIn, typename VectorOut>
+    void solve(const VectorIn& b, VectorOut& x) const{
+      CME212_PROFILE_SCOPE("poisson.pc_solve");
+      std::vector<double> y(n_);
+      // Forward substitution L y = b
+      for(size_t i = 0; i < n_; ++i){
+        double s = b[i];
+        for(size_t k = lp_[i]; k < lp_[i+1]; ++k){
+          s -= lv_[k] * y[li_[k]];
+        }
+        y[i] = s / diag_[i];
+      }
+      // Backward substitution L^T x = y, column by column
+      for(size_t i = n_; i-- > 0; ){
+        double xi = y[i] / diag_[i];
+        for(size_t k = lp_[i]; k < lp_[i+1]; ++k){
+          y[li_[k]] -= lv_[k] * xi;
+        }
+        x[i] = xi;
+      }
+    }
+
+    /** M is symmetric, so the adjoint solve is the same. */
+    template <typename VectorIn, typename VectorOut>
+    void adjoint_solve(const VectorIn& b, VectorOut& x) const{
+      solve(b, x);
+    }
+
+  private:
+    size_t n_;
+    std::vector<size_t> lp_;
+    std::vector<GraphSymmetricMatrix::index_type> li_;
+    std::vector<double> lv_;
+    std::vector<double> diag_;
+  };
+
+  /** Aggregation multigrid preconditioner for GraphSymmetricMatrix.
+   *
+   *  Each level groups every node with its not yet grouped neighbors in the
+   *  matrix graph (plain aggregation), the coarse matrix is the Galerkin
+   *  product P^T A P with piecewise constant P, and levels are added until
+   *  at most 500 unknowns remain, which are solved by a dense Cholesky
+   *  factorization. solve() applies one symmetric V-cycle with forward
+   *  Gauss-Seidel before and backward Gauss-Seidel after the (scaled)
+   *  coarse grid correction, so M stays symmetric positive definite for CG. Rows with
+   *  no off-diagonal entries (the boundary) are solved exactly by the
+   *  smoother and never coarsened. If coarsening stalls with more than 500
+   *  unknowns left, the coarsest level is smoothed by one symmetric
+   *  Gauss-Seidel sweep instead of factored. */
+  class graph_multigrid {
+  public:
+    /** Build the hierarchy for @a A.
+     * @pre A.tosparse() has been called and A is symmetric positive definite,
+     *      not A.matrix_free() */
+    explicit graph_multigrid(const GraphSymmetricMatrix& A) {
+      CME212_PROFILE_SCOPE("poisson.pc_setup");
+      assert(not A.matrix_free());
+      const size_t n = A.num_rows();
+      levels_.resize(1);
+      level& fine = levels_[0];
+      fine.indp.assign(A.row_ptr(), A.row_ptr() + n + 1);
+      fine.indi.assign(A.col_ind(), A.col_ind() + fine.indp[n]);
+      fine.elem.assign(A.values(), A.values() + fine.indp[n]);
+      while(levels_.back().size() > coarse_size and coarsen(levels_.back())){
+        levels_.push_back(galerkin(levels_.back()));
+      }
+      for(auto& l : levels_) prepare(l);
+      // A stalled hierarchy would need an O(n^2) dense factor
+      if(levels_.back().size() <= coarse_size) factor_coarse(levels_.back());
+    }
+
+    /** Compute @a x = M^{-1} @a b by one V-cycle. */
+    template <typename VectorIn, typename VectorOut>
+    void solve(const VectorIn& b, VectorOut& x) const{
+      CME212_PROFILE_SCOPE("poisson.pc_solve");
+      level& l = levels_[0];
+      for(size_t i = 0; i < l.size(); ++i) l.b[i] = b[i];
+      cycle(0);
+      for(size_t i = 0; i < l.size(); ++i) x[i] = l.x[i];
+    }
+
+    /** M is symmetric, so the adjoint solve is the same. */
+    template <typename VectorIn, typename VectorOut>
+    void adjoint_solve(const VectorIn& b, VectorOut& x) const{
+      solve(b, x);
+    }
+
+    /** The number of levels, including the finest. */
+    size_t num_levels() const{
+      return levels_.size();
+    }
+
+  private:
+    typedef GraphSymmetricMatrix::index_type index_type;
+    static constexpr index_type no_aggregate = index_type(-1);
+    static constexpr size_t coarse_size = 500;
+    /** Piecewise constant P underestimates smooth errors, scaling the
+     *  coarse correction (by less than 2, to stay definite) makes up for it. */
+    static constexpr double over_correction = 1.8;
+
+    struct level {
+      std::vector<index_type> indp, indi;
+      std::vector<double> elem, diag;
+      /** agg[i] is the coarse row of row i, or no_aggregate */
+      std::vector<index_type> agg;
+      /** Work vectors for the V-cycle */
+      std::vector<double> x, b;
+      size_t size() const { return indp.size() - 1; }
+    };
+
+    /** Fill @a l.agg. Return false if it would not shrink the problem. */
+    static bool coarsen(level& l) {
+      const size_t n = l.size();
+      const index_type unset = no_aggregate - 1;
+      l.agg.assign(n, unset);
+      index_type count = 0;
+      // Rows without neighbors are solved exactly by the smoother.
+      for(size_t i = 0; i < n; ++i){
+        if(l.indp[i+1] - l.indp[i] <= 1) l.agg[i] = no_aggregate;
+      }
+      // A new aggregate for every node whose neighborhood is still free,
+      for(size_t i = 0; i < n; ++i){
+        if(l.agg[i] != unset) continue;
+        bool free = true;
+        for(auto k = l.indp[i]; k < l.indp[i+1] and free; ++k){
+          free = l.agg[l.indi[k]] == unset;
+        }
+        if(not free) continue;
+        for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+          l.agg[l.indi[k]] = count;
+        }
+        ++count;
+      }
+      // then the leftovers join a neighboring aggregate.
+      for(size_t i = 0; i < n; ++i){
+        if(l.agg[i] != unset) continue;
+        for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+          index_type a = l.agg[l.indi[k]];
+          if(a != unset and a != no_aggregate){
+            l.agg[i] = a;
+            break;
+          }
+        }
+        if(l.agg[i] == unset) l.agg[i] = count++;
+      }
+      return count > 0 and count < n;
+    }
+
+    /** Return the level with matrix P^T A P for the aggregates of @a l. */
+    static level galerkin(const level& l) {
+      const size_t n = l.size();
+      index_type nc = 0;
+      for(index_type a : l.agg){
+        if(a != no_aggregate) nc = std::max(nc, a + 1);
+      }
+      // Fine rows grouped by aggregate
+      std::vector<index_type> start(nc + 1, 0), rows;
+      for(index_type a : l.agg){
+        if(a != no_aggregate) ++start[a + 1];
+      }
+      for(index_type c = 0; c < nc; ++c) start[c + 1] += start[c];
+      rows.resize(start[nc]);
+      std::vector<index_type> fill(start.begin(), start.end() - 1);
+      for(size_t i = 0; i < n; ++i){
+        if(l.agg[i] != no_aggregate) rows[fill[l.agg[i]]++] = i;
+      }
+
+      level c;
+      c.indp.assign(1, 0);
+      std::vector<index_type> where(nc, index_type(no_aggregate));
+      for(index_type I = 0; I < nc; ++I){
+        size_t row_begin = c.indi.size();
+        for(auto r = start[I]; r < start[I + 1]; ++r){
+          size_t i = rows[r];
+          for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+            index_type J = l.agg[l.indi[k]];
+            if(J == no_aggregate) continue;
+            if(where[J] == no_aggregate or where[J] < row_begin){
+              where[J] = c.indi.size();
+              c.indi.push_back(J);
+              c.elem.push_back(l.elem[k]);
+            } else {
+              c.elem[where[J]] += l.elem[k];
+            }
+          }
+        }
+        // Keep the columns of each row sorted
+        std::vector<std::pair<index_type, double>> row;
+        for(size_t k = row_begin; k < c.indi.size(); ++k){
+          row.push_back(std::make_pair(c.indi[k], c.elem[k]));
+        }
+        std::sort(row.begin(), row.end());
+        for(size_t k = 0; k < row.size(); ++k){
+          c.indi[row_begin + k] = row[k].first;
+          c.elem[row_begin + k] = row[k].second;
+          where[row[k].first] = row_begin + k;
+        }
+        c.indp.push_back(c.indi.size());
+      }
+      return c;
+    }
+
+    static void prepare(level& l) {
+      const size_t n = l.size();
+      l.diag.assign(n, 0.0);
+      for(size_t i = 0; i < n; ++i){
+        for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+          if(l.indi[k] == i) l.diag[i] = l.elem[k];
+        }
+      }
+      l.x.assign(n, 0.0);
+      l.b.assign(n, 0.0);
+    }
+
+    /** Dense Cholesky factor of the coarsest matrix, row major, into chol_.
+     *  chol_ stays empty if the coarsest level is only smoothed. */
+    void factor_coarse(const level& l) {
+      const size_t n = l.size();
+      chol_.assign(n * n, 0.0);
+      for(size_t i = 0; i < n; ++i){
+        for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+          chol_[i*n + l.indi[k]] = l.elem[k];
+        }
+      }
+      for(size_t j = 0; j < n; ++j){
+        double d = chol_[j*n + j];
+        for(size_t k = 0; k < j; ++k) d -= chol_[j*n + k] * chol_[j*n + k];
+        assert(d > 0);
+        d = std::sqrt(d);
+        chol_[j*n + j] = d;
+        for(size_t i = j + 1; i < n; ++i){
+          double s = chol_[i*n + j];
+          for(size_t k = 0; k < j; ++k) s -= chol_[i*n + k] * chol_[j*n + k];
+          chol_[i*n + j] = s / d;
+        }
+      }
+    }
+
+    /** One Gauss-Seidel sweep on l.x, forward or backward. */
+    static void gauss_seidel(level& l, bool forward) {
+      const size_t n = l.size();
+      for(size_t s = 0; s < n; ++s){
+        size_t i = forward ? s : n - 1 - s;
+        double r = l.b[i];
+        for(auto k = l.indp[i]; k < l.indp[i+1]; ++k){
+          if(l.indi[k] != i) r -= l.elem[k] * l.x[l.indi[k]];
+        }
+        l.x[i] = r / l.diag[i];
+      }
+    }
+
+    /** Solve levels_[k] for l.x given l.b with a V-cycle. */
+    void cycle(size_t k) const{
+      level& l = levels_[k];
+      const size_t n = l.size();
+      if(k + 1 == levels_.size() and chol_.empty()){
+        // Coarsening stalled: smooth the coarsest level only
+        std::fill(l.x.begin(), l.x.end(), 0.0);
+        gauss_seidel(l, true);
+        gauss_seidel(l, false);
+        return;
+      }
+      if(k + 1 == levels_.size()){
+        // Dense forward and backward substitution on the coarsest level
+        for(size_t i = 0; i < n; ++i){
+          double s = l.b[i];
+          for(size_t j = 0; j < i; ++j) s -= chol_[i*n + j] * l.x[j];
+          l.x[i] = s / chol_[i*n + i];
+        }
+        for(size_t i = n; i-- > 0; ){
+          double s = l.x[i];
+          for(size_t j = i + 1; j < n; ++j) s -= chol_[j*n + i] * l.x[j];
+          l.x[i] = s / chol_[i*n + i];
+        }
+        return;
+      }
+      level& c = levels_[k + 1];
+      std::fill(l.x.begin(), l.x.end(), 0.0);
+      gauss_seidel(l, true);
+      // Restrict the residual: c.b = P^T (b - A x)
+      std::fill(c.b.begin(), c.b.end(), 0.0);
+      for(size_t i = 0; i < n; ++i){
+        if(l.agg[i] == no_aggregate) continue;
+        double r = l.b[i];
+        for(auto q = l.indp[i]; q < l.indp[i+1]; ++q){
+          r -= l.elem[q] * l.x[l.indi[q]];
+        }
+        c.b[l.agg[i]] += r;
+      }
+      cycle(k + 1);
+      // Prolongate the correction: x += omega P c.x
+      for(size_t i = 0; i < n; ++i){
+        if(l.agg[i] != no_aggregate) l.x[i] += over_correction * c.x[l.agg[i]];
+      }
+      gauss_seidel(l, false);
+    }
+
+    mutable std::vector<level> levels_;
+    std::vector<double> chol_;
+  };
+
+  /** Lazy z = solve(P, r) as used inside the ITL Krylov solvers. */
+  template <typename Vector>
+  inline solver<graph_diagonal, Vector, false>
+  solve(const graph_diagonal& P, const Vector& b){
+    return solver<graph_diagonal, Vector, false>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<graph_diagonal, Vector, true>
+  adjoint_solve(const graph_diagonal& P, const Vector& b){
+    return solver<graph_diagonal, Vector, true>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<graph_ic_0, Vector, false>
+  solve(const graph_ic_0& P, const Vector& b){
+    return solver<graph_ic_0, Vector, false>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<graph_ic_0, Vector, true>
+  adjoint_solve(const graph_ic_0& P, const Vector& b){
+    return solver<graph_ic_0, Vector, true>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<graph_multigrid, Vector, false>
+  solve(const graph_multigrid& P, const Vector& b){
+    return solver<graph_multigrid, Vector, false>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<graph_multigrid, Vector, true>
+  adjoint_solve(const graph_multigrid& P, const Vector& b){
+    return solver<graph_multigrid, Vector, true>(P, b);
+  }
+
+  } // end namespace pc
+} // end namespace itl
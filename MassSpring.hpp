@@ -0,0 +1,433 @@
+#pragma once
+/** @file MassSpring.hpp
+ * @brief A mass-spring system on contiguous arrays, stepped by one fused
+ *   symplectic Euler pass per time step.
+ *
+ * MassSpringSystem copies the state of a graph once: positions, velocities
+ * and masses to plain arrays, the springs to compressed rows, and which
+ * nodes are held fixed to a mask. Forces are expressions built from terms
+ * at compile time,
+ *
+ *   MassSpringSystem system(graph, is_fixed);
+ *   auto force = GravityTerm() + SpringTerm() + DampingTerm(0.01);
+ *   t = system.step(t, system.adaptive_dt(), force);
+ *   system.store(graph);
+ *
+ * and step() evaluates the whole expression inline, node by node, in the
+ * same loop that updates the velocities and positions. Terms that are
+ * cheaper per edge than per node, like the springs, fill a buffer of the
+ * system first, in prepare().
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <omp.h>
+
+#include "CME212/Point.hpp"
+
+#include "Profile.hpp"
+
+/** @class ForceExpr
+ * @brief Curiously Recurring Template Pattern for force expressions.
+ *
+ * A force expression is anything that inherits from ForceExpr<E> and
+ * implements
+ * concept E {
+ *   template <typename S>
+ *   Point operator()(const S& s, unsigned i, double t) const;
+ * }
+ * returning the force on node i of the system s at time t, and optionally
+ *   template <typename S>
+ *   void prepare(S& s) const;
+ * which is called once before the forces of a step are evaluated, with the
+ * positions and velocities the step starts from. Unlike the matrix
+ * expressions of Examples/expr_template.cpp, expressions hold their
+ * operands by value: terms are a few doubles, and an expression saved with
+ * auto must not refer to temporaries.
+ */
+template <typename E>
+struct ForceExpr {
+  const E& derived() const {
+    return static_cast<const E&>(*this);
+  }
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double t) const {
+    return derived()(s, i, t);
+  }
+  /** Nothing to prepare, unless E says otherwise */
+  template <typename S>
+  void prepare(S&) const {
+  }
+};
+
+/** Lazy sum of two force expressions */
+template <typename E1, typename E2>
+struct ForceAdd : public ForceExpr<ForceAdd<E1, E2>> {
+  ForceAdd(const E1& a, const E2& b)
+      : a_(a), b_(b) {
+  }
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double t) const {
+    return a_(s, i, t) + b_(s, i, t);
+  }
+  template <typename S>
+  void prepare(S& s) const {
+    a_.prepare(s);
+    b_.prepare(s);
+  }
+ private:
+  E1 a_;
+  E2 b_;
+};
+
+/** Lazy scaling of a force expression */
+template <typename E1>
+struct ForceScale : public ForceExpr<ForceScale<E1>> {
+  ForceScale(double alpha, const E1& a)
+      : alpha_(alpha), a_(a) {
+  }
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double t) const {
+    return alpha_ * a_(s, i, t);
+  }
+  template <typename S>
+  void prepare(S& s) const {
+    a_.prepare(s);
+  }
+ private:
+  double alpha_;
+  E1 a_;
+};
+
+/** Add any two force expressions */
+template <typename E1, typename E2>
+ForceAdd<E1, E2> operator+(const ForceExpr<E1>& a, const ForceExpr<E2>& b) {
+  return ForceAdd<E1, E2>(a.derived(), b.derived());
+}
+
+/** Scale any force expression */
+template <typename E>
+ForceScale<E> operator*(double alpha, const ForceExpr<E>& a) {
+  return ForceScale<E>(alpha, a.derived());
+}
+template <typename E>
+ForceScale<E> operator*(const ForceExpr<E>& a, double alpha) {
+  return alpha * a;
+}
+
+/** Gravity, m * (0, 0, -g), with g in meters/sec^2 */
+struct GravityTerm : public ForceExpr<GravityTerm> {
+  explicit GravityTerm(double g = 9.81)
+      : g_(g) {
+  }
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double) const {
+    return s.mass(i) * Point(0, 0, -g_);
+  }
+ private:
+  double g_;
+};
+
+/** Hooke's law summed over the springs of the node,
+ * -K (|xi - xj| - L) (xi - xj) / |xi - xj|
+ *
+ * prepare() evaluates every spring once, from one end, see
+ * MassSpringSystem::update_spring_forces(); the node then adds up the
+ * forces of its springs with the right signs. */
+struct SpringTerm : public ForceExpr<SpringTerm> {
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double) const {
+    Point f(0, 0, 0);
+    for (unsigned k = s.spring_begin(i); k < s.spring_end(i); ++k)
+      f += s.spring_force(i, k);
+    return f;
+  }
+  template <typename S>
+  void prepare(S& s) const {
+    s.update_spring_forces();
+  }
+};
+
+/** Damping, -c * v */
+struct DampingTerm : public ForceExpr<DampingTerm> {
+  explicit DampingTerm(double c)
+      : c_(c) {
+  }
+  template <typename S>
+  Point operator()(const S& s, unsigned i, double) const {
+    return -c_ * s.velocity(i);
+  }
+ private:
+  double c_;
+};
+
+
+/** @class MassSpringSystem
+ * @brief The positions, velocities, masses and springs of a graph, stored in
+ *   contiguous arrays indexed like its nodes.
+ */
+class MassSpringSystem {
+ public:
+  typedef unsigned size_type;
+
+  /** Copy the state of @a g.
+   * @param[in] fixed Callable as fixed(node) -> bool, true for the nodes that
+   *                  never move. It is evaluated once per node, here.
+   * @tparam G::node_value_type has members vel and mass, and
+   *         G::edge_value_type has members K and L, like the NodeData and
+   *         EdgeData of mass_spring.cpp.
+   *
+   * Complexity: O(g.num_nodes() + g.num_edges()).
+   */
+  template <typename G, typename FixedPred>
+  MassSpringSystem(const G& g, FixedPred fixed)
+      : x_(g.num_nodes()), x_next_(g.num_nodes()), v_(g.num_nodes()),
+        mass_(g.num_nodes()), inv_mass_(g.num_nodes()), free_(g.num_nodes()),
+        offsets_(g.num_nodes() + 1, 0) {
+    const size_type n = size();
+    for (size_type i = 0; i < n; ++i)
+      offsets_[i + 1] = offsets_[i] + g.node(i).degree();
+    neighbors_.resize(offsets_[n]);
+    K_.resize(offsets_[n]);
+    L_.resize(offsets_[n]);
+    double omega2 = 0;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(max:omega2)
+    for (size_type i = 0; i < n; ++i) {
+      auto node = g.node(i);
+      x_[i] = node.position();
+      mass_[i] = node.value().mass;
+      free_[i] = fixed(node) ? 0 : 1;
+      inv_mass_[i] = free_[i] / mass_[i];
+      // Fixed nodes start, and stay, at rest
+      v_[i] = free_[i] * node.value().vel;
+      size_type k = offsets_[i];
+      double row_K = 0;
+      for (auto it = node.edge_begin(); it != node.edge_end(); ++it, ++k) {
+        auto e = *it;
+        neighbors_[k] = e.node2().index();
+        K_[k] = e.value().K;
+        L_[k] = e.value().L;
+        row_K += K_[k];
+      }
+      omega2 = std::max(omega2, 2 * row_K * inv_mass_[i]);
+    }
+    omega2_ = omega2;
+
+    // The same spring seen from its other end
+    twin_.resize(offsets_[n]);
+    force_.resize(offsets_[n]);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (size_type i = 0; i < n; ++i) {
+      for (size_type k = offsets_[i]; k < offsets_[i + 1]; ++k) {
+        const size_type j = neighbors_[k];
+        size_type t = offsets_[j];
+        while (neighbors_[t] != i)
+          ++t;
+        assert(t < offsets_[j + 1]);
+        twin_[k] = t;
+      }
+    }
+  }
+
+  /** Return the number of nodes. */
+  size_type size() const {
+    return x_.size();
+  }
+
+  const Point& position(size_type i) const { return x_[i]; }
+  Point& position(size_type i) { return x_[i]; }
+  const Point& velocity(size_type i) const { return v_[i]; }
+  Point& velocity(size_type i) { return v_[i]; }
+  double mass(size_type i) const { return mass_[i]; }
+  bool is_fixed(size_type i) const { return free_[i] == 0; }
+
+  /** The springs of node i are [spring_begin(i), spring_end(i)), to
+   * spring_node(k) with stiffness spring_K(k) and rest length spring_L(k). */
+  size_type spring_begin(size_type i) const { return offsets_[i]; }
+  size_type spring_end(size_type i) const { return offsets_[i + 1]; }
+  size_type spring_node(size_type k) const { return neighbors_[k]; }
+  double spring_K(size_type k) const { return K_[k]; }
+  double spring_L(size_type k) const { return L_[k]; }
+
+  /** The force of spring k on node i at the positions of the last
+   * update_spring_forces().
+   * @pre spring_begin(i) <= k < spring_end(i) */
+  Point spring_force(size_type i, size_type k) const {
+    return i < neighbors_[k] ? force_[k] : -force_[twin_[k]];
+  }
+
+  /** Evaluate Hooke's law for every spring once, at the current positions,
+   * from its end with the lower index and with that end's K and L. The
+   * other end gets the opposite force from spring_force().
+   *
+   * Complexity: O(size() + number of springs), in parallel; each spring is
+   * written by the thread of its lower end only.
+   */
+  void update_spring_forces() {
+    CME212_PROFILE_SCOPE("ms.springs");
+    const size_type n = size();
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < n; ++i) {
+      const Point xi = x_[i];
+      for (size_type k = offsets_[i]; k < offsets_[i + 1]; ++k) {
+        if (neighbors_[k] < i)
+          continue;
+        const Point& xj = x_[neighbors_[k]];
+        double dx = xi.x - xj.x, dy = xi.y - xj.y, dz = xi.z - xj.z;
+        double len = std::sqrt(dx * dx + dy * dy + dz * dz);
+        double c = K_[k] * (L_[k] / len - 1);
+        force_[k] = Point(c * dx, c * dy, c * dz);
+      }
+    }
+  }
+
+  /** Call force.prepare(*this), before the forces of a step are evaluated
+   * at the current positions and velocities. step() does this itself. */
+  template <typename E>
+  void prepare(const ForceExpr<E>& force) {
+    force.derived().prepare(*this);
+  }
+
+  /** Advance the system by one symplectic Euler step with the force
+   * expression @a force.
+   * @return t + dt
+   *
+   * Kicks then drifts,
+   *   v^{n+1} = v^n + F(x^n, t) * dt / m
+   *   x^{n+1} = x^n + v^{n+1} * dt
+   * in one pass over the nodes. Forces read x^n and the new positions go to
+   * a second buffer, swapped in at the end, so no node sees a neighbor's
+   * x^{n+1} early. Fixed nodes get velocity zero, and so don't move, through
+   * a mask rather than a test.
+   *
+   * Complexity: O(size() + number of springs), in parallel.
+   */
+  template <typename E>
+  double step(double t, double dt, const ForceExpr<E>& force) {
+    CME212_PROFILE_SCOPE("ms.step");
+    prepare(force);
+    step_range(t, dt, force, 0, size());
+    swap_positions();
+    return t + dt;
+  }
+
+  /** The update of step() for the nodes [@a first, @a last) only. Their
+   * new velocities are written in place and their new positions to a second
+   * buffer, read by next_position(i), which swap_positions() makes current.
+   * Ranges may be done in any order before the swap, e.g. the nodes
+   * another process needs first.
+   * @pre prepare(@a force) was called since the positions last changed.
+   *
+   * Complexity: O(last - first + their springs), in parallel.
+   */
+  template <typename E>
+  void step_range(double t, double dt, const ForceExpr<E>& force,
+                  size_type first, size_type last) {
+    const E& f = force.derived();
+    #pragma omp parallel for schedule(static)
+    for (size_type i = first; i < last; ++i) {
+      Point v = free_[i] * v_[i] + (dt * inv_mass_[i]) * f(*this, i, t);
+      v_[i] = v;
+      x_next_[i] = x_[i] + dt * v;
+    }
+  }
+
+  /** The position of node i after the current step_range() calls. */
+  const Point& next_position(size_type i) const { return x_next_[i]; }
+
+  /** Make the positions computed by step_range() current. Nodes outside
+   * every range get stale positions, to be overwritten. */
+  void swap_positions() {
+    x_.swap(x_next_);
+  }
+
+  /** Return @a cfl times the largest time step for which step() stays
+   * stable.
+   *
+   * Symplectic Euler is stable while dt < 2 / w, for w the highest angular
+   * frequency of the springs. The eigenvalues w^2 of M^{-1} K are bounded
+   * by its largest Gershgorin row sum, 2 sum_k K_k / m_i over the springs
+   * of the free node i, whatever the springs' directions. Gravity and
+   * damping don't lower the bound. Complexity: O(1), the bound is computed
+   * by the constructor.
+   */
+  double stable_dt(double cfl = 0.5) const {
+    return omega2_ > 0 ? cfl * 2 / std::sqrt(omega2_)
+                       : std::numeric_limits<double>::infinity();
+  }
+
+  /** Return stable_dt(@a cfl), or less if a spring would change in length
+   * by more than @a max_move times its rest length in one step, at the
+   * current velocities. The second limit follows how fast the mesh deforms,
+   * not how fast it moves as a whole, and keeps nodes from stepping through
+   * each other before the collisions see them.
+   *
+   * Complexity: O(size() + number of springs), in parallel.
+   */
+  double adaptive_dt(double cfl = 0.5, double max_move = 0.1) const {
+    CME212_PROFILE_SCOPE("ms.adaptive_dt");
+    // Largest squared strain rate, |vi - vj|^2 / L^2
+    double rate2 = 0;
+    const size_type n = size();
+    #pragma omp parallel for schedule(static) reduction(max:rate2)
+    for (size_type i = 0; i < n; ++i) {
+      for (size_type k = offsets_[i]; k < offsets_[i + 1]; ++k)
+        rate2 = std::max(rate2, normSq(v_[i] - v_[neighbors_[k]]) / (L_[k] * L_[k]));
+    }
+    double dt = stable_dt(cfl);
+    if (rate2 > 0)
+      dt = std::min(dt, max_move / std::sqrt(rate2));
+    return dt;
+  }
+
+  /** Copy the positions and velocities back to the nodes of @a g. */
+  template <typename G>
+  void store(G& g) const {
+    assert(g.num_nodes() == size());
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < size(); ++i) {
+      auto node = g.node(i);
+      node.position() = x_[i];
+      node.value().vel = v_[i];
+    }
+  }
+
+  /** Copy the positions and velocities of the nodes of @a g, e.g. after a
+   * constraint has changed them. Fixed nodes are set back to rest. */
+  template <typename G>
+  void load(const G& g) {
+    assert(g.num_nodes() == size());
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < size(); ++i) {
+      auto node = g.node(i);
+      x_[i] = node.position();
+      v_[i] = free_[i] * node.value().vel;
+    }
+  }
+
+ private:
+  std::vector<Point> x_;
+  std::vector<Point> x_next_;
+  std::vector<Point> v_;
+  std::vector<double> mass_;
+  // 1/mass_ for free nodes, 0 for fixed ones
+  std::vector<double> inv_mass_;
+  // 1 for free nodes, 0 for fixed ones
+  std::vector<double> free_;
+
+  // Springs in compressed rows, both directions
+  std::vector<size_type> offsets_;
+  std::vector<size_type> neighbors_;
+  std::vector<double> K_;
+  std::vector<double> L_;
+  // twin_[k] is spring k from its other end; force_[k] its force on the
+  // lower end, for the springs stored at their lower end only
+  std::vector<size_type> twin_;
+  std::vector<Point> force_;
+
+  // Bound on the squared highest spring frequency
+  double omega2_;
+};
@@ -0,0 +1,312 @@
+#pragma once
+/** @file MassSpringImplicit.hpp
+ * @brief Linearized backward Euler steps for a MassSpringSystem, solved
+ *   with the MTL/ITL conjugate gradient like the Poisson problem of
+ *   poisson.cpp.
+ *
+ * An explicit step() is only stable for dt below stable_dt(1), which on the
+ * fine grids is far below what the motion needs. A backward Euler step
+ * stays stable at any dt, at the cost of one linear solve:
+ *
+ *   BackwardEuler implicit;
+ *   t = implicit.step(system, t, dt, force);
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <omp.h>
+
+#include <boost/numeric/mtl/mtl.hpp>
+#include <boost/numeric/itl/itl.hpp>
+
+#include "CME212/Point.hpp"
+
+#include "MassSpring.hpp"
+#include "Profile.hpp"
+
+/** @class MassSpringMatrix
+ * @brief The matrix A = M + dt^2 K of a backward Euler step, applied
+ *   matrix-free from the springs of a MassSpringSystem.
+ *
+ * Unknowns are the velocity changes of the nodes, three per node, node i's
+ * at 3i, 3i+1, 3i+2. M is the diagonal of masses and K the stiffness of the
+ * springs at the current positions. Each spring from i to j, with unit
+ * direction u, stiffness k and rest length L, adds the 3x3 block
+ *   k u u^T + k max(0, 1 - L/|xi - xj|) (I - u u^T)
+ * to K_ii and its negative to K_ij. The transverse part is dropped when
+ * the spring is compressed, as it would make K indefinite, so A is
+ * symmetric positive definite as CG requires. Rows of fixed nodes are the
+ * identity and their columns are zero.
+ */
+class MassSpringMatrix {
+
+public:
+  typedef unsigned index_type;
+
+  MassSpringMatrix(const MassSpringSystem* s, double dt)
+    : s_(s), dt2_(dt * dt){
+  }
+
+  /** Helper function to perform multiplication. Allows for delayed
+    * evaluation of results.
+    * Assign::apply(a, b) resolves to an assignment operation such as
+    * a += b, a -= b, or a = b.
+    * @pre @a size(v) == size(w) == num_rows() */
+  template <typename VectorIn, typename VectorOut, typename Assign>
+  void mult(const VectorIn& v, VectorOut& w, Assign) const{
+    CME212_PROFILE_SCOPE("ms.implicit.matvec");
+    const index_type n = s_->size();
+    assert(mtl::size(v) == num_rows());
+    assert(mtl::size(w) == num_rows());
+    #pragma omp parallel for schedule(static)
+    for(index_type i = 0; i < n; ++i){
+      Point y = at(v, i);
+      if(not s_->is_fixed(i)){
+        y = s_->mass(i) * y + dt2_ * stiffness(i, [&](index_type j){
+          return at(v, j);
+        });
+      }
+      Assign::apply(w[3*i], y.x);
+      Assign::apply(w[3*i+1], y.y);
+      Assign::apply(w[3*i+2], y.z);
+    }
+  }
+
+  /* Matvec forwards to MTL's lazy mat_cvec_multiplier operator */
+  template <typename Vector>
+  mtl::vec::mat_cvec_multiplier<MassSpringMatrix, Vector>
+  operator *(const Vector& v) const{
+    return {*this, v};
+  }
+
+  /** Return row i of K times @a p, where p(j) is the part of the vector at
+   * node j. Parts at fixed nodes are taken as zero. */
+  template <typename P>
+  Point stiffness(index_type i, P p) const{
+    const Point& xi = s_->position(i);
+    const Point pi = p(i);
+    Point y(0, 0, 0);
+    for(index_type k = s_->spring_begin(i); k < s_->spring_end(i); ++k){
+      index_type j = s_->spring_node(k);
+      Point u = xi - s_->position(j);
+      double len = norm(u);
+      u /= len;
+      double a = s_->spring_K(k);
+      double b = a * std::max(0.0, 1 - s_->spring_L(k) / len);
+      Point q = s_->is_fixed(j) ? pi : pi - p(j);
+      y += b * q + ((a - b) * dot(u, q)) * u;
+    }
+    return y;
+  }
+
+  /** Return the diagonal entry of row @a r. */
+  double diagonal(size_t r) const{
+    const index_type i = r / 3, d = r % 3;
+    if(s_->is_fixed(i)) return 1.0;
+    const Point& xi = s_->position(i);
+    double sum = 0;
+    for(index_type k = s_->spring_begin(i); k < s_->spring_end(i); ++k){
+      Point u = xi - s_->position(s_->spring_node(k));
+      double len = norm(u);
+      double a = s_->spring_K(k);
+      double b = a * std::max(0.0, 1 - s_->spring_L(k) / len);
+      sum += b + (a - b) * (u[d] / len) * (u[d] / len);
+    }
+    return s_->mass(i) + dt2_ * sum;
+  }
+
+  size_t num_rows() const{
+    return 3 * size_t(s_->size());
+  }
+
+  size_t num_cols() const{
+    return num_rows();
+  }
+
+  size_t m_size() const{
+    return num_rows() * num_cols();
+  }
+
+private:
+  template <typename Vector>
+  static Point at(const Vector& v, index_type i){
+    return Point(v[3*i], v[3*i+1], v[3*i+2]);
+  }
+
+  const MassSpringSystem* s_;
+  double dt2_;
+};
+
+/* The number of rows in the matrix. */
+inline std::size_t num_rows(const MassSpringMatrix& A){
+  return A.num_rows();
+}
+
+/* The number of columns in the matrix. */
+inline std::size_t num_cols(const MassSpringMatrix& A){
+  return A.num_cols();
+}
+
+/* The number of elements in the matrix. */
+inline std::size_t size(const MassSpringMatrix& A){
+  return A.m_size();
+}
+
+/* Traits that MTL uses to determine properties of our MassSpringMatrix. */
+namespace mtl {
+  namespace ashape {
+    /* Define MassSpringMatrix to be a non-scalar type. */
+    template <>
+      struct ashape_aux <MassSpringMatrix> {
+      typedef nonscal type;
+      };
+  } // end namespace ashape
+
+  /* MassSpringMatrix implements the Collection concept
+   * with value_type and size_type */
+  template <>
+  struct Collection <MassSpringMatrix> {
+    typedef double value_type;
+    typedef unsigned size_type;
+  };
+} // end namespace mtl
+
+namespace itl {
+  namespace pc {
+
+  /** Jacobi preconditioner for MassSpringMatrix: M = diag(A). */
+  class mass_spring_diagonal {
+  public:
+    explicit mass_spring_diagonal(const MassSpringMatrix& A)
+      : inv_diag_(A.num_rows()) {
+      #pragma omp parallel for schedule(static)
+      for(size_t r = 0; r < inv_diag_.size(); ++r){
+        inv_diag_[r] = 1.0 / A.diagonal(r);
+      }
+    }
+
+    /** Compute @a x = M^{-1} @a b. */
+    template <typename VectorIn, typename VectorOut>
+    void solve(const VectorIn& b, VectorOut& x) const{
+      const size_t n = inv_diag_.size();
+      #pragma omp parallel for schedule(static)
+      for(size_t r = 0; r < n; ++r){
+        x[r] = inv_diag_[r] * b[r];
+      }
+    }
+
+    /** M is symmetric, so the adjoint solve is the same. */
+    template <typename VectorIn, typename VectorOut>
+    void adjoint_solve(const VectorIn& b, VectorOut& x) const{
+      solve(b, x);
+    }
+
+  private:
+    std::vector<double> inv_diag_;
+  };
+
+  /** Lazy z = solve(P, r) as used inside the ITL Krylov solvers. */
+  template <typename Vector>
+  inline solver<mass_spring_diagonal, Vector, false>
+  solve(const mass_spring_diagonal& P, const Vector& b){
+    return solver<mass_spring_diagonal, Vector, false>(P, b);
+  }
+
+  template <typename Vector>
+  inline solver<mass_spring_diagonal, Vector, true>
+  adjoint_solve(const mass_spring_diagonal& P, const Vector& b){
+    return solver<mass_spring_diagonal, Vector, true>(P, b);
+  }
+
+  } // end namespace pc
+} // end namespace itl
+
+
+/** @class BackwardEuler
+ * @brief Takes linearized backward Euler steps of a MassSpringSystem.
+ *
+ * One Newton iteration of
+ *   v^{n+1} = v^n + F(x^{n+1}, t) * dt / m
+ *   x^{n+1} = x^n + v^{n+1} * dt
+ * with the spring forces linearized at x^n: the velocity change dv solves
+ *   (M + dt^2 K) dv = dt (F(x^n, t) - dt K v^n)
+ * by Jacobi preconditioned CG. The rest of the force expression, gravity or
+ * damping, is taken at x^n and v^n as in MassSpringSystem::step(). The
+ * step is stable for any dt but damps the fastest spring modes, more so as
+ * dt grows.
+ */
+class BackwardEuler {
+ public:
+  typedef unsigned size_type;
+
+  /** @param[in] tol      Relative residual at which CG stops.
+   *  @param[in] max_iter Most CG iterations per step. */
+  explicit BackwardEuler(double tol = 1e-8, int max_iter = 500)
+      : tol_(tol), max_iter_(max_iter), iterations_(0) {
+  }
+
+  /** Advance @a s by one step of length @a dt with the force expression
+   * @a force, which must include SpringTerm().
+   * @return t + dt
+   *
+   * Complexity: O(CG iterations * (size() + number of springs)), in
+   * parallel.
+   */
+  template <typename E>
+  double step(MassSpringSystem& s, double t, double dt,
+              const ForceExpr<E>& force) {
+    CME212_PROFILE_SCOPE("ms.implicit.step");
+    const E& f = force.derived();
+    const size_type n = s.size();
+    if (mtl::size(b_) != 3 * size_t(n)) {
+      b_.change_dim(3 * n);
+      dv_.change_dim(3 * n);
+    }
+    MassSpringMatrix A(&s, dt);
+    s.prepare(f);
+
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < n; ++i) {
+      Point b(0, 0, 0);
+      if (!s.is_fixed(i)) {
+        b = dt * (f(s, i, t) - dt * A.stiffness(i, [&](size_type j) {
+          return s.velocity(j);
+        }));
+      }
+      for (int d = 0; d < 3; ++d) {
+        b_[3*i+d] = b[d];
+        dv_[3*i+d] = 0;
+      }
+    }
+
+    itl::pc::mass_spring_diagonal P(A);
+    itl::basic_iteration<double> iter(b_, max_iter_, tol_);
+    itl::cg(A, dv_, b_, P, iter);
+    iterations_ = iter.iterations();
+    CME212_PROFILE_COUNT("ms.implicit.cg_iterations", iterations_);
+
+    #pragma omp parallel for schedule(static)
+    for (size_type i = 0; i < n; ++i) {
+      if (s.is_fixed(i))
+        continue;
+      s.velocity(i) += Point(dv_[3*i], dv_[3*i+1], dv_[3*i+2]);
+      s.position(i) += dt * s.velocity(i);
+    }
+    return t + dt;
+  }
+
+  /** The number of CG iterations of the last step. */
+  int iterations() const {
+    return iterations_;
+  }
+
+ private:
+  double tol_;
+  int max_iter_;
+  int iterations_;
+  // Right-hand side and solution of the last step
+  mtl::vec::dense_vector<double> b_;
+  mtl::vec::dense_vector<double> dv_;
+};
@@ -0,0 +1,327 @@
+#pragma once
+/** @file MeshIO.hpp
+ * @brief Fast loading of .nodes/.tets meshes in text or binary form.
+ *
+ * Text formats are the ones in data/: one node per line as three coordinates,
+ * one tetrahedron per line as four node indices, with blank lines and lines
+ * starting with '#' ignored, exactly like CME212::getline_parsed.
+ *
+ * Binary formats are an 8 byte magic ("CME212ND" for nodes, "CME212TT" for
+ * tets), a uint64_t item count, then count*3 doubles or count*4 uint32_t in
+ * native byte order. Use write_nodes_binary/write_tets_binary (or the
+ * mesh_convert executable) to produce them.
+ *
+ * read_nodes and read_tets memory-map the file, detect the format from the
+ * magic and parse text in parallel chunks without any per-line allocation.
+ */
+
+#include <vector>
+#include <array>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CME212/Point.hpp"
+
+/** Type of one tetrahedron: four node indices. */
+using tet_type = std::array<unsigned, 4>;
+
+/** @class MappedFile
+ * @brief Read-only memory map of a whole file.
+ *
+ * Not copyable. The mapping is released when the MappedFile is destroyed.
+ */
+class MappedFile {
+ public:
+  /** Map the file at @a path. Check is_open() for success. */
+  explicit MappedFile(const std::string& path)
+      : data_(nullptr), size_(0), open_(false) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    struct stat st;
+    if(::fstat(fd, &st) == 0){
+      open_ = true;
+      if(st.st_size > 0){
+        void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED){
+          ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+          data_ = static_cast<const char*>(p);
+          size_ = st.st_size;
+        } else {
+          open_ = false;
+        }
+      }
+    }
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if(data_) ::munmap(const_cast<char*>(data_), size_);
+  }
+
+  /** Return true if the file exists and was mapped (empty files count). */
+  bool is_open() const { return open_; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  std::size_t size_;
+  bool open_;
+};
+
+namespace detail {
+
+static constexpr char nodes_magic[8] = {'C','M','E','2','1','2','N','D'};
+static constexpr char tets_magic[8]  = {'C','M','E','2','1','2','T','T'};
+
+inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline bool is_digit(char c) {
+  return unsigned(c - '0') < 10;
+}
+
+/** Parse an unsigned 32-bit integer at @a p, advancing @a p past it. */
+inline bool parse_number(const char*& p, const char* end, unsigned& v) {
+  const char* q = p;
+  if(q != end && *q == '+') ++q;
+  uint64_t x = 0;
+  const char* first = q;
+  for(; q != end && is_digit(*q); ++q){
+    x = 10*x + (*q - '0');
+    if(x > 0xFFFFFFFFull) return false;
+  }
+  if(q == first) return false;
+  v = unsigned(x);
+  p = q;
+  return true;
+}
+
+/** Parse a double at @a p, advancing @a p past it.
+ *
+ * Decimal numbers with at most 19 significant digits and a small exponent
+ * (which covers every file in data/) are converted with a single correctly
+ * rounded multiplication or division. Anything else is handed to strtod.
+ */
+inline bool parse_number(const char*& p, const char* end, double& v) {
+  static const double pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  const char* q = p;
+  bool neg = false;
+  if(q != end && (*q == '-' || *q == '+')) neg = (*q++ == '-');
+  uint64_t mant = 0;
+  int sig = 0, exp10 = 0;
+  bool any = false, exact = true;
+  for(; q != end && is_digit(*q); ++q){
+    any = true;
+    if(sig < 19){
+      mant = 10*mant + (*q - '0');
+      sig += (mant != 0);
+    } else {
+      ++exp10;
+      exact = exact && *q == '0';
+    }
+  }
+  if(q != end && *q == '.'){
+    for(++q; q != end && is_digit(*q); ++q){
+      any = true;
+      if(sig < 19){
+        mant = 10*mant + (*q - '0');
+        sig += (mant != 0);
+        --exp10;
+      } else {
+        exact = exact && *q == '0';
+      }
+    }
+  }
+  if(q != end && (*q == 'e' || *q == 'E') && any){
+    const char* r = q + 1;
+    bool eneg = false;
+    if(r != end && (*r == '-' || *r == '+')) eneg = (*r++ == '-');
+    if(r == end || !is_digit(*r)) return false;
+    int e = 0;
+    for(; r != end && is_digit(*r); ++r){
+      if(e < 100000) e = 10*e + (*r - '0');
+    }
+    exp10 += eneg ? -e : e;
+    q = r;
+  }
+
+  if(any && exact && mant < (uint64_t(1) << 53) && exp10 >= -22 && exp10 <= 22){
+    double d = double(mant);
+    d = exp10 < 0 ? d / pow10[-exp10] : d * pow10[exp10];
+    v = neg ? -d : d;
+    p = q;
+    return true;
+  }
+
+  // Slow path: long mantissas, large exponents, inf/nan, ...
+  q = p;
+  while(q != end && !is_blank(*q) && *q != '\n') ++q;
+  char buf[64];
+  std::size_t len = q - p;
+  if(len == 0 || len >= sizeof(buf)) return false;
+  std::memcpy(buf, p, len);
+  buf[len] = '\0';
+  char* stop;
+  v = std::strtod(buf, &stop);
+  if(stop == buf) return false;
+  p += (stop - buf);
+  return true;
+}
+
+/** Parse N numbers from the line starting at @a p into @a out. */
+template <typename T, std::size_t N>
+bool parse_fields(const char* p, const char* eol, T* out) {
+  for(std::size_t k = 0; k < N; ++k){
+    while(p != eol && is_blank(*p)) ++p;
+    if(!parse_number(p, eol, out[k])) return false;
+  }
+  return true;
+}
+
+inline bool parse_item(const char* p, const char* eol, Point& out) {
+  return parse_fields<double, 3>(p, eol, out.elem);
+}
+
+inline bool parse_item(const char* p, const char* eol, tet_type& out) {
+  return parse_fields<unsigned, 4>(p, eol, out.data());
+}
+
+/** Parse every line of [first, last) into @a out.
+ * Stops at the first line that does not parse and returns false. */
+template <typename Item>
+bool parse_lines(const char* first, const char* last, std::vector<Item>& out) {
+  Item item;
+  while(first != last){
+    const char* eol = static_cast<const char*>(std::memchr(first, '\n', last - first));
+    if(eol == nullptr) eol = last;
+    const char* p = first;
+    while(p != eol && is_blank(*p)) ++p;
+    if(p != eol && *p != '#'){
+      if(!parse_item(p, eol, item)) return false;
+      out.push_back(item);
+    }
+    first = (eol == last) ? last : eol + 1;
+  }
+  return true;
+}
+
+/** Parse a text file, splitting it into one chunk per thread at newlines.
+ * Items up to the first malformed line are kept, as with getline_parsed. */
+template <typename Item>
+bool parse_text(const char* first, const char* last, std::vector<Item>& out) {
+  const std::size_t min_chunk = std::size_t(1) << 20;
+  std::size_t len = last - first;
+  int nchunks = std::max<int>(1, std::min<std::size_t>(omp_get_max_threads(),
+                                                       len / min_chunk));
+  std::vector<const char*> cut(nchunks + 1, last);
+  cut[0] = first;
+  for(int k = 1; k < nchunks; ++k){
+    const char* c = std::max(first + len / nchunks * k, cut[k - 1]);
+    const char* nl = static_cast<const char*>(std::memchr(c, '\n', last - c));
+    cut[k] = nl ? nl + 1 : last;
+  }
+
+  std::vector<std::vector<Item>> parts(nchunks);
+  std::vector<char> ok(nchunks, 1);
+  #pragma omp parallel for schedule(static, 1)
+  for(int k = 0; k < nchunks; ++k){
+    parts[k].reserve(std::count(cut[k], cut[k + 1], '\n') + 1);
+    ok[k] = parse_lines(cut[k], cut[k + 1], parts[k]);
+  }
+
+  std::size_t total = 0;
+  int used = 0;
+  while(used < nchunks){
+    total += parts[used].size();
+    if(!ok[used++]) break;
+  }
+  out.clear();
+  out.reserve(total);
+  for(int k = 0; k < used; ++k){
+    out.insert(out.end(), parts[k].begin(), parts[k].end());
+  }
+  return ok[used - 1];
+}
+
+/** Copy a binary file body of @a count items of @a Scalar[N] into @a out. */
+template <typename Item, typename Scalar, std::size_t N>
+bool read_binary(const MappedFile& f, std::vector<Item>& out) {
+  static_assert(sizeof(Item) == N * sizeof(Scalar), "Item must be packed");
+  uint64_t count;
+  std::memcpy(&count, f.begin() + 8, sizeof(count));
+  if(count > (f.size() - 16) / sizeof(Item) ||
+     f.size() != 16 + count * sizeof(Item)) return false;
+  out.resize(count);
+  if(count) std::memcpy(&out[0], f.begin() + 16, count * sizeof(Item));
+  return true;
+}
+
+template <typename Item>
+bool write_binary(const std::string& path, const char* magic,
+                  const std::vector<Item>& items) {
+  std::ofstream os(path, std::ios::binary);
+  uint64_t count = items.size();
+  os.write(magic, 8);
+  os.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  if(count) os.write(reinterpret_cast<const char*>(&items[0]), count * sizeof(Item));
+  return bool(os);
+}
+
+template <typename Item, typename Scalar, std::size_t N>
+bool read_mesh_file(const std::string& path, const char* magic,
+                    std::vector<Item>& out) {
+  out.clear();
+  MappedFile f(path);
+  if(!f.is_open()) return false;
+  if(f.size() >= 16 && std::memcmp(f.begin(), magic, 8) == 0)
+    return read_binary<Item, Scalar, N>(f, out);
+  return parse_text(f.begin(), f.end(), out);
+}
+
+} // end namespace detail
+
+/** Read the nodes file at @a path, text or binary, into @a nodes.
+ * @return false if the file can't be opened or has a malformed line; in
+ *         the latter case @a nodes holds the nodes before that line.
+ */
+inline bool read_nodes(const std::string& path, std::vector<Point>& nodes) {
+  return detail::read_mesh_file<Point, double, 3>(path, detail::nodes_magic, nodes);
+}
+
+/** Read the tets file at @a path, text or binary, into @a tets.
+ * @return false if the file can't be opened or has a malformed line; in
+ *         the latter case @a tets holds the tets before that line.
+ */
+inline bool read_tets(const std::string& path, std::vector<tet_type>& tets) {
+  return detail::read_mesh_file<tet_type, unsigned, 4>(path, detail::tets_magic, tets);
+}
+
+/** Write @a nodes to @a path in the binary nodes format. */
+inline bool write_nodes_binary(const std::string& path,
+                               const std::vector<Point>& nodes) {
+  return detail::write_binary(path, detail::nodes_magic, nodes);
+}
+
+/** Write @a tets to @a path in the binary tets format. */
+inline bool write_tets_binary(const std::string& path,
+                              const std::vector<tet_type>& tets) {
+  return detail::write_binary(path, detail::tets_magic, tets);
+}
@@ -6,8 +6,13 @@
  */
 
 #include <cstdint>
+#include <cstddef>
 #include <climits>
 #include <cassert>
+#include <type_traits>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 #include "CME212/Point.hpp"
 #include "CME212/BoundingBox.hpp"
@@ -15,20 +20,94 @@
 
 namespace detail {
 
+/** Pick the narrowest unsigned type that holds a 3*L-bit Morton code. */
+template <int L>
+struct morton_code_type {
+  typedef typename std::conditional<(L <= 10), uint32_t, uint64_t>::type type;
+};
+
+/** Properties of the supported code types. */
+template <typename C> struct morton_traits;
+template <> struct morton_traits<uint32_t> {
+  /** The number of 3D levels that fit in the type. */
+  static constexpr int max_levels = 10;
+  // 0x09249249 = 0b001001001001001001001001001001
+  static constexpr uint32_t coordinate_mask = 0x09249249;
+};
+template <> struct morton_traits<uint64_t> {
+  static constexpr int max_levels = 21;
+  // 0x1249249249249249 = 0b0001001001...001001
+  static constexpr uint64_t coordinate_mask = 0x1249249249249249;
+};
+
+/** Branch-free version of spread_bits using shifts and magic masks.
+ *   Always available, and vectorizable when applied to arrays.
+ */
+inline uint32_t spread_bits_mask(uint32_t x) {
+  x &= 0x000003ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x <<  8)) & 0x0300f00f;
+  x = (x | (x <<  4)) & 0x030c30c3;
+  x = (x | (x <<  2)) & 0x09249249;
+  return x;
+}
+
+/** 64-bit spread_bits_mask: spreads the first 21 bits of @a x. */
+inline uint64_t spread_bits_mask(uint64_t x) {
+  x &= 0x00000000001fffff;
+  x = (x | (x << 32)) & 0x001f00000000ffff;
+  x = (x | (x << 16)) & 0x001f0000ff0000ff;
+  x = (x | (x <<  8)) & 0x100f00f00f00f00f;
+  x = (x | (x <<  4)) & 0x10c30c30c30c30c3;
+  x = (x | (x <<  2)) & 0x1249249249249249;
+  return x;
+}
+
+/** Branch-free version of compact_bits using shifts and magic masks. */
+inline uint32_t compact_bits_mask(uint32_t x) {
+  x &= 0x09249249;
+  x = (x | (x >>  2)) & 0x030c30c3;
+  x = (x | (x >>  4)) & 0x0300f00f;
+  x = (x | (x >>  8)) & 0x030000ff;
+  x = (x | (x >> 16)) & 0x000003ff;
+  return x;
+}
+
+/** 64-bit compact_bits_mask: compacts every third bit into the low 21. */
+inline uint64_t compact_bits_mask(uint64_t x) {
+  x &= 0x1249249249249249;
+  x = (x | (x >>  2)) & 0x10c30c30c30c30c3;
+  x = (x | (x >>  4)) & 0x100f00f00f00f00f;
+  x = (x | (x >>  8)) & 0x001f0000ff0000ff;
+  x = (x | (x >> 16)) & 0x001f00000000ffff;
+  x = (x | (x >> 32)) & 0x00000000001fffff;
+  return x;
+}
+
 /** Spreads the first 10-bits of a 32-bit number so that there are two 0s
  *   in between each bit.
  * @param[in] x 32-bit integer of the form 0b0000000000000000000000ABCDEFGHIJ
  * @returns     32-bit integer of the form 0b0000A00B00C00D00E00F00G00H00I00J,
  *   where each A,...,J is the corresponding bit from @a x
+ *
+ * Uses a single BMI2 PDEP instruction when compiled with BMI2 support
+ * (e.g. -mbmi2 or -march=native on Haswell and later).
  */
 inline uint32_t spread_bits(uint32_t x) {
-  uint32_t y = 0;
-  for(int i = 9; i >= 0; --i){
-    uint32_t temp = x & (1 << i);
-    temp <<= 2 * i;
-    y |= temp;
-  }
-  return y;
+#if defined(__BMI2__)
+  return _pdep_u32(x, 0x09249249);
+#else
+  return spread_bits_mask(x);
+#endif
+}
+
+/** 64-bit spread_bits: spreads the first 21 bits of @a x. */
+inline uint64_t spread_bits(uint64_t x) {
+#if defined(__BMI2__)
+  return _pdep_u64(x, 0x1249249249249249);
+#else
+  return spread_bits_mask(x);
+#endif
 }
 
 /** Compacts every third bit in a 32-bit integer to the lowest 10-bits.
@@ -36,13 +115,24 @@ inline uint32_t spread_bits(uint32_t x) {
  * @param[in] x 32-bit integer of form 0bXXXXAXXBXXCXXDXXEXXFXXGXXHXXIXXJ
  * @returns     32-bit integer of form 0b0000000000000000000000ABCDEFGHIJ
  *   where each A,...,J is the corresponding bit from @a x
+ *
+ * Uses a single BMI2 PEXT instruction when compiled with BMI2 support.
  */
 inline uint32_t compact_bits(uint32_t x) {
-  uint32_t y = 0;
-  for(int i = 9; i >= 0; --i){
-    y |= (x & (1 << (3 * i))) >> (2 * i);
-  }
-  return y;
+#if defined(__BMI2__)
+  return _pext_u32(x, 0x09249249);
+#else
+  return compact_bits_mask(x);
+#endif
+}
+
+/** 64-bit compact_bits: compacts every third bit into the low 21 bits. */
+inline uint64_t compact_bits(uint64_t x) {
+#if defined(__BMI2__)
+  return _pext_u64(x, 0x1249249249249249);
+#else
+  return compact_bits_mask(x);
+#endif
 }
 
 /** Smears the bits in c into the low bits by steps of one
@@ -58,6 +148,16 @@ inline uint32_t smear_low_1(uint32_t c) {
   return c;
 }
 
+inline uint64_t smear_low_1(uint64_t c) {
+  c |= c >>  1;
+  c |= c >>  2;
+  c |= c >>  4;
+  c |= c >>  8;
+  c |= c >> 16;
+  c |= c >> 32;
+  return c;
+}
+
 /** Smears the bits in c into the low bits by steps of three
  *
  * Example: 0000010000000000 -> 0000010010010010
@@ -70,6 +170,15 @@ inline uint32_t smear_low_3(uint32_t c) {
   return c;
 }
 
+inline uint64_t smear_low_3(uint64_t c) {
+  c |= c >>  3;
+  c |= c >>  6;
+  c |= c >> 12;
+  c |= c >> 24;
+  c |= c >> 48;
+  return c;
+}
+
 } // end namespace detail
 
 
@@ -101,16 +210,21 @@ inline uint32_t smear_low_3(uint32_t c) {
  * This class computes maps box numbers to point and visa-versa
  * with respect to a bounding box and the number of equal-volume boxes (8^L).
  * These mappings are performed in O(1) time.
+ *
+ * The code type @a C defaults to uint32_t for up to 10 levels and to
+ * uint64_t for 11 to 21 levels. A uint64_t can be requested explicitly for
+ * fewer levels too.
  */
-template <int L = 5>
+template <int L = 5, typename C = typename detail::morton_code_type<L>::type>
 class MortonCoder {
-  // Using a 32-bit unsigned int for the code_type
-  // means we can only resolve 10 3D levels
-  static_assert(L >= 1 && L <= 10, "L (LEVELS) must be between 1 and 10");
+  // A code stores 3 bits per level: a 32-bit code_type resolves 10 3D
+  // levels and a 64-bit code_type resolves 21.
+  static_assert(L >= 1 && L <= detail::morton_traits<C>::max_levels,
+                "L (LEVELS) must be between 1 and 10 (uint32_t) or 21 (uint64_t)");
 
  public:
-  /** The type to use for the Morton codes -- allows 30-bit codes */
-  using code_type = uint32_t;
+  /** The type to use for the Morton codes -- allows 30- or 63-bit codes */
+  using code_type = C;
 
   /** The number of bits per dimension [octree subdivisions]. #cells = 8^L. */
   static constexpr int levels = L;
@@ -148,11 +262,46 @@ class MortonCoder {
     assert(bounding_box().contains(p));
     p -= pmin_;
     p /= cell_size_;
+    // Points on the upper faces of the box belong to the last cell
+    const double cmax = cells_per_side - 1;
+    p.x = p.x < cmax ? p.x : cmax;
+    p.y = p.y < cmax ? p.y : cmax;
+    p.z = p.z < cmax ? p.z : cmax;
     return interleave(p);
   }
 
-  // 0x09249249 = 0b001001001001001001001001001001
-  static constexpr code_type coordinate_mask = 0x09249249;
+  /** Compute the Morton codes of the @a n Points in @a in.
+   * @param[in]  in  Array of @a n Points
+   * @param[out] out Array of @a n codes; out[i] == code(in[i])
+   * @pre For all 0 <= i < @a n, bounding_box().contains(@a in[i])
+   *
+   * The quantize-and-interleave loop has no branches or calls, so the
+   * compiler can vectorize it across Points.
+   */
+  void code(const Point* in, code_type* out, std::size_t n) const {
+#ifndef NDEBUG
+    for (std::size_t i = 0; i < n; ++i)
+      assert(bounding_box().contains(in[i]));
+#endif
+    const double x0 = pmin_.x, y0 = pmin_.y, z0 = pmin_.z;
+    const double hx = cell_size_.x, hy = cell_size_.y, hz = cell_size_.z;
+    const double cmax = cells_per_side - 1;
+    #pragma omp simd
+    for (std::size_t i = 0; i < n; ++i) {
+      double qx = (in[i].x - x0) / hx;
+      double qy = (in[i].y - y0) / hy;
+      double qz = (in[i].z - z0) / hz;
+      // Same clamping as code(Point)
+      qx = qx < cmax ? qx : cmax;
+      qy = qy < cmax ? qy : cmax;
+      qz = qz < cmax ? qz : cmax;
+      out[i] = detail::spread_bits_mask((code_type) qx)
+            | (detail::spread_bits_mask((code_type) qy) << 1)
+            | (detail::spread_bits_mask((code_type) qz) << 2);
+    }
+  }
+
+  static constexpr code_type coordinate_mask = detail::morton_traits<C>::coordinate_mask;
   static constexpr code_type x_mask = coordinate_mask << 0;
   static constexpr code_type y_mask = coordinate_mask << 1;
   static constexpr code_type z_mask = coordinate_mask << 2;
@@ -0,0 +1,232 @@
+#pragma once
+/** @file Partition.hpp
+ * @brief Splitting a graph into subdomains, each with a layer of ghost nodes,
+ *   for runs across several processes (see Distributed.hpp).
+ *
+ * Every node belongs to one part. A part's subdomain is its own nodes plus
+ * the ghosts, the nodes of other parts next to one of its own:
+ *
+ *   auto owner = morton_partition(graph, nprocs);
+ *   Subdomain sub(graph, owner, rank);
+ *   GraphType local = sub.local_graph(graph);
+ *
+ * The local graph numbers the subdomain's nodes so that every group a
+ * distributed algorithm treats differently is a range of indices:
+ *
+ *   [0, num_boundary())               own nodes with a ghost neighbor
+ *   [num_boundary(), num_owned())     own nodes that only see own nodes
+ *   [num_owned(), size())             ghosts, grouped by their part
+ *
+ * so the interior range can be computed while the ghosts are in flight, and
+ * the ghosts from one part can be received in place.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cassert>
+
+#include "GraphOrdering.hpp"
+
+/** Return the part of every node of @a g when it is cut into @a parts
+ * pieces along a Morton curve.
+ * @return owner, with owner[i] < @a parts the part of node i
+ *
+ * Pieces are contiguous ranges of morton_order(g), so they are compact in
+ * space and the number of ghosts grows like their surface. Each gets about
+ * the same number of nodes plus incident edges, which is the work of one
+ * mass-spring step or one matvec.
+ *
+ * Complexity: O(num_nodes() log(num_nodes()) + num_edges()).
+ */
+template <typename G>
+std::vector<unsigned> morton_partition(const G& g, unsigned parts) {
+  typedef typename G::size_type size_type;
+  assert(parts > 0);
+  const size_type n = g.num_nodes();
+  std::vector<size_type> order = morton_order(g);
+  double total = 0;
+  for(size_type i = 0; i < n; ++i){
+    total += 1 + g.node(i).degree();
+  }
+  std::vector<unsigned> owner(n);
+  double before = 0;
+  for(size_type k = 0; k < n; ++k){
+    double w = 1 + g.node(order[k]).degree();
+    // The part that holds the middle of this node's weight
+    unsigned p = unsigned((before + w / 2) / total * parts);
+    owner[order[k]] = std::min(p, parts - 1);
+    before += w;
+  }
+  return owner;
+}
+
+/** @class Subdomain
+ * @brief The nodes of one part of a graph and its ghosts, and which node
+ *   values have to travel between the part and each of its neighbors.
+ *
+ * Local index l stands for node global_index(l) of the graph. Within each
+ * of the ranges above, local indices increase with the global ones; that
+ * way both sides of a neighbor pair list the nodes they exchange in the
+ * same order.
+ */
+class Subdomain {
+ public:
+  typedef unsigned size_type;
+
+  /** Make the subdomain of @a part.
+   * @param[in] owner The part of every node of @a g, e.g. from
+   *                  morton_partition(g, parts).
+   *
+   * Complexity: O(g.num_nodes() + g.num_edges()).
+   */
+  template <typename G>
+  Subdomain(const G& g, const std::vector<unsigned>& owner, unsigned part)
+      : part_(part) {
+    const size_type n = g.num_nodes();
+    assert(owner.size() == n);
+    std::vector<size_type> interior, ghosts;
+    // Own nodes next to part p, for every p, as (p, global index)
+    std::vector<std::pair<unsigned, size_type>> sends;
+    std::vector<char> is_ghost(n, 0);
+    for(size_type i = 0; i < n; ++i){
+      if(owner[i] != part) continue;
+      bool boundary = false;
+      auto node = g.node(i);
+      for(auto it = node.edge_begin(); it != node.edge_end(); ++it){
+        size_type j = (*it).node2().index();
+        if(owner[j] == part) continue;
+        boundary = true;
+        sends.push_back(std::make_pair(owner[j], i));
+        if(!is_ghost[j]){
+          is_ghost[j] = 1;
+          ghosts.push_back(j);
+        }
+      }
+      if(boundary) global_.push_back(i);
+      else interior.push_back(i);
+    }
+    num_boundary_ = global_.size();
+    global_.insert(global_.end(), interior.begin(), interior.end());
+    num_owned_ = global_.size();
+
+    // Ghosts by part, then by index
+    std::sort(ghosts.begin(), ghosts.end(), [&owner](size_type a, size_type b){
+      return owner[a] < owner[b] || (owner[a] == owner[b] && a < b);
+    });
+    global_.insert(global_.end(), ghosts.begin(), ghosts.end());
+    for(size_type k = 0; k < ghosts.size(); ++k){
+      if(k == 0 || owner[ghosts[k]] != owner[ghosts[k-1]]){
+        neighbors_.push_back(owner[ghosts[k]]);
+        recv_offsets_.push_back(num_owned_ + k);
+      }
+    }
+    recv_offsets_.push_back(size());
+
+    // An edge between two parts is also an edge the other way, so every
+    // part we receive from is one we send to.
+    std::sort(sends.begin(), sends.end());
+    sends.erase(std::unique(sends.begin(), sends.end()), sends.end());
+    std::vector<size_type> local(n, size_type(-1));
+    for(size_type l = 0; l < size(); ++l){
+      local[global_[l]] = l;
+    }
+    send_offsets_.assign(1, 0);
+    size_type k = 0;
+    for(unsigned p : neighbors_){
+      for(; k < sends.size() && sends[k].first == p; ++k){
+        send_ids_.push_back(local[sends[k].second]);
+      }
+      send_offsets_.push_back(send_ids_.size());
+    }
+    assert(k == sends.size());
+  }
+
+  /** The part this subdomain belongs to. */
+  unsigned part() const {
+    return part_;
+  }
+  /** The number of own and ghost nodes. */
+  size_type size() const {
+    return global_.size();
+  }
+  size_type num_owned() const {
+    return num_owned_;
+  }
+  size_type num_boundary() const {
+    return num_boundary_;
+  }
+  size_type num_ghosts() const {
+    return size() - num_owned_;
+  }
+  /** The index in the whole graph of local node @a l. */
+  size_type global_index(size_type l) const {
+    return global_[l];
+  }
+
+  /** The parts with a ghost here, by increasing part. These are also the
+   * parts with a ghost of ours. */
+  const std::vector<unsigned>& neighbors() const {
+    return neighbors_;
+  }
+  /** The local own nodes neighbor k needs are send_ids()[send_begin(k)]
+   * up to send_ids()[send_end(k)], as neighbor k orders its ghosts. */
+  const std::vector<size_type>& send_ids() const {
+    return send_ids_;
+  }
+  size_type send_begin(size_type k) const {
+    return send_offsets_[k];
+  }
+  size_type send_end(size_type k) const {
+    return send_offsets_[k + 1];
+  }
+  /** The ghosts owned by neighbor k are the local nodes
+   * [recv_begin(k), recv_end(k)). */
+  size_type recv_begin(size_type k) const {
+    return recv_offsets_[k];
+  }
+  size_type recv_end(size_type k) const {
+    return recv_offsets_[k + 1];
+  }
+
+  /** Copy this subdomain out of @a g.
+   * @return A frozen graph whose node l is node global_index(l) of @a g,
+   *         with its position and value, and with every edge of @a g
+   *         between two nodes of the subdomain. Own nodes have all of
+   *         their edges, ghosts only those to the subdomain.
+   *
+   * Complexity: O(g.num_nodes() + sum of the degrees of the subdomain
+   * nodes).
+   */
+  template <typename G>
+  G local_graph(const G& g) const {
+    std::vector<char> in(g.num_nodes(), 0);
+    for(size_type i : global_){
+      in[i] = 1;
+    }
+    G local = g.view([&in](const typename G::node_type& node){
+      return in[node.index()] != 0;
+    }).subgraph();
+    // The subgraph keeps the order of g; its node q is the q-th smallest
+    // global index of the subdomain.
+    std::vector<size_type> sorted(global_);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<typename G::size_type> order(size());
+    for(size_type l = 0; l < size(); ++l){
+      order[l] = std::lower_bound(sorted.begin(), sorted.end(), global_[l])
+               - sorted.begin();
+    }
+    local.reorder(order);
+    return local;
+  }
+
+ private:
+  unsigned part_;
+  size_type num_owned_;
+  size_type num_boundary_;
+  std::vector<size_type> global_;
+  std::vector<unsigned> neighbors_;
+  std::vector<size_type> send_offsets_;
+  std::vector<size_type> send_ids_;
+  std::vector<size_type> recv_offsets_;
+};
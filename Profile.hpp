@@ -0,0 +1,295 @@
+#pragma once
+/** @file Profile.hpp
+ * @brief Scoped timers and counters for the phases of a run, compiled out
+ *   unless CME212_PROFILE is defined.
+ *
+ * Mark a phase with a scope, count events with a counter,
+ *
+ *   {
+ *     CME212_PROFILE_SCOPE("ms.step");
+ *     t = system.step(t, dt, force);
+ *   }
+ *   CME212_PROFILE_COUNT("ms.steps", 1);
+ *
+ * and, when built with -DCME212_PROFILE, a table of the calls, total, mean
+ * and longest time of every scope and the total of every counter goes to
+ * std::cerr when the program exits. If the environment variable CME212_TRACE
+ * names a file, every scope is also written there as a Chrome trace event
+ * (open it in chrome://tracing or ui.perfetto.dev).
+ *
+ * Scopes and counters may be used from any thread, inside parallel regions
+ * too: each thread records to its own buffer, without locks, and the buffers
+ * are added up at exit. Without CME212_PROFILE the macros expand to nothing
+ * and the classes below to empty inline functions.
+ *
+ * Names must be string literals, or outlive the program: only the pointer
+ * is kept.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+
+#include "CME212/Util.hpp"
+
+namespace profile {
+
+#ifdef CME212_PROFILE
+
+namespace detail {
+
+/** One scope or counter, as seen by one thread. */
+struct Entry {
+  const char* name;
+  uint64_t calls;
+  double seconds;
+  double max_seconds;
+  int64_t count;
+};
+
+/** One completed scope, for the trace. Times are seconds since the first
+ * scope or counter. */
+struct Event {
+  const char* name;
+  double begin;
+  double seconds;
+};
+
+/** The entries and events of one thread. */
+struct Buffer {
+  unsigned tid;
+  std::vector<Entry> entries;
+  std::vector<Event> events;
+
+  /** The entry for @a name. Complexity: O(number of names). */
+  Entry& entry(const char* name) {
+    for (auto& e : entries)
+      if (e.name == name)
+        return e;
+    entries.push_back(Entry{name, 0, 0, 0, 0});
+    return entries.back();
+  }
+};
+
+/** Owns every thread's buffer, and reports them when destroyed at exit. */
+class Registry {
+ public:
+  // Events kept per thread, the rest are only added to the table
+  static constexpr size_t max_events = size_t(1) << 20;
+
+  Registry() {
+    const char* trace = std::getenv("CME212_TRACE");
+    if (trace != nullptr && *trace != '\0')
+      trace_file_ = trace;
+  }
+
+  ~Registry() {
+    report(std::cerr);
+    if (!trace_file_.empty())
+      write_trace(trace_file_);
+  }
+
+  /** Seconds since the first scope or counter. */
+  double now() const {
+    return clock_.seconds();
+  }
+
+  bool tracing() const {
+    return !trace_file_.empty();
+  }
+
+  /** Add a new buffer for the calling thread. */
+  Buffer* add_buffer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(new Buffer());
+    buffers_.back()->tid = buffers_.size() - 1;
+    return buffers_.back().get();
+  }
+
+  /** Write the table of every scope and counter, summed over the threads,
+   * longest total first. */
+  void report(std::ostream& s) const {
+    struct Total {
+      uint64_t calls = 0;
+      double seconds = 0;
+      double max_seconds = 0;
+      int64_t count = 0;
+      unsigned threads = 0;
+    };
+    std::map<std::string, Total> totals;
+    for (auto& b : buffers_) {
+      for (auto& e : b->entries) {
+        Total& t = totals[e.name];
+        t.calls += e.calls;
+        t.seconds += e.seconds;
+        t.max_seconds = std::max(t.max_seconds, e.max_seconds);
+        t.count += e.count;
+        ++t.threads;
+      }
+    }
+    if (totals.empty())
+      return;
+    std::vector<std::pair<std::string, Total>> rows(totals.begin(), totals.end());
+    std::stable_sort(rows.begin(), rows.end(), [](const std::pair<std::string, Total>& a,
+                                                  const std::pair<std::string, Total>& b) {
+      return a.second.seconds > b.second.seconds;
+    });
+
+    std::ios::fmtflags flags = s.flags();
+    s << "profile: " << now() << " seconds, " << buffers_.size() << " threads\n"
+      << std::left << std::setw(28) << "name" << std::right
+      << std::setw(10) << "calls" << std::setw(12) << "total[s]"
+      << std::setw(12) << "mean[ms]" << std::setw(12) << "max[ms]"
+      << std::setw(8) << "threads" << std::setw(14) << "count" << "\n";
+    for (auto& r : rows) {
+      const Total& t = r.second;
+      s << std::left << std::setw(28) << r.first << std::right
+        << std::setw(10) << t.calls;
+      if (t.calls > 0) {
+        s << std::fixed << std::setprecision(4) << std::setw(12) << t.seconds
+          << std::setw(12) << 1e3 * t.seconds / t.calls
+          << std::setw(12) << 1e3 * t.max_seconds;
+        s.flags(flags);
+      } else {
+        s << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(12) << "-";
+      }
+      s << std::setw(8) << t.threads << std::setw(14) << t.count << "\n";
+    }
+    s.flags(flags);
+  }
+
+  /** Write the events of every thread in the Chrome trace event format. */
+  void write_trace(const std::string& filename) const {
+    std::ofstream f(filename);
+    if (!f) {
+      std::cerr << "profile: Error writing " << filename << std::endl;
+      return;
+    }
+    f << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (auto& b : buffers_) {
+      for (auto& e : b->events) {
+        f << (first ? "" : ",\n") << "{\"name\":\"" << e.name
+          << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << b->tid
+          << ",\"ts\":" << 1e6 * e.begin << ",\"dur\":" << 1e6 * e.seconds << "}";
+        first = false;
+      }
+    }
+    f << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  }
+
+ private:
+  CME212::Clock clock_;
+  std::string trace_file_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+inline Registry& registry() {
+  static Registry r;
+  return r;
+}
+
+/** The calling thread's buffer. */
+inline Buffer& buffer() {
+  static thread_local Buffer* b = nullptr;
+  if (b == nullptr)
+    b = registry().add_buffer();
+  return *b;
+}
+
+/** Add one call of @a seconds, which began at @a begin, to @a name. */
+inline void record(const char* name, double begin, double seconds) {
+  Buffer& b = buffer();
+  Entry& e = b.entry(name);
+  ++e.calls;
+  e.seconds += seconds;
+  e.max_seconds = std::max(e.max_seconds, seconds);
+  if (registry().tracing() && b.events.size() < Registry::max_events)
+    b.events.push_back(Event{name, begin, seconds});
+}
+
+} // end namespace detail
+
+/** Times its own lifetime under @a name. */
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const char* name)
+      : name_(name), begin_(detail::registry().now()) {
+  }
+  ~ScopedTimer() {
+    detail::record(name_, begin_, detail::registry().now() - begin_);
+  }
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+ private:
+  const char* name_;
+  double begin_;
+};
+
+/** Times the intervals between consecutive calls of lap() under @a name,
+ * one call each, e.g. the iterations of a solver that only calls back once
+ * per iteration. */
+class LapTimer {
+ public:
+  explicit LapTimer(const char* name)
+      : name_(name), begin_(detail::registry().now()) {
+  }
+  /** Record the time since the last lap() or restart(). */
+  void lap() {
+    double t = detail::registry().now();
+    detail::record(name_, begin_, t - begin_);
+    begin_ = t;
+  }
+  /** Start the next lap now, without recording the current one. */
+  void restart() {
+    begin_ = detail::registry().now();
+  }
+ private:
+  const char* name_;
+  double begin_;
+};
+
+/** Add @a n to the counter @a name. */
+inline void count(const char* name, int64_t n) {
+  detail::buffer().entry(name).count += n;
+}
+
+#define CME212_PROFILE_CAT2(a, b) a##b
+#define CME212_PROFILE_CAT(a, b) CME212_PROFILE_CAT2(a, b)
+/** Time the rest of the enclosing scope under @a name. */
+#define CME212_PROFILE_SCOPE(name) \
+  ::profile::ScopedTimer CME212_PROFILE_CAT(profile_scope_, __LINE__)(name)
+/** Add @a n to the counter @a name. */
+#define CME212_PROFILE_COUNT(name, n) ::profile::count(name, n)
+
+#else
+
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const char*) {}
+};
+
+class LapTimer {
+ public:
+  explicit LapTimer(const char*) {}
+  void lap() {}
+  void restart() {}
+};
+
+inline void count(const char*, int64_t) {}
+
+#define CME212_PROFILE_SCOPE(name)
+#define CME212_PROFILE_COUNT(name, n)
+
+#endif
+
+} // end namespace profile
@@ -0,0 +1,338 @@
+#pragma once
+/** @file RowArena.hpp
+ * @brief Storage for many short, growable rows carved out of shared pages.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
+#include <cassert>
+
+namespace detail {
+
+constexpr unsigned floor_log2(std::size_t x) {
+  return x <= 1 ? 0 : 1 + floor_log2(x / 2);
+}
+
+} // end namespace detail
+
+/** @class RowArena
+ * @brief A sequence of rows of T, each growable like a std::vector<T>, all
+ *   stored in a few large pages.
+ *
+ * A std::vector<std::vector<T>> with millions of short rows makes a heap
+ * allocation for every row and every time one grows, and scatters the rows
+ * over the heap. Here the elements of a row are a block whose capacity is a
+ * power of two, cut from a page of about 64KB. A row that outgrows its block
+ * moves to one twice as large, and the old block goes on a free list for the
+ * next row that needs that size. Pages never move, so the arena grows
+ * without copying, and destroying it frees a page, not a row, at a time.
+ *
+ * @code
+ * RowArena<int> rows;
+ * rows.add_row();
+ * rows[0].push_back(3);
+ * for (int x : rows[0]) ...
+ * @endcode
+ *
+ * Element references and iterators into a row are invalidated when that row
+ * grows: by reserve(), resize() to a larger size and push_back(). Calls that
+ * don't allocate (element access, pop_back(), resize() to a smaller size,
+ * clear() of a row) may run concurrently on distinct rows.
+ */
+template <typename T>
+class RowArena {
+  struct Header;
+
+ public:
+  typedef unsigned size_type;
+  typedef T value_type;
+
+  /** Capacity of a row's first block. Rows of the 2D meshes in data/ fit,
+   * rows of a tet mesh move once, to 16. */
+  enum : unsigned { min_capacity = 8 };
+
+  class Row;
+  class ConstRow;
+
+  /** Construct an arena with no rows. Allocates no page. */
+  RowArena()
+      : pages_(1), current_(0), used_(page_size) {
+  }
+
+  /** Copy the rows of @a other, each into a block just large enough. */
+  RowArena(const RowArena& other)
+      : RowArena() {
+    rows_.reserve(other.size());
+    for (size_type r = 0; r < other.size(); ++r) {
+      ConstRow row = other[r];
+      add_row(row.size());
+      std::copy(row.begin(), row.end(), block(rows_.back()));
+      rows_.back().size = row.size();
+    }
+  }
+
+  RowArena(RowArena&& other)
+      : RowArena() {
+    swap(other);
+  }
+
+  RowArena& operator=(RowArena other) {
+    swap(other);
+    return *this;
+  }
+
+  /** Return the number of rows. */
+  size_type size() const {
+    return rows_.size();
+  }
+  bool empty() const {
+    return rows_.empty();
+  }
+
+  Row operator[](size_type r) {
+    assert(r < size());
+    return Row(this, r);
+  }
+  ConstRow operator[](size_type r) const {
+    assert(r < size());
+    return ConstRow(this, r);
+  }
+
+  /** Append an empty row with room for @a capacity elements.
+   * Rows added with a capacity while no block is free are laid out one
+   * after the other. */
+  void add_row(size_type capacity = 0) {
+    rows_.push_back(Header());
+    if (capacity > 0)
+      move_row(size() - 1, capacity);
+  }
+
+  /** Remove the last row, returning its block to the free lists. */
+  void pop_row() {
+    assert(!empty());
+    release(size() - 1);
+    rows_.pop_back();
+  }
+
+  /** Keep the first @a n rows, or append empty rows up to @a n. */
+  void resize(size_type n) {
+    for (size_type r = n; r < size(); ++r)
+      release(r);
+    rows_.resize(n, Header());
+  }
+
+  /** Make room for @a rows rows holding @a elements elements in all. */
+  void reserve(size_type rows, std::size_t elements) {
+    rows_.reserve(rows);
+    pages_.reserve(pages_.size() + elements / page_size + 1);
+  }
+
+  /** Exchange the contents of rows @a r and @a s. Complexity: O(1). */
+  void swap_rows(size_type r, size_type s) {
+    std::swap(rows_[r], rows_[s]);
+  }
+
+  /** Renumber the rows: row @a order[i] becomes row i.
+   * @pre @a order is a permutation of [0, size())
+   * Complexity: O(size()), no elements are moved. */
+  void permute(const std::vector<size_type>& order) {
+    assert(order.size() == size());
+    std::vector<Header> rows(size());
+    for (size_type i = 0; i < size(); ++i)
+      rows[i] = rows_[order[i]];
+    rows_.swap(rows);
+  }
+
+  /** Free the storage of row @a r.
+   * @post (*this)[r].size() == 0 && (*this)[r].capacity() == 0 */
+  void release(size_type r) {
+    Header& h = rows_[r];
+    if (h.capacity > 0)
+      free_block(h.offset, log2(h.capacity));
+    h = Header();
+  }
+
+  /** Remove all rows and free all pages. */
+  void clear() {
+    RowArena().swap(*this);
+  }
+
+  void swap(RowArena& other) {
+    rows_.swap(other.rows_);
+    pages_.swap(other.pages_);
+    std::swap(current_, other.current_);
+    std::swap(used_, other.used_);
+    free_.swap(other.free_);
+  }
+
+  /** @class RowArena::ConstRow
+   * @brief Read-only view of a row, valid while the row doesn't grow.
+   */
+  class ConstRow {
+   public:
+    size_type size() const { return header().size; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return header().capacity; }
+    const T* begin() const { return arena_->block(header()); }
+    const T* end() const { return begin() + size(); }
+    const T& operator[](size_type k) const { return begin()[k]; }
+    const T& back() const {
+      assert(!empty());
+      return begin()[size() - 1];
+    }
+
+   private:
+    friend class RowArena;
+    ConstRow(const RowArena* arena, size_type r) : arena_(arena), r_(r) {}
+    const Header& header() const { return arena_->rows_[r_]; }
+    const RowArena* arena_;
+    size_type r_;
+  };
+
+  /** @class RowArena::Row
+   * @brief A row of the arena, used like a std::vector<T>&.
+   */
+  class Row {
+   public:
+    size_type size() const { return header().size; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return header().capacity; }
+    T* begin() const { return arena_->block(header()); }
+    T* end() const { return begin() + size(); }
+    T& operator[](size_type k) const { return begin()[k]; }
+    T& back() const {
+      assert(!empty());
+      return begin()[size() - 1];
+    }
+
+    void push_back(const T& v) const {
+      if (size() == capacity()) {
+        T copy(v);  // v may be an element of this row
+        arena_->move_row(r_, size() + 1);
+        begin()[size()] = copy;
+      } else {
+        begin()[size()] = v;
+      }
+      ++header().size;
+    }
+    void pop_back() const {
+      assert(!empty());
+      --header().size;
+    }
+    /** Keep the first @a n elements, or append T() up to @a n. */
+    void resize(size_type n) const {
+      reserve(n);
+      std::fill(begin() + std::min(n, size()), begin() + n, T());
+      header().size = n;
+    }
+    void reserve(size_type n) const {
+      if (n > capacity())
+        arena_->move_row(r_, n);
+    }
+    /** Remove the elements. The row keeps its block. */
+    void clear() const {
+      header().size = 0;
+    }
+
+   private:
+    friend class RowArena;
+    Row(RowArena* arena, size_type r) : arena_(arena), r_(r) {}
+    Header& header() const { return arena_->rows_[r_]; }
+    RowArena* arena_;
+    size_type r_;
+  };
+
+ private:
+  /** Blocks smaller than page_size elements are cut from shared pages,
+   *  larger ones get a page of their own. */
+  enum : unsigned {
+    page_shift = detail::floor_log2(65536 / sizeof(T)),
+    page_size = 1u << page_shift
+  };
+
+  /** A row's block, at element (offset % page_size) of page
+   *  (offset / page_size). Capacity is 0 or a power of two. */
+  struct Header {
+    size_type offset = 0;
+    size_type size = 0;
+    size_type capacity = 0;
+  };
+
+  std::vector<Header> rows_;
+  // pages_[0] stays null: it is the block of the rows without capacity
+  std::vector<std::unique_ptr<T[]>> pages_;
+  // The shared page blocks are being cut from, and how much of it is used
+  size_type current_;
+  size_type used_;
+  // free_[k] holds the offsets of unused blocks of capacity 2^k
+  std::vector<std::vector<size_type>> free_;
+
+  static size_type log2(size_type c) {
+    size_type k = 0;
+    while ((size_type(1) << k) < c) ++k;
+    return k;
+  }
+
+  T* block(size_type offset) const {
+    return pages_[offset >> page_shift].get() + (offset & (page_size - 1));
+  }
+  T* block(const Header& h) const {
+    return block(h.offset);
+  }
+
+  void free_block(size_type offset, size_type k) {
+    if (free_.size() <= k)
+      free_.resize(k + 1);
+    free_[k].push_back(offset);
+  }
+
+  /** Append a page with room for 2^k elements and return its index. */
+  size_type new_page(size_type k) {
+    assert(pages_.size() < (std::size_t(1) << (32 - page_shift)));
+    std::size_t n = std::max<std::size_t>(page_size, std::size_t(1) << k);
+    pages_.emplace_back(new T[n]());
+    return size_type(pages_.size() - 1);
+  }
+
+  /** Return the offset of an unused block of 2^k elements. */
+  size_type allocate(size_type k) {
+    if (k < free_.size() && !free_[k].empty()) {
+      size_type offset = free_[k].back();
+      free_[k].pop_back();
+      return offset;
+    }
+    const size_type n = size_type(1) << k;
+    if (n >= page_size)
+      return new_page(k) << page_shift;
+    if (used_ + n > page_size) {
+      // Hand the rest of the current page to the free lists
+      for (size_type j = k; j-- > log2(min_capacity); ) {
+        if (used_ + (size_type(1) << j) <= page_size) {
+          free_block((current_ << page_shift) + used_, j);
+          used_ += size_type(1) << j;
+        }
+      }
+      current_ = new_page(k);
+      used_ = 0;
+    }
+    size_type offset = (current_ << page_shift) + used_;
+    used_ += n;
+    return offset;
+  }
+
+  /** Move row @a r to a block with room for at least @a n elements. */
+  void move_row(size_type r, size_type n) {
+    size_type k = log2(std::max(n, size_type(min_capacity)));
+    size_type offset = allocate(k);
+    Header& h = rows_[r];
+    std::copy(block(h), block(h) + h.size, block(offset));
+    size_type old_size = h.size;
+    release(r);
+    h.offset = offset;
+    h.size = old_size;
+    h.capacity = size_type(1) << k;
+  }
+};
@@ -0,0 +1,309 @@
+#pragma once
+/** @file Snapshot.hpp
+ * @brief Append-only binary snapshots of per-node data for headless runs.
+ *
+ * A snapshot file is self-contained, so it can be viewed without the mesh it
+ * came from (see snapshot_view.cpp):
+ *
+ *   header   8 byte magic "CME212SN", then uint32_t version, flags,
+ *            components and a reserved zero, then uint64_t num_nodes and
+ *            num_edges
+ *   mesh     num_nodes*3 doubles of initial positions, then num_edges*2
+ *            uint32_t node indices
+ *   frames   repeated until the end of the file: uint64_t step, double time,
+ *            uint64_t payload bytes, then the payload, which is
+ *            num_nodes*components floats (or doubles without
+ *            SNAPSHOT_SINGLE), deflated if SNAPSHOT_ZLIB is set
+ *
+ * All in native byte order. Frames are appended and flushed one at a time,
+ * so the file of a run that was killed is still readable up to its last
+ * complete frame. SnapshotReader memory-maps the file and decodes a frame
+ * straight from the map when it is asked for.
+ *
+ * Compression needs zlib: build with -DCME212_USE_ZLIB and link with -lz.
+ * The executables then write deflated frames (see SNAPSHOT_DEFAULT).
+ */
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+#ifdef CME212_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "CME212/Point.hpp"
+#include "MeshIO.hpp"
+
+/** Snapshot flags. */
+enum : uint32_t {
+  SNAPSHOT_SINGLE = 1,      //< Payload is float instead of double
+  SNAPSHOT_ZLIB   = 2,      //< Payload is deflated with zlib
+  /** Floats, deflated if compiled with CME212_USE_ZLIB */
+#ifdef CME212_USE_ZLIB
+  SNAPSHOT_DEFAULT = SNAPSHOT_SINGLE | SNAPSHOT_ZLIB
+#else
+  SNAPSHOT_DEFAULT = SNAPSHOT_SINGLE
+#endif
+};
+
+namespace detail {
+
+static constexpr char snapshot_magic[8] = {'C','M','E','2','1','2','S','N'};
+static constexpr uint32_t snapshot_version = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t components;
+  uint32_t reserved;
+  uint64_t num_nodes;
+  uint64_t num_edges;
+};
+
+struct SnapshotFrameHeader {
+  uint64_t step;
+  double time;
+  uint64_t bytes;
+};
+
+inline void put(double*& out, double v) {
+  *out++ = v;
+}
+inline void put(double*& out, const Point& p) {
+  *out++ = p.x; *out++ = p.y; *out++ = p.z;
+}
+
+} // end namespace detail
+
+/** @class SnapshotWriter
+ * @brief Writes the mesh of a graph once, then frames of per-node data.
+ *
+ * @code
+ * SnapshotWriter snap("run.snap", graph, 3);
+ * for (...) {
+ *   step();
+ *   if (step % K == 0)
+ *     snap.append(step, t, graph.node_begin(), graph.node_end(),
+ *                 [](const Node& n) { return n.position(); });
+ * }
+ * @endcode
+ */
+class SnapshotWriter {
+ public:
+  /** Create the file at @a path for @a components values per node of @a g.
+   * @param[in] flags SNAPSHOT_SINGLE and/or SNAPSHOT_ZLIB. SNAPSHOT_ZLIB is
+   *    dropped unless compiled with CME212_USE_ZLIB.
+   * Check is_open() for success. */
+  template <typename G>
+  SnapshotWriter(const std::string& path, const G& g, unsigned components,
+                 uint32_t flags = SNAPSHOT_DEFAULT)
+      : os_(path, std::ios::binary | std::ios::trunc),
+        num_nodes_(g.num_nodes()), components_(components) {
+#ifndef CME212_USE_ZLIB
+    flags &= ~uint32_t(SNAPSHOT_ZLIB);
+#endif
+    flags_ = flags;
+    detail::SnapshotHeader h;
+    std::memcpy(h.magic, detail::snapshot_magic, 8);
+    h.version = detail::snapshot_version;
+    h.flags = flags_;
+    h.components = components_;
+    h.reserved = 0;
+    h.num_nodes = num_nodes_;
+    h.num_edges = g.num_edges();
+    os_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+    std::vector<Point> points(num_nodes_);
+    for (std::size_t i = 0; i < num_nodes_; ++i)
+      points[i] = g.node(i).position();
+    write(points);
+    std::vector<uint32_t> edges;
+    edges.reserve(2 * h.num_edges);
+    for (auto it = g.edge_begin(); it != g.edge_end(); ++it) {
+      edges.push_back((*it).node1().index());
+      edges.push_back((*it).node2().index());
+    }
+    write(edges);
+    os_.flush();
+  }
+
+  /** Return true if every write so far succeeded. */
+  bool is_open() const {
+    return bool(os_);
+  }
+
+  /** Append a frame with @a value_fn(n) for each node n in [first, last).
+   * @pre [first, last) has num_nodes() nodes, in index order.
+   * @pre value_fn returns a double if components() == 1, or a Point if
+   *      components() == 3.
+   * @return false if the write failed. */
+  template <typename InputIterator, typename ValueFn>
+  bool append(uint64_t step, double time, InputIterator first,
+              InputIterator last, ValueFn value_fn) {
+    values_.resize(num_nodes_ * components_);
+    double* out = values_.data();
+    for (; first != last; ++first)
+      detail::put(out, value_fn(*first));
+    assert(out == values_.data() + values_.size());
+
+    const char* data = reinterpret_cast<const char*>(values_.data());
+    std::size_t bytes = values_.size() * sizeof(double);
+    if (flags_ & SNAPSHOT_SINGLE) {
+      floats_.assign(values_.begin(), values_.end());
+      data = reinterpret_cast<const char*>(floats_.data());
+      bytes = floats_.size() * sizeof(float);
+    }
+#ifdef CME212_USE_ZLIB
+    if (flags_ & SNAPSHOT_ZLIB) {
+      uLongf zbytes = compressBound(bytes);
+      zbuffer_.resize(zbytes);
+      if (compress2(zbuffer_.data(), &zbytes,
+                    reinterpret_cast<const Bytef*>(data), bytes,
+                    Z_BEST_SPEED) != Z_OK)
+        return false;
+      data = reinterpret_cast<const char*>(zbuffer_.data());
+      bytes = zbytes;
+    }
+#endif
+
+    detail::SnapshotFrameHeader h = {step, time, bytes};
+    os_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    os_.write(data, bytes);
+    os_.flush();
+    return bool(os_);
+  }
+
+  std::size_t num_nodes() const { return num_nodes_; }
+  unsigned components() const { return components_; }
+
+ private:
+  template <typename T>
+  void write(const std::vector<T>& v) {
+    if (!v.empty())
+      os_.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+  }
+
+  std::ofstream os_;
+  std::size_t num_nodes_;
+  unsigned components_;
+  uint32_t flags_;
+  // Reused frame buffers
+  std::vector<double> values_;
+  std::vector<float> floats_;
+#ifdef CME212_USE_ZLIB
+  std::vector<Bytef> zbuffer_;
+#endif
+};
+
+/** @class SnapshotReader
+ * @brief Memory-mapped reader for files written by SnapshotWriter.
+ *
+ * Indexes the frames when opened; a truncated last frame is ignored.
+ */
+class SnapshotReader {
+ public:
+  /** Open the snapshot at @a path. Check is_open() for success. */
+  explicit SnapshotReader(const std::string& path)
+      : file_(path), open_(false), header_() {
+    if (!file_.is_open() || file_.size() < sizeof(header_))
+      return;
+    std::memcpy(&header_, file_.begin(), sizeof(header_));
+    if (std::memcmp(header_.magic, detail::snapshot_magic, 8) != 0
+        || header_.version != detail::snapshot_version)
+      return;
+#ifndef CME212_USE_ZLIB
+    if (header_.flags & SNAPSHOT_ZLIB)
+      return;
+#endif
+    std::size_t offset = sizeof(header_);
+    std::size_t mesh_bytes = header_.num_nodes * sizeof(Point)
+                             + header_.num_edges * 2 * sizeof(uint32_t);
+    if (file_.size() - offset < mesh_bytes)
+      return;
+    positions_.resize(header_.num_nodes);
+    if (!positions_.empty())
+      std::memcpy(&positions_[0], file_.begin() + offset,
+                  positions_.size() * sizeof(Point));
+    offset += positions_.size() * sizeof(Point);
+    edges_.resize(2 * header_.num_edges);
+    if (!edges_.empty())
+      std::memcpy(&edges_[0], file_.begin() + offset,
+                  edges_.size() * sizeof(uint32_t));
+    offset += edges_.size() * sizeof(uint32_t);
+
+    detail::SnapshotFrameHeader h;
+    while (file_.size() - offset >= sizeof(h)) {
+      std::memcpy(&h, file_.begin() + offset, sizeof(h));
+      if (file_.size() - offset - sizeof(h) < h.bytes)
+        break;
+      frames_.push_back(h);
+      offsets_.push_back(offset + sizeof(h));
+      offset += sizeof(h) + h.bytes;
+    }
+    open_ = true;
+  }
+
+  bool is_open() const { return open_; }
+  std::size_t num_nodes() const { return header_.num_nodes; }
+  unsigned components() const { return header_.components; }
+  uint32_t flags() const { return header_.flags; }
+  std::size_t num_frames() const { return frames_.size(); }
+
+  /** Return the node positions when the file was created. */
+  const std::vector<Point>& positions() const { return positions_; }
+  /** Return the edges as consecutive pairs of node indices. */
+  const std::vector<uint32_t>& edges() const { return edges_; }
+
+  uint64_t step(std::size_t k) const { return frames_[k].step; }
+  double time(std::size_t k) const { return frames_[k].time; }
+
+  /** Read frame @a k into @a values, num_nodes()*components() doubles.
+   * @pre k < num_frames() */
+  bool read_frame(std::size_t k, std::vector<double>& values) const {
+    assert(k < num_frames());
+    std::size_t count = num_nodes() * components();
+    std::size_t raw = count * ((flags() & SNAPSHOT_SINGLE) ? sizeof(float)
+                                                           : sizeof(double));
+    const char* data = file_.begin() + offsets_[k];
+    std::vector<char> inflated;
+#ifdef CME212_USE_ZLIB
+    if (flags() & SNAPSHOT_ZLIB) {
+      inflated.resize(raw);
+      uLongf bytes = raw;
+      if (uncompress(reinterpret_cast<Bytef*>(inflated.data()), &bytes,
+                     reinterpret_cast<const Bytef*>(data), frames_[k].bytes)
+          != Z_OK || bytes != raw)
+        return false;
+      data = inflated.data();
+    } else
+#endif
+    if (frames_[k].bytes != raw)
+      return false;
+
+    values.resize(count);
+    if (flags() & SNAPSHOT_SINGLE) {
+      for (std::size_t i = 0; i < count; ++i) {
+        float f;
+        std::memcpy(&f, data + i * sizeof(float), sizeof(float));
+        values[i] = f;
+      }
+    } else if (count) {
+      std::memcpy(&values[0], data, raw);
+    }
+    return true;
+  }
+
+ private:
+  MappedFile file_;
+  bool open_;
+  detail::SnapshotHeader header_;
+  std::vector<Point> positions_;
+  std::vector<uint32_t> edges_;
+  std::vector<detail::SnapshotFrameHeader> frames_;
+  std::vector<std::size_t> offsets_;
+};
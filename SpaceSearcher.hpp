@@ -3,6 +3,10 @@
  * @brief Define the SpaceSearcher class for making efficient spatial searches.
  */
 
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
 #include <thrust/iterator/transform_iterator.h>
 #include <thrust/iterator/zip_iterator.h>
 #include <thrust/tuple.h>
@@ -12,6 +16,7 @@
 #include "CME212/Point.hpp"
 #include "CME212/BoundingBox.hpp"
 #include "MortonCoder.hpp"
+#include "Profile.hpp"
 
 /** @class SpaceSearcher
  * @brief Class for making spatial searches, which uses the MortonCoder
@@ -30,8 +35,9 @@ class SpaceSearcher
   // Implementation types
 
   /** The number of levels in the MortonCoder. This controls the "accuracy" of
-   * the searching iterators (10 -- high accuracy, 1 -- low accuracy), but
-   * can also impose more expensive searching.
+   * the searching iterators (21 -- high accuracy, 1 -- low accuracy), but
+   * can also impose more expensive searching. Up to 10 levels use 32-bit
+   * Morton codes, more levels use 64-bit codes.
    */
   static constexpr int NumLevels = L;
   /** Type of MortonCoder. */
@@ -135,14 +141,59 @@ class SpaceSearcher
     CodeIter clast = thrust::make_transform_iterator(plast, p2code(mc_));
 
     // Using the zip iterator to initialize z_data_
-    using TupleIter = thrust::tuple<CodeIter, TIter>;
+    using TupleIter = thrust::tuple<CodeIter, TIter, PointIter>;
     using ZipIter = thrust::zip_iterator<TupleIter>;
-    ZipIter zfirst(thrust::make_tuple(cfirst, tfirst));
-    ZipIter zlast(thrust::make_tuple(clast, tlast));
+    ZipIter zfirst(thrust::make_tuple(cfirst, tfirst, pfirst));
+    ZipIter zlast(thrust::make_tuple(clast, tlast, plast));
     z_data_ = std::vector<morton_pair>(zfirst, zlast);
 
-    // Sort the z_data_ vector using the custom comparing function
-    thrust::sort(thrust::omp::par, z_data_.begin(), z_data_.end(), comp());
+    // Sort the z_data_ vector by Morton code, with scratch space that
+    // update() reuses
+    buffer_ = z_data_;
+    hist_.resize(omp_get_max_threads() << radix_bits);
+    radix_sort(z_data_, buffer_, hist_);
+  }
+
+  /** @brief Refresh the SpaceSearcher after its data items have moved.
+   *
+   * Recomputes the Morton code of every stored item in place, in parallel,
+   * and restores the sorted order. In a time-stepping loop items move only
+   * a little between calls, so the data is nearly sorted and a serial
+   * insertion sort does close to linear work. If the data turns out to be
+   * badly out of order, the remaining work is handed to the parallel radix
+   * sort, which reuses the scratch space of the constructor. Nothing is
+   * allocated unless there are more OpenMP threads than at construction.
+   *
+   * @param[in] t2p A functor that maps data items to @a Points, with the
+   *                  same interface as in the constructor.
+   *
+   * @pre For all stored items t, bounding_box().contains(@a t2p(t)).
+   */
+  template <typename T2Point>
+  void update(T2Point t2p) {
+    CME212_PROFILE_SCOPE("searcher.update");
+    const long n = z_data_.size();
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+      z_data_[i].point_ = t2p(z_data_[i].value_);
+      z_data_[i].code_ = mc_.code(z_data_[i].point_);
+    }
+
+    // Insertion sort, giving up after a linear number of element moves
+    const long max_moves = 8 * n;
+    long moves = 0;
+    for (long i = 1; i < n && moves <= max_moves; ++i) {
+      if (!(z_data_[i].code_ < z_data_[i-1].code_))
+        continue;
+      morton_pair mp = z_data_[i];
+      long j = i;
+      for (; j > 0 && mp.code_ < z_data_[j-1].code_; --j)
+        z_data_[j] = z_data_[j-1];
+      z_data_[j] = mp;
+      moves += i - j;
+    }
+    if (moves > max_moves)
+      radix_sort(z_data_, buffer_, hist_);
   }
 
   ///////////////
@@ -219,7 +270,7 @@ class SpaceSearcher
     assert(bounding_box().contains(bb));
     code_type morton_min = mc_.code(bb.min());
     code_type morton_max = mc_.code(bb.max());
-    auto mit_end = std::lower_bound(z_data_.begin(), z_data_.end(), morton_max);
+    auto mit_end = std::upper_bound(z_data_.begin(), z_data_.end(), morton_max);
     return NeighborhoodIterator(z_data_.begin(), mit_end, morton_min, morton_max);
   }
 
@@ -232,26 +283,249 @@ class SpaceSearcher
     assert(bounding_box().contains(bb));
     code_type morton_min = mc_.code(bb.min());
     code_type morton_max = mc_.code(bb.max());
-    auto mit_end = std::lower_bound(z_data_.begin(), z_data_.end(), morton_max);
+    auto mit_end = std::upper_bound(z_data_.begin(), z_data_.end(), morton_max);
     return NeighborhoodIterator(mit_end, mit_end, morton_min, morton_max);
   }
 
+  ///////////////////////
+  // Distance queries  //
+  ///////////////////////
+
+  /** Call @a f(t) for every data item t within distance @a r of @a c.
+   * @param[in] c The query center.
+   * @param[in] r The query radius.
+   * @param[in] f A functor called as f(const T&).
+   *
+   * Unlike begin(bb)/end(bb) this is exact: the Morton cells covering the
+   * box around the ball are walked in order, cells farther than @a r
+   * from @a c are skipped whole, and the items in the remaining cells are
+   * tested against their stored positions.
+   */
+  template <typename F>
+  void for_each_in_radius(const Point& c, double r, F f) const {
+    visit_ball(c, r, [&](const morton_pair& mp) { f(mp.value_); });
+  }
+
+  /** Write every data item within distance @a r of @a c to @a out.
+   * @return The output iterator one past the last item written.
+   *
+   * Items are written in Morton order; see for_each_in_radius().
+   */
+  template <typename OutputIter>
+  OutputIter radius_query(const Point& c, double r, OutputIter out) const {
+    visit_ball(c, r, [&](const morton_pair& mp) { *out = mp.value_; ++out; });
+    return out;
+  }
+
+  /** Write the @a k data items nearest to @a c to @a out, nearest first.
+   * @return The output iterator one past the last item written.
+   *
+   * Fewer than @a k items are written only if the SpaceSearcher holds fewer
+   * than @a k items. Runs exact radius queries with a radius starting at
+   * the expected distance of the k-th neighbor for uniformly spread data,
+   * or at one cell if the bounding box is flat, doubling it until at least
+   * @a k items are found.
+   */
+  template <typename OutputIter>
+  OutputIter knn(const Point& c, std::size_t k, OutputIter out) const {
+    if (k == 0 || z_data_.empty())
+      return out;
+    k = std::min(k, z_data_.size());
+
+    Box3D bb = bounding_box();
+    Point extent = bb.max() - bb.min();
+    double diameter = norm(extent) + norm(c - bb.min()) + norm(c - bb.max());
+    double volume = extent.x * extent.y * extent.z;
+    double r = std::cbrt(3 * k * volume / (4 * M_PI * z_data_.size()));
+    // A box flat in some direction has no volume; start from a cell instead
+    if (!(r > 0))
+      r = std::max(std::max(extent.x, extent.y), extent.z)
+          / MortonCoderType::cells_per_side;
+    if (!(r > 0))
+      r = diameter;
+
+    std::vector<std::pair<double, const morton_pair*>> found;
+    while (true) {
+      found.clear();
+      visit_ball(c, r, [&](const morton_pair& mp) {
+        found.push_back(std::make_pair(normSq(mp.point_ - c), &mp));
+      });
+      if (found.size() >= k || r >= diameter)
+        break;
+      r *= 2;
+    }
+
+    k = std::min(k, found.size());
+    auto by_dist = [](const std::pair<double, const morton_pair*>& a,
+                      const std::pair<double, const morton_pair*>& b) {
+      return a.first < b.first;
+    };
+    std::partial_sort(found.begin(), found.begin() + k, found.end(), by_dist);
+    for (std::size_t i = 0; i < k; ++i, ++out)
+      *out = found[i].second->value_;
+    return out;
+  }
+
+  /** Answer a radius query around every stored data item, in parallel.
+   * @param[in] radius A functor called as double radius(const T& t), giving
+   *                     the query radius around t.
+   * @param[in] visit  A functor called as visit(const T& t, const T& s) for
+   *                     every item s within radius(t) of t, t itself
+   *                     included. Calls for the same t come from one thread;
+   *                     calls for different t may run concurrently.
+   *
+   * The queries are issued in Morton order and handed to threads in
+   * contiguous blocks, so consecutive queries on a thread hit mostly the
+   * same cells and stay in cache.
+   */
+  template <typename RadiusFn, typename Visitor>
+  void radius_query_all(RadiusFn radius, Visitor visit) const {
+    const long n = z_data_.size();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (long i = 0; i < n; ++i) {
+      const morton_pair& q = z_data_[i];
+      visit_ball(q.point_, radius(q.value_),
+                 [&](const morton_pair& mp) { visit(q.value_, mp.value_); });
+    }
+  }
+
  private:
 
   // MortonCoder instance associated with this SpaceSearcher.
   MortonCoderType mc_;
 
-  // A (code_type,value_type) pair that can be used as a MortonCode
+  // A (code_type,value_type) pair that can be used as a MortonCode.
+  // The item's position is kept too, for exact distance queries.
   struct morton_pair {
     code_type code_;
     T value_;
+    Point point_;
     // Cast operator so we can treat a morton_pair like a code_type
     operator const code_type&() const { return code_; }
 
-    morton_pair(thrust::tuple<code_type, T> values)
-    : code_(thrust::get<0>(values)), value_(thrust::get<1>(values)) {}
+    morton_pair(thrust::tuple<code_type, T, Point> values)
+    : code_(thrust::get<0>(values)), value_(thrust::get<1>(values)),
+      point_(thrust::get<2>(values)) {}
   };
 
+  /** Call @a f(mp) for every morton_pair mp within distance @a r of @a c. */
+  template <typename F>
+  void visit_ball(const Point& c, double r, F f) const {
+    // Clip the box around the ball to the searcher's bounding box
+    Box3D bb = bounding_box();
+    Point lo = c - Point(r), hi = c + Point(r);
+    for (int d = 0; d < 3; ++d) {
+      lo[d] = std::max(lo[d], bb.min()[d]);
+      hi[d] = std::min(hi[d], bb.max()[d]);
+      if (lo[d] > hi[d])
+        return;
+    }
+    const code_type cmin = mc_.code(lo);
+    const code_type cmax = mc_.code(hi);
+    const double r2 = r * r;
+
+    auto end = std::upper_bound(z_data_.begin(), z_data_.end(), cmax);
+    auto i = std::lower_bound(z_data_.begin(), end, cmin);
+    while (i < end) {
+      const code_type code = i->code_;
+      const code_type next = MortonCoderType::advance_to_box(code, cmin, cmax);
+      if (next != code) {
+        i = std::lower_bound(i, end, next);
+        continue;
+      }
+      // [i, j) are the items of one cell inside the box
+      auto j = i;
+      while (j < end && j->code_ == code)
+        ++j;
+      if (dist_sq(mc_.cell(code), c) <= r2) {
+        for (; i < j; ++i)
+          if (normSq(i->point_ - c) <= r2)
+            f(*i);
+      }
+      i = j;
+    }
+  }
+
+  /** Squared distance from @a p to the closest point of @a b. */
+  static double dist_sq(const Box3D& b, const Point& p) {
+    double d2 = 0;
+    for (int d = 0; d < 3; ++d) {
+      double e = std::max(std::max(b.min()[d] - p[d], p[d] - b.max()[d]), 0.0);
+      d2 += e * e;
+    }
+    return d2;
+  }
+
   // Pairs of Morton codes and data items of type T.
   std::vector<morton_pair> z_data_;
+
+  /** Number of significant bits in a Morton code. */
+  static constexpr int code_bits = 3 * NumLevels;
+  /** Number of radix sort passes, using digits of at most 8 bits. */
+  static constexpr int radix_passes = (code_bits + 7) / 8;
+  /** Width of a radix sort digit, spreading code_bits evenly over passes. */
+  static constexpr int radix_bits = (code_bits + radix_passes - 1) / radix_passes;
+
+  // Scratch space of radix_sort(): a copy of z_data_ and the per-thread
+  // digit counts.
+  std::vector<morton_pair> buffer_;
+  std::vector<long> hist_;
+
+  /** Stable LSD radix sort of @a data by Morton code.
+   * @param[in,out] buffer Scratch space, @a buffer.size() == @a data.size().
+   * @param[in,out] hist   Scratch space for the digit counts, grown if it
+   *                       is too small for the OpenMP threads.
+   *
+   * Only the low code_bits bits of a code can be set, so radix_passes
+   * counting passes suffice. Each pass histograms and then scatters
+   * contiguous chunks of @a data, one chunk per OpenMP thread; chunks are
+   * scattered in thread order, which keeps every pass stable.
+   */
+  static void radix_sort(std::vector<morton_pair>& data,
+                         std::vector<morton_pair>& buffer,
+                         std::vector<long>& hist) {
+    assert(buffer.size() == data.size());
+    const long n = data.size();
+    const int num_buckets = 1 << radix_bits;
+    const code_type digit_mask = num_buckets - 1;
+    const std::size_t hist_size = omp_get_max_threads() * num_buckets;
+    if (hist.size() < hist_size)
+      hist.resize(hist_size);
+
+    for (int pass = 0; pass < radix_passes; ++pass) {
+      const int shift = pass * radix_bits;
+      #pragma omp parallel
+      {
+        const int nt = omp_get_num_threads();
+        const int tid = omp_get_thread_num();
+        const long lo = n * tid / nt;
+        const long hi = n * (tid + 1) / nt;
+        long* h = &hist[tid * num_buckets];
+
+        // Count the digits of this thread's chunk
+        std::fill(h, h + num_buckets, 0);
+        for (long i = lo; i < hi; ++i)
+          ++h[(data[i].code_ >> shift) & digit_mask];
+        #pragma omp barrier
+
+        // Turn the counts into output offsets, bucket-major, thread-minor
+        #pragma omp single
+        {
+          long sum = 0;
+          for (int d = 0; d < num_buckets; ++d) {
+            for (int t = 0; t < nt; ++t) {
+              long c = hist[t * num_buckets + d];
+              hist[t * num_buckets + d] = sum;
+              sum += c;
+            }
+          }
+        }
+
+        // Scatter this thread's chunk
+        for (long i = lo; i < hi; ++i)
+          buffer[h[(data[i].code_ >> shift) & digit_mask]++] = data[i];
+      }
+      data.swap(buffer);
+    }
+  }
 };
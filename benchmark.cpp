@@ -0,0 +1,379 @@
+/**
+ * @file benchmark.cpp
+ * Times the main stages of the Graph, SpaceSearcher, mass-spring and Poisson
+ * code on the meshes in data/.
+ *
+ * @brief Reads every mesh named on the command line (a path without the
+ * .nodes/.tets extension, e.g. data/grid3) and, for every thread count of
+ * the sweep, runs each stage the given number of times:
+ *
+ *   load            read_nodes and read_tets
+ *   build           Graph::build_from_tets
+ *   num_edges       Graph::num_edges
+ *   edge_iter       visiting every edge through edge_begin/edge_end
+ *   incident_iter   visiting every node's incident edges
+ *   reorder         Graph::reorder(morton_order(g))
+ *   freeze          Graph::freeze, from the thawed graph
+ *   searcher_build  SpaceSearcher construction over the node indices
+ *   searcher_query  radius queries around 10000 nodes
+ *   ms_step         one MassSpringSystem::step with gravity and springs
+ *   ms_constraints  one ConstraintPass with a sphere and a box obstacle,
+ *                   searcher refresh included
+ *   ms_collisions   one SelfCollisionPass, searcher refresh included
+ *   poisson_assembly GraphSymmetricMatrix::tosparse
+ *   poisson_matvec  one product with the assembled matrix
+ *   poisson_matvec_stencil
+ *                   one product with the matrix after tostencil()
+ *   poisson_pc      graph_multigrid setup
+ *   poisson_cg      itl::cg to a relative residual of 1e-8
+ *
+ * One line (CSV) or object (JSON) per mesh, thread count and stage is
+ * written to standard output, with the min, median, mean and max seconds
+ * over the repeats and a stage-specific count that should not change
+ * between runs (edges visited, query hits, constraint candidates, CG
+ * iterations), e.g.
+ *
+ *   ./benchmark --repeat 5 --threads 1,2,4 --format json data/grid3 > b.json
+ *
+ * `make bench` runs it on the meshes of data/, see the Makefile.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <cstdlib>
+#include <omp.h>
+#include <thrust/iterator/counting_iterator.h>
+
+#include "CME212/Util.hpp"
+#include "CME212/Point.hpp"
+#include "CME212/BoundingBox.hpp"
+
+#include "Graph.hpp"
+#include "GraphOrdering.hpp"
+#include "GraphSymmetricMatrix.hpp"
+#include "SpaceSearcher.hpp"
+#include "MeshIO.hpp"
+#include "MassSpring.hpp"
+#include "Constraints.hpp"
+
+/** Node and edge data of the mass-spring stages, as in mass_spring.cpp */
+struct NodeData {
+  Point vel;
+  double mass;
+};
+struct EdgeData {
+  double K;
+  double L;
+};
+typedef Graph<NodeData, EdgeData> GraphType;
+typedef GraphType::node_type Node;
+typedef GraphSymmetricMatrix::graph_type PoissonGraph;
+
+/** The timings of one stage on one mesh with one thread count. */
+struct Result {
+  std::string mesh;
+  unsigned nodes;
+  unsigned edges;
+  int threads;
+  std::string stage;
+  std::vector<double> seconds;
+  double count;
+};
+
+/** Run @a f @a repeats times, @a setup before every run but untimed.
+ * @a f returns the stage-specific count. */
+Result time_stage(const std::string& stage, unsigned repeats,
+                  std::function<void()> setup, std::function<double()> f) {
+  Result r;
+  r.stage = stage;
+  r.count = 0;
+  CME212::Clock clock;
+  for (unsigned k = 0; k < repeats; ++k) {
+    setup();
+    clock.start();
+    r.count = f();
+    r.seconds.push_back(clock.seconds());
+  }
+  return r;
+}
+
+/** The nodes on the faces of the bounding box of @a g fix the Poisson
+ * problem, like the outer square of poisson.cpp. */
+struct OnBoundingBox {
+  Box3D bb;
+  bool operator()(const PoissonGraph::node_type& n) const {
+    const Point& p = n.position();
+    for (int d = 0; d < 3; ++d) {
+      if (bb.min()[d] == bb.max()[d]) continue;  // flat meshes: skip z
+      if (p[d] == bb.min()[d] || p[d] == bb.max()[d]) return true;
+    }
+    return false;
+  }
+};
+
+/** Time every stage on the mesh at @a prefix with the current number of
+ * threads, appending the results to @a out. */
+void run_mesh(const std::string& prefix, unsigned repeats,
+              std::vector<Result>& out) {
+  std::vector<Result> results;
+  auto none = []{};
+
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  results.push_back(time_stage("load", repeats, none, [&]{
+    points.clear();
+    tets.clear();
+    if (!read_nodes(prefix + ".nodes", points) ||
+        !read_tets(prefix + ".tets", tets)) {
+      std::cerr << "Error reading " << prefix << ".nodes or .tets\n";
+      exit(1);
+    }
+    return double(points.size());
+  }));
+
+  GraphType graph;
+  results.push_back(time_stage("build", repeats, [&]{ graph.clear(); }, [&]{
+    graph.build_from_tets(points, tets);
+    return double(graph.num_edges());
+  }));
+
+  results.push_back(time_stage("num_edges", repeats, none, [&]{
+    return double(graph.num_edges());
+  }));
+
+  results.push_back(time_stage("edge_iter", repeats, none, [&]{
+    double length = 0;
+    for (auto it = graph.edge_begin(); it != graph.edge_end(); ++it)
+      length += (*it).length();
+    return std::floor(length);
+  }));
+
+  results.push_back(time_stage("incident_iter", repeats, none, [&]{
+    unsigned visits = 0;
+    for (auto ni = graph.node_begin(); ni != graph.node_end(); ++ni) {
+      auto n = *ni;
+      for (auto ei = n.edge_begin(); ei != n.edge_end(); ++ei)
+        visits += (*ei).node2().index() != n.index();
+    }
+    return double(visits);
+  }));
+
+  // Reorder a copy each time, so every run starts from the file's order
+  GraphType unordered = graph;
+  results.push_back(time_stage("reorder", repeats, [&]{ graph = unordered; }, [&]{
+    graph.reorder(morton_order(graph));
+    return double(graph.num_nodes());
+  }));
+
+  // Initialize like mass_spring.cpp
+  const unsigned n = graph.num_nodes();
+  for (auto it = graph.node_begin(); it != graph.node_end(); ++it) {
+    (*it).value().vel = Point(0, 0, 0);
+    (*it).value().mass = (1.0 / n) / n;
+  }
+  for (auto it = graph.edge_begin(); it != graph.edge_end(); ++it) {
+    auto e = *it;
+    auto edual = e.dual();
+    e.value().K = edual.value().K = 100.0 / n;
+    e.value().L = edual.value().L = e.length();
+  }
+  // build_from_tets leaves the graph frozen
+  results.push_back(time_stage("freeze", repeats, [&]{ graph.thaw(); }, [&]{
+    graph.freeze();
+    return double(graph.num_edges());
+  }));
+
+  MassSpringSystem system(graph, [](const Node& node) {
+    return node.position() == Point(0, 0, 0) || node.position() == Point(1, 0, 0);
+  });
+  Box3D bb(points.begin(), points.end());
+  Box3D domain(bb.min() - Point(1), bb.max() + Point(1));
+  auto i2p = [&system](unsigned i) { return system.position(i); };
+  typedef SpaceSearcher<unsigned, 10> Searcher;
+  std::unique_ptr<Searcher> searcher;
+  results.push_back(time_stage("searcher_build", repeats, none, [&]{
+    searcher.reset(new Searcher(domain, thrust::counting_iterator<unsigned>(0),
+                                thrust::counting_iterator<unsigned>(n), i2p));
+    return double(n);
+  }));
+
+  double h = 0;
+  for (auto it = graph.edge_begin(); it != graph.edge_end(); ++it)
+    h += (*it).length();
+  h /= std::max(graph.num_edges(), 1u);
+  results.push_back(time_stage("searcher_query", repeats, none, [&]{
+    const unsigned stride = std::max(n / 10000, 1u);
+    unsigned hits = 0;
+    for (unsigned i = 0; i < n; i += stride)
+      searcher->for_each_in_radius(system.position(i), 2 * h, [&](unsigned) { ++hits; });
+    return double(hits);
+  }));
+
+  auto force = GravityTerm() + SpringTerm();
+  double t = 0;
+  results.push_back(time_stage("ms_step", repeats, none, [&]{
+    t = system.step(t, system.stable_dt(), force);
+    return double(n);
+  }));
+
+  // A sphere around the center of the mesh and a box over one corner, each
+  // holding a few tenths of its nodes
+  const Point center = (bb.min() + bb.max()) / 2;
+  const double size = norm_inf(bb.max() - bb.min());
+  auto obstacles = SphereObstacle(center, 0.25 * size)
+                 + BoxObstacle(Box3D(bb.min() - Point(size), bb.min() + Point(0.25 * size)));
+  ConstraintPass<decltype(obstacles)> constrain(obstacles);
+  results.push_back(time_stage("ms_constraints", repeats, none, [&]{
+    searcher->update(i2p);
+    constrain(system, *searcher);
+    return double(constrain.candidates().size());
+  }));
+
+  SelfCollisionPass collisions;
+  results.push_back(time_stage("ms_collisions", repeats, none, [&]{
+    searcher->update(i2p);
+    collisions(system, *searcher);
+    return double(n);
+  }));
+
+  // The Poisson stages: the tets' edges, with the bounding box as boundary
+  PoissonGraph pgraph;
+  pgraph.build_from_tets(points, tets);
+  pgraph.reorder(rcm_order(pgraph));
+  pgraph.freeze();
+  GraphSymmetricMatrix A(&pgraph, OnBoundingBox{bb});
+  results.push_back(time_stage("poisson_assembly", repeats, none, [&]{
+    A.tosparse();
+    return double(A.row_ptr()[A.num_rows()]);
+  }));
+
+  const size_t rows = A.num_rows();
+  mtl::vec::dense_vector<double> b(rows), x(rows);
+  for (size_t i = 0; i < rows; ++i)
+    b[i] = OnBoundingBox{bb}(pgraph.node(i)) ? 0.0 : 1.0;
+  results.push_back(time_stage("poisson_matvec", repeats, none, [&]{
+    A.mult(b, x, mtl::assign::assign_copy());
+    return double(rows);
+  }));
+  {
+    GraphSymmetricMatrix S(&pgraph, OnBoundingBox{bb});
+    S.tostencil();
+    results.push_back(time_stage("poisson_matvec_stencil", repeats, none, [&]{
+      S.mult(b, x, mtl::assign::assign_copy());
+      return double(rows);
+    }));
+  }
+
+  std::unique_ptr<itl::pc::graph_multigrid> P;
+  results.push_back(time_stage("poisson_pc", repeats, none, [&]{
+    P.reset(new itl::pc::graph_multigrid(A));
+    return double(P->num_levels());
+  }));
+
+  results.push_back(time_stage("poisson_cg", repeats, [&]{
+    for (size_t i = 0; i < rows; ++i) x[i] = 0.0;
+  }, [&]{
+    itl::basic_iteration<double> iter(b, 1000, 1.e-8);
+    itl::cg(A, x, b, *P, iter);
+    return double(iter.iterations());
+  }));
+
+  for (Result& r : results) {
+    r.mesh = prefix;
+    r.nodes = graph.num_nodes();
+    r.edges = graph.num_edges();
+    r.threads = omp_get_max_threads();
+    out.push_back(r);
+  }
+}
+
+/** Min, median, mean and max of @a v. @pre !v.empty() */
+std::vector<double> summary(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  const size_t m = v.size() / 2;
+  double median = v.size() % 2 ? v[m] : (v[m - 1] + v[m]) / 2;
+  double mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+  return {v.front(), median, mean, v.back()};
+}
+
+void write_csv(std::ostream& s, const std::vector<Result>& results) {
+  s << "mesh,nodes,edges,threads,stage,repeats,min,median,mean,max,count\n";
+  for (const Result& r : results) {
+    std::vector<double> st = summary(r.seconds);
+    s << r.mesh << "," << r.nodes << "," << r.edges << "," << r.threads << ","
+      << r.stage << "," << r.seconds.size() << ","
+      << st[0] << "," << st[1] << "," << st[2] << "," << st[3] << ","
+      << r.count << "\n";
+  }
+}
+
+void write_json(std::ostream& s, const std::vector<Result>& results) {
+  s << "[\n";
+  for (size_t k = 0; k < results.size(); ++k) {
+    const Result& r = results[k];
+    std::vector<double> st = summary(r.seconds);
+    s << "  {\"mesh\": \"" << r.mesh << "\", \"nodes\": " << r.nodes
+      << ", \"edges\": " << r.edges << ", \"threads\": " << r.threads
+      << ", \"stage\": \"" << r.stage << "\", \"seconds\": [";
+    for (size_t i = 0; i < r.seconds.size(); ++i)
+      s << (i ? ", " : "") << r.seconds[i];
+    s << "], \"min\": " << st[0] << ", \"median\": " << st[1]
+      << ", \"mean\": " << st[2] << ", \"max\": " << st[3]
+      << ", \"count\": " << r.count << "}"
+      << (k + 1 < results.size() ? "," : "") << "\n";
+  }
+  s << "]\n";
+}
+
+int main(int argc, char** argv) {
+  unsigned repeats = 3;
+  std::vector<int> threads;
+  std::string format = "csv";
+  std::vector<std::string> meshes;
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    if (arg == "--repeat" && a + 1 < argc) {
+      repeats = std::max(atoi(argv[++a]), 1);
+    } else if (arg == "--threads" && a + 1 < argc) {
+      // Comma separated thread counts
+      for (const char* p = argv[++a]; *p; ) {
+        threads.push_back(std::max(atoi(p), 1));
+        while (*p && *p != ',') ++p;
+        if (*p) ++p;
+      }
+    } else if (arg == "--format" && a + 1 < argc) {
+      format = argv[++a];
+    } else {
+      meshes.push_back(arg);
+    }
+  }
+  if (meshes.empty() || (format != "csv" && format != "json")) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--repeat N] [--threads T1,T2,...] [--format csv|json]"
+              << " MESH...\n  where MESH is a path without the .nodes/.tets"
+              << " extension, e.g. data/grid3\n";
+    exit(1);
+  }
+  if (threads.empty())
+    threads.push_back(omp_get_max_threads());
+
+  std::vector<Result> results;
+  for (const std::string& mesh : meshes) {
+    for (int t : threads) {
+      omp_set_num_threads(t);
+      std::cerr << mesh << ", " << t << " threads" << std::endl;
+      run_mesh(mesh, repeats, results);
+    }
+  }
+
+  if (format == "json")
+    write_json(std::cout, results);
+  else
+    write_csv(std::cout, results);
+  return 0;
+}
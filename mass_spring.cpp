@@ -6,11 +6,21 @@
  * First file: 3D Points (one per line) defined by three doubles
  * Second file: Tetrahedra (one per line) defined by 4 indices into the point
  * list
+ *
+ * With a third argument, runs headless: no SDLViewer is launched and the node
+ * positions are appended to that snapshot file every K time steps (the
+ * optional fourth argument, default 100). View it with snapshot_view.
+ *
+ * Built with -DCME212_USE_MPI, run it headless under mpirun: every process
+ * steps one part of the mesh, see Distributed.hpp, and the first one writes
+ * the snapshots.
  */
 
 #include <fstream>
+#include <memory>
 #include <thrust/for_each.h>
 #include <thrust/system/omp/execution_policy.h>
+#include <thrust/iterator/counting_iterator.h>
 
 #include "CME212/SDLViewer.hpp"
 #include "CME212/Util.hpp"
@@ -20,6 +30,21 @@
 
 #include "Graph.hpp"
 #include "SpaceSearcher.hpp"
+#include "GraphOrdering.hpp"
+#include "MeshIO.hpp"
+#include "Snapshot.hpp"
+#include "MassSpring.hpp"
+#include "Constraints.hpp"
+#include "Profile.hpp"
+#ifdef CME212_IMPLICIT_MASS_SPRING
+#include "MassSpringImplicit.hpp"
+#endif
+#ifdef CME212_USE_MPI
+#ifdef CME212_IMPLICIT_MASS_SPRING
+#error "The backward Euler steps of MassSpringImplicit.hpp are not distributed"
+#endif
+#include "Distributed.hpp"
+#endif
 
 
 
@@ -244,90 +269,6 @@ struct make_combined_force {
   }
 };
 
-/** The constraint of a plane. */
-struct PlaneConstraint {
-  double l = -0.75;
-  template<typename GRAPH>
-  void operator()(GRAPH& g){
-    for(auto it = g.node_begin(); it != g.node_end(); ++it){
-      auto n = *it;
-      if(n.position().z < l){
-        n.position().z = l;
-        n.value().vel.z = 0;
-      }
-    }
-    return;
-  }
-};
-
-/** The constraint of sphere. */
-struct SphereConstraint {
-  Point c = Point(0.5, 0.5, -0.5);
-  double r = 0.15;
-  template<typename GRAPH>
-  void operator()(GRAPH& g){
-    for(auto it = g.node_begin(); it != g.node_end(); ++it){
-      auto n = *it;
-      auto x = n.position();
-      auto R = (x - c)/norm(x - c);
-      if(norm(x - c) < r){
-        n.value().vel -= (n.value().vel * R) * R;
-        n.position() = c + r * R;
-      }
-    }
-    return;
-  }
-};
-
-struct modifyvel{
-  Point c_;
-  double r2_;
-  Node n_;
-  modifyvel(Point c, double r2, Node n1) : c_(c), r2_(r2), n_(n1) {}
-  void operator()(Node n){
-    Point r = c_ - n.position();
-    double l2 = normSq(r);
-    if(n != n_ and l2 < r2_){
-      n_.value().vel -= (dot(r, n_.value().vel) / l2) * r;
-    }
-  }
-};
-
-struct checkcollision {
-  SpaceSearcher<Node> searcher_;
-  checkcollision(const SpaceSearcher<Node>& searcher) : searcher_(searcher) {}
-  void operator()(Node n){
-    Point center = n.position();
-    double radius2 = std::numeric_limits<double>::max();
-    for(auto i = n.edge_begin(); i != n.edge_end(); ++i){
-      auto e = *i;
-      radius2 = std::min(radius2, normSq(e.node2().position() - center));
-    }
-    radius2 *= 0.9;
-
-    // Form a bounding box that encapsulates the constraint’s influence
-    // Add some relaxing space for the box via multiplying the radius by 2
-    double radius = std::sqrt(radius2);
-    Point p1 = center - 2 * Point(radius, radius, radius);
-    Point p2 = center + 2 * Point(radius, radius, radius);
-    Box3D bb(p1, p2);
-    // Using SpaceSeacher to iterate in the given box.
-    // Note that the NeighborhoodIterator is not a random access iterator so we don't use parallel methods
-    thrust::for_each(searcher_.begin(bb), searcher_.end(bb), modifyvel(center, radius2, n));
-  }
-};
-
-struct SelfCollisionConstraint {
-  SpaceSearcher<Node> searcher_;
-  SelfCollisionConstraint(SpaceSearcher<Node> searcher) : searcher_(searcher) {}
-  void operator()(GraphType& g){
-    // Implement the first for-loop using thrust::for_each
-    // Iterate through all nodes using NodeIterator
-    thrust::for_each(thrust::omp::par, g.node_begin(), g.node_end(), checkcollision(searcher_));
-  }
-};
-
-
 struct SelfCollisionTest {
   void operator()(GraphType& g) const {
     for(auto i = g.node_begin(); i != g.node_end(); ++i){
@@ -358,17 +299,10 @@ struct SphereRemove {
   double r = 0.15;
   template<typename GRAPH>
   void operator()(GRAPH& g){
-    auto it = g.node_begin();
-    while(it != g.node_end()){
-      auto n = *it;
-      auto x = n.position();
-      if(norm(x - c) < r){
-        it = g.remove_node(it);
-      }
-      else{
-        ++it;
-      }
-    }
+    // One compaction pass instead of a remove_node per node
+    g.remove_nodes_if([this](const typename GRAPH::node_type& n){
+      return norm(n.position() - c) < r;
+    });
     return;
   }
 };
@@ -376,35 +310,52 @@ struct SphereRemove {
 int main(int argc, char** argv) {
   // Check arguments
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " NODES_FILE TETS_FILE\n";
+    std::cerr << "Usage: " << argv[0]
+              << " NODES_FILE TETS_FILE [SNAPSHOT_FILE [K]]\n";
+    exit(1);
+  }
+  const bool headless = argc > 3;
+  const unsigned snapshot_every = argc > 4 ? std::max(atoi(argv[4]), 1) : 100;
+  int rank = 0;
+#ifdef CME212_USE_MPI
+  // MPI is only called from the master thread, between parallel loops
+  int provided, nprocs;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+  if (!headless) {
+    if (rank == 0)
+      std::cerr << "With MPI, give a SNAPSHOT_FILE to run headless\n";
+    MPI_Finalize();
     exit(1);
   }
+#endif
 
   // Construct an empty graph
   GraphType graph;
 
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file(argv[1]);
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  Point p;
-  std::vector<typename GraphType::node_type> nodes;
-  while (CME212::getline_parsed(nodes_file, p))
-    nodes.push_back(graph.add_node(p));
-
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file(argv[2]);
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t)) {
-    graph.add_edge(nodes[t[0]], nodes[t[1]]);
-    graph.add_edge(nodes[t[0]], nodes[t[2]]);
- //#if 0
-    // Diagonal edges: include as of HW2 #2
-    graph.add_edge(nodes[t[0]], nodes[t[3]]);
-    graph.add_edge(nodes[t[1]], nodes[t[2]]);
-//#endif
-    graph.add_edge(nodes[t[1]], nodes[t[3]]);
-    graph.add_edge(nodes[t[2]], nodes[t[3]]);
+  // Read the nodes and tets files, text or binary, from the input arguments
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  {
+    CME212_PROFILE_SCOPE("load");
+    if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+      std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+      exit(1);
+    }
+  }
+
+  // Add each Point to the Graph and connect every pair of nodes in each tet
+  // (diagonal edges included as of HW2 #2)
+  {
+    CME212_PROFILE_SCOPE("build");
+    graph.build_from_tets(points, tets);
+  }
+
+  // Renumber the nodes along a Morton curve so neighbors are close in memory.
+  {
+    CME212_PROFILE_SCOPE("reorder");
+    graph.reorder(morton_order(graph));
   }
 
   // Initialize the node values: mass and velocity.
@@ -423,51 +374,149 @@ int main(int argc, char** argv) {
     edual.value().L = edual.length();
   }
 
+  // The topology is fixed from here on, so pack the adjacency into CSR form.
+  graph.freeze();
+
   // double K = 100;
   // double L = (*(graph.edge_begin())).length();
 
   // Print out the stats
-  std::cout << graph.num_nodes() << " " << graph.num_edges() << std::endl;
-
-  // Launch the SDLViewer
-  CME212::SDLViewer viewer;
-  auto node_map = viewer.empty_node_map(graph);
-  viewer.launch();
+  if (rank == 0)
+    std::cout << graph.num_nodes() << " " << graph.num_edges() << std::endl;
+
+  // Launch the SDLViewer, or open the snapshot file when headless
+  std::unique_ptr<CME212::SDLViewer> viewer;
+  std::unique_ptr<SnapshotWriter> snapshot;
+  if (headless) {
+    if (rank == 0) {
+      snapshot.reset(new SnapshotWriter(argv[3], graph, 3));
+      if (!snapshot->is_open()) {
+        std::cerr << "Error writing " << argv[3] << "\n";
+        exit(1);
+      }
+    }
+  } else {
+    viewer.reset(new CME212::SDLViewer());
+    auto node_map = viewer->empty_node_map(graph);
+    viewer->launch();
 
-  viewer.add_nodes(graph.node_begin(), graph.node_end(), node_map);
-  viewer.add_edges(graph.edge_begin(), graph.edge_end(), node_map);
+    viewer->add_nodes(graph.node_begin(), graph.node_end(), node_map);
+    viewer->add_edges(graph.edge_begin(), graph.edge_end(), node_map);
 
-  viewer.center_view();
+    viewer->center_view();
+  }
 
-  // Begin the mass-spring simulation
-  double dt = 1.0/graph.num_nodes();
+  // Begin the mass-spring simulation. The time step is chosen every step
+  // from the springs and the speed of the nodes, see below.
   double t_start = 0;
   double t_end = 5.0;
 
-  for (double t = t_start; t < t_end; t += dt) {
+  // Copy the state to contiguous arrays once. The nodes at (0, 0, 0) and
+  // (1, 0, 0) never move.
+  auto is_fixed = [](const Node& n) {
+    return n.position() == Point(0, 0, 0) || n.position() == Point(1, 0, 0);
+  };
+#ifdef CME212_USE_MPI
+  // Split the mesh along a Morton curve, one part per process. Each steps
+  // its part and refreshes a layer of ghosts; the whole graph is only used
+  // to collect the snapshots on the first process.
+  Subdomain sub(graph, morton_partition(graph, nprocs), rank);
+  GraphType local = sub.local_graph(graph);
+  MassSpringSystem system(local, is_fixed);
+  DistributedMassSpring distributed(system, sub);
+#else
+  MassSpringSystem system(graph, is_fixed);
+#endif
+  auto force = GravityTerm(grav) + SpringTerm();
+#ifdef CME212_IMPLICIT_MASS_SPRING
+  // Backward Euler steps are stable at any dt, so go ten times past the
+  // explicit limit
+  BackwardEuler implicit;
+  const double cfl = 10;
+#else
+  const double cfl = 0.5;
+#endif
+
+  // Build the searcher once and refresh it in place every time step
+  Box3D bigbb(Point(-5,-5,-5), Point(5,5,5));
+  auto n2p = [](const Node& n) { return n.position(); };
+  // Search the system's own positions, by node index. Ten levels make cells
+  // of about 0.01, close to the collision radius of the finer grids.
+  auto i2p = [&system](unsigned i) { return system.position(i); };
+  SpaceSearcher<unsigned, 10> searcher(bigbb, thrust::counting_iterator<unsigned>(0),
+                                       thrust::counting_iterator<unsigned>(system.size()), i2p);
+  // The floor and the ball the cloth falls on
+  auto obstacles = PlaneObstacle(-0.75)
+                 + SphereObstacle(Point(0.5, 0.5, -0.5), 0.15);
+  ConstraintPass<decltype(obstacles)> constraints(obstacles);
+  SelfCollisionPass collisions;
+
+  // Draw every time step, but no more often than the screen can show
+  CME212::RenderThrottle throttle(1, 60);
+
+  unsigned step = 0;
+  for (double t = t_start; t < t_end; ++step) {
+    CME212_PROFILE_SCOPE("ms.timestep");
     //std::cout << "t = " << t << std::endl;
     //symp_euler_step(graph, t, dt, Problem1Force(K, L));
     //symp_euler_step(graph, t, dt, Problem2Force());
     //symp_euler_step(graph, t, dt, make_combined_force<GravityForce, MassSpringForce, ZeroForce>(GravityForce(), MassSpringForce()));
-    auto force = make_combined_force<GravityForce, MassSpringForce, ZeroForce>(GravityForce(), MassSpringForce());
-
-    Box3D bigbb(Point(-5,-5,-5), Point(5,5,5));
-    auto n2p = [](const Node& n) { return n.position(); };
-    SpaceSearcher<Node> searcher(bigbb, graph.node_begin(), graph.node_end(), n2p);
-
-    symp_euler_step(graph, t, dt, force, SelfCollisionConstraint(searcher));
-    // Update viewer with nodes' new positions
-    viewer.clear();
-    node_map.clear();
-    viewer.add_nodes(graph.node_begin(), graph.node_end(), node_map);
-    viewer.add_edges(graph.edge_begin(), graph.edge_end(), node_map);
-    viewer.set_label(t);
+    // As large as stability allows, unless some spring would stretch or
+    // shrink by more than a tenth of its length
+#ifdef CME212_USE_MPI
+    double dt = distributed.adaptive_dt(cfl, 0.1);
+    t = distributed.step(t, dt, force);
+#else
+    double dt = system.adaptive_dt(cfl, 0.1);
+#ifdef CME212_IMPLICIT_MASS_SPRING
+    t = implicit.step(system, t, dt, force);
+#else
+    t = system.step(t, dt, force);
+#endif
+#endif
+    searcher.update(i2p);
+#ifdef CME212_USE_MPI
+    distributed.constrain(constraints, searcher);
+    distributed.collide(collisions, searcher);
+#else
+    constraints(system, searcher);
+    collisions(system, searcher);
+#endif
+    // The nodes are only read for output, so copy the state back only then.
+    // Update viewer with nodes' new positions. The topology is fixed, so
+    // overwrite the displayed points in place, at most 60 times a second.
+    const bool draw = viewer && throttle.due();
+    // The same on every process, as collecting the state takes them all
+    const bool save = headless && step % snapshot_every == 0;
+    if (draw || save) {
+      CME212_PROFILE_SCOPE("ms.store");
+#ifdef CME212_USE_MPI
+      distributed.store(graph);
+#else
+      system.store(graph);
+#endif
+    }
+    if (draw) {
+      CME212_PROFILE_SCOPE("render");
+      viewer->update_positions(graph.node_begin(), graph.node_end());
+      viewer->set_label(t);
+    }
+    if (save && snapshot) {
+      CME212_PROFILE_SCOPE("snapshot");
+      if (!snapshot->append(step, t, graph.node_begin(), graph.node_end(), n2p)) {
+        std::cerr << "Error writing " << argv[3] << "\n";
+        exit(1);
+      }
+    }
 
     // These lines slow down the animation for small graphs, like grid0_*.
     // Feel free to remove them or tweak the constants.
-    if (graph.size() < 100)
+    if (viewer && graph.size() < 100)
       CME212::sleep(0.001);
   }
 
+#ifdef CME212_USE_MPI
+  MPI_Finalize();
+#endif
   return 0;
 }
@@ -0,0 +1,57 @@
+/**
+ * @file mesh_convert.cpp
+ * Convert a mesh to the binary formats of MeshIO.hpp
+ *
+ * @brief Reads in two files specified on the command line.
+ * First file: 3D Points (one per line) defined by three doubles
+ * Second file: Tetrahedra (one per line) defined by 4 indices into the point list
+ * Either file may already be binary.
+ *
+ * Writes the same mesh to the third and fourth files in binary form, which
+ * every executable reading a NODES_FILE and TETS_FILE accepts, and prints
+ * A B
+ * where A = number of nodes
+ *       B = number of tets
+ */
+
+#include <iostream>
+
+#include "CME212/Util.hpp"
+
+#include "MeshIO.hpp"
+
+
+int main(int argc, char** argv)
+{
+  // Check arguments
+  if (argc < 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " NODES_FILE TETS_FILE NODES_OUT TETS_OUT\n";
+    exit(1);
+  }
+
+  CME212::Clock clock;
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+    std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+    exit(1);
+  }
+  std::cerr << "Read in " << clock.seconds() << " seconds" << std::endl;
+
+  // Catch tets that refer to nodes which don't exist
+  for (const tet_type& t : tets)
+    for (unsigned k : t)
+      if (k >= points.size()) {
+        std::cerr << "Tet refers to node " << k << " of " << points.size() << "\n";
+        exit(1);
+      }
+
+  if (!write_nodes_binary(argv[3], points) || !write_tets_binary(argv[4], tets)) {
+    std::cerr << "Error writing " << argv[3] << " or " << argv[4] << "\n";
+    exit(1);
+  }
+
+  std::cout << points.size() << " " << tets.size() << std::endl;
+  return 0;
+}
@@ -7,6 +7,11 @@
 #include <boost/numeric/mtl/mtl.hpp>
 #include <boost/numeric/itl/itl.hpp>
 
+#include "CME212/Util.hpp"
+#include "GraphSymmetricMatrix.hpp"
+#include "MassSpringImplicit.hpp"
+#include "MeshIO.hpp"
+
 // HW3: YOUR CODE HERE
 // Define a IdentityMatrix that interfaces with MTL
 
@@ -92,9 +97,84 @@ namespace mtl {
   };
 } // end namespace mtl
 
+typedef mtl::vec::dense_vector<double> Vector;
+
+static unsigned fail_count = 0;
+
+void sf_print(bool sf, std::string msg = "") {
+  if (sf)
+    std::cerr << msg << " [Success]" << std::endl;
+  else {
+    std::cerr << msg << " [FAIL]" << std::endl;
+    ++fail_count;
+  }
+}
+
+/** Load the unit square grid @a name from data/ as poisson does, with the
+ *  four sides of every square as edges. */
+template <typename G>
+bool load_grid(const std::string& name, G& graph) {
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes("data/" + name + ".nodes", points) ||
+      !read_tets("data/" + name + ".tets", tets))
+    return false;
+  graph.build_from_tets(points, tets, {{0,1}, {0,2}, {1,3}, {2,3}});
+  graph.freeze();
+  return true;
+}
+
+/** Node and edge data of a MassSpringSystem, as in mass_spring.cpp */
+struct NodeData {
+  Point vel;
+  double mass;
+};
+struct EdgeData {
+  double K;
+  double L;
+};
+typedef Graph<NodeData, EdgeData> SpringGraph;
+
+/** The largest difference between the velocities after one BackwardEuler
+ *  step and one explicit step of length @a dt of the system of @a g. */
+double implicit_vs_explicit(const SpringGraph& g, double dt) {
+  auto is_fixed = [](const SpringGraph::node_type& n) {
+    return n.position() == Point(0, 0, 0) || n.position() == Point(1, 0, 0);
+  };
+  auto force = GravityTerm() + SpringTerm() + DampingTerm(0.1);
+  MassSpringSystem explicit_system(g, is_fixed), implicit_system(g, is_fixed);
+  explicit_system.step(0, dt, force);
+  BackwardEuler implicit(1e-13, 1000);
+  implicit.step(implicit_system, 0, dt, force);
+  double err = 0;
+  for (unsigned i = 0; i < g.num_nodes(); ++i)
+    err = std::max(err, norm_inf(implicit_system.velocity(i) - explicit_system.velocity(i)));
+  return err;
+}
+
+/** Solve A x = b by CG with preconditioner @a P from x = 0.
+ *  @return true if ||b - A x|| <= 1e-9 ||b|| and x is within 1e-6 of
+ *          @a x_ref, relative to its largest entry. */
+template <typename Precond>
+bool check_solve(const GraphSymmetricMatrix& A, const Vector& b, const Precond& P,
+                 const Vector& x_ref, int& iterations) {
+  const size_t n = A.num_rows();
+  Vector x(n, 0.0), r(n);
+  itl::basic_iteration<double> iter(b, 2000, 1.e-11);
+  itl::cg(A, x, b, P, iter);
+  iterations = iter.iterations();
+  A.mult(x, r, mtl::assign::assign_copy());
+  double err = 0, scale = 0;
+  for (size_t i = 0; i < n; ++i) {
+    r[i] = b[i] - r[i];
+    err = std::max(err, std::abs(x[i] - x_ref[i]));
+    scale = std::max(scale, std::abs(x_ref[i]));
+  }
+  return mtl::two_norm(r) <= 1e-9 * mtl::two_norm(b) && err <= 1e-6 * scale;
+}
+
 int main()
 {
-  typedef mtl::vec::dense_vector<double> Vector;
   typedef IdentityMatrix IMatrix;
   const size_t N = 1000;
   IMatrix I(N);
@@ -111,5 +191,78 @@ int main()
 
   //Solve Ax == b with left preconditioner P
   itl::bicgstab(I, x, b, P, iter);
-  return 0;
+
+  // The graph preconditioners on the Laplacian of grid1, with the outer
+  // ring as the boundary, against unpreconditioned CG
+  GraphSymmetricMatrix::graph_type grid;
+  sf_print(load_grid("grid1", grid), "Load data/grid1");
+  auto on_ring = [](const GraphSymmetricMatrix::node_type& n) {
+    Point p = n.position();
+    return p.x == 0 || p.y == 0 || p.x == 1 || p.y == 1;
+  };
+  GraphSymmetricMatrix A(&grid, on_ring);
+  A.tosparse();
+  const size_t n = A.num_rows();
+  Vector g(n), x_ref(n, 0.0);
+  for (size_t i = 0; i < n; ++i)
+    g[i] = CME212::random(-1, 1);
+  int plain = 0, its = 0;
+  itl::pc::identity<GraphSymmetricMatrix> none(A);
+  {
+    itl::basic_iteration<double> iter(g, 2000, 1.e-11);
+    itl::cg(A, x_ref, g, none, iter);
+  }
+  sf_print(check_solve(A, g, none, x_ref, plain), "CG without preconditioner");
+  itl::pc::graph_diagonal D(A);
+  sf_print(check_solve(A, g, D, x_ref, its), "CG with graph_diagonal");
+  itl::pc::graph_ic_0 IC(A);
+  sf_print(check_solve(A, g, IC, x_ref, its) && its < plain, "CG with graph_ic_0");
+  itl::pc::graph_multigrid MG(A);
+  sf_print(MG.num_levels() > 1 && check_solve(A, g, MG, x_ref, its) && its < plain,
+           "CG with graph_multigrid");
+
+  // The stencil of the same graph multiplies like the assembled matrix
+  GraphSymmetricMatrix S(&grid, on_ring);
+  S.tostencil();
+  Vector y_csr(n), y_stencil(n);
+  A.mult(g, y_csr, mtl::assign::assign_copy());
+  S.mult(g, y_stencil, mtl::assign::assign_copy());
+  double diff = 0;
+  for (size_t i = 0; i < n; ++i)
+    diff = std::max(diff, std::abs(y_csr[i] - y_stencil[i]));
+  sf_print(S.matrix_free() && diff < 1e-12, "Stencil mult against CSR mult");
+  itl::pc::graph_diagonal DS(S);
+  sf_print(check_solve(S, g, DS, x_ref, its), "CG with graph_diagonal on the stencil");
+
+  // Without off-diagonal entries nothing coarsens, so the hierarchy stalls
+  // at all 625 rows and multigrid only smooths
+  GraphSymmetricMatrix B(&grid, [](const GraphSymmetricMatrix::node_type&) { return true; });
+  B.tosparse();
+  itl::pc::graph_multigrid MGB(B);
+  sf_print(MGB.num_levels() == 1 && n > 500 && check_solve(B, g, MGB, g, its),
+           "CG with graph_multigrid that cannot coarsen");
+
+  // Both steps are first order and agree to O(dt^2) in the velocities, on
+  // grid1 stretched by a tenth, moving at random
+  SpringGraph cloth;
+  sf_print(load_grid("grid1", cloth), "Load data/grid1");
+  for (auto it = cloth.node_begin(); it != cloth.node_end(); ++it)
+    (*it).value() = NodeData{Point(CME212::random(-1, 1), CME212::random(-1, 1),
+                                   CME212::random(-1, 1)), 1};
+  for (auto it = cloth.edge_begin(); it != cloth.edge_end(); ++it) {
+    (*it).value() = EdgeData{100, (*it).length()};
+    (*it).dual().value() = EdgeData{100, (*it).length()};
+  }
+  for (auto it = cloth.node_begin(); it != cloth.node_end(); ++it)
+    (*it).position() *= 1.1;
+  double err1 = implicit_vs_explicit(cloth, 1e-3), err2 = implicit_vs_explicit(cloth, 5e-4);
+  sf_print(err1 > 0 && err1 < 1e-2 && err2 < 0.3 * err1,
+           "BackwardEuler step against the explicit step at small dt");
+
+  if (fail_count) {
+    std::cerr << "\n" << fail_count
+              << (fail_count > 1 ? " FAILURES" : " FAILURE") << std::endl;
+    return 1;
+  } else
+    return 0;
 }
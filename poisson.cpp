@@ -8,10 +8,18 @@
  * Second file: Eges (one per line) defined by 2 indices into the point list
  *              of the first file.
  *
- * Launches an SDLViewer to visualize the solution.
+ * Launches an SDLViewer to visualize the solution. With a third argument,
+ * runs headless instead and appends the iterate to that snapshot file every
+ * K iterations (the optional fourth argument, default 10) and at the end.
+ *
+ * Built with -DCME212_USE_MPI, run it headless under mpirun: every process
+ * solves for one part of the mesh, see Distributed.hpp, and the first one
+ * writes the solution to the snapshot file once, at the end.
  */
 
 #include <fstream>
+#include <memory>
+#include <vector>
 
 #include "CME212/SDLViewer.hpp"
 #include "CME212/Util.hpp"
@@ -21,6 +29,14 @@
 #include <boost/numeric/itl/itl.hpp>
 
 #include "Graph.hpp"
+#include "GraphSymmetricMatrix.hpp"
+#include "GraphOrdering.hpp"
+#include "MeshIO.hpp"
+#include "Snapshot.hpp"
+#include "Profile.hpp"
+#ifdef CME212_USE_MPI
+#include "Distributed.hpp"
+#endif
 
 typedef Graph<char,char> GraphType;
 typedef GraphType::node_type NodeType;
@@ -79,8 +95,8 @@ struct PositionColorFn{
 /* The function which returns the Point value according to the Vector x */
 template<typename Vector>
 struct Positionfunction{
-  Vector x_;
-  Positionfunction(Vector x) : x_(x){
+  const Vector& x_;
+  Positionfunction(const Vector& x) : x_(x){
   }
   Point& operator()(GraphType::node_type n){
     size_t i = n.index();
@@ -90,121 +106,6 @@ struct Positionfunction{
   }
 };
 
-/* GraphSymmetricMatrix which is implemented by graph. */
-class GraphSymmetricMatrix {
-
-public:
-  GraphSymmetricMatrix(GraphType* graph)
-  // Initialize the private attributes of a graph,with no nodes and no edges.
-    : graph_(graph){
-  }
-
-  double element(size_t i, size_t j){
-    // double h = (*(graph_->edge_begin())).length();
-    if(i == j and boundary(graph_->node(i))) return 1.0;
-    if(i != j and (boundary(graph_->node(i)) or boundary(graph_->node(j)))) return 0;
-    else{
-      if(i == j) return -double(graph_->node(i).degree());
-      auto n1 = graph_->node(i);
-      auto n2 = graph_->node(j);
-      if(graph_->has_edge(n1, n2)) return 1.0;
-      else return 0.0;
-    }
-  }
-
-  /** Helper function to perform multiplication . Allows for delayed
-    * evaluation of results .
-    * Assign :: apply (a , b ) resolves to an assignment operation such as
-    * a += b , a -= b , or a = b .
-    * @pre @a size ( v ) == size ( w ) */
-  template <typename VectorIn, typename VectorOut, typename Assign>
-  void mult(const VectorIn& v, VectorOut& w, Assign) const{
-    size_t s = graph_->size();
-    assert(mtl::size(v) == s);
-    assert(mtl::size(w) == s);
-    for(size_t i = 0; i < s; ++i){
-      double current = 0;
-      for (size_t j = indp_[i]; j < indp_[i+1]; ++j){
-  			current += v[indi_[j]] * elem_[j];
-  		}
-      Assign::apply(w[i], current);
-    }
-  }
-
-  /* * Matvec forwards to MTL ’s lazy m at _ c ve c _ mu l t ip l i er operator */
-  template <typename Vector>
-  mtl::vec::mat_cvec_multiplier<GraphSymmetricMatrix, Vector>
-  operator *(const Vector& v) const{
-    return {*this, v};
-  }
-  /* Construct a sparse matrix using the graph's feature. */
-  void tosparse(){
-    assert(graph_ != NULL);
-    indp_.push_back(0);
-    for(size_t i = 0; i < num_rows(); ++i){
-      for(size_t j = 0; j < num_cols(); ++j){
-        if(this->element(i, j) != 0){
-          elem_.push_back(this->element(i, j));
-          indi_.push_back(j);
-        }
-      }
-      indp_.push_back(indi_.size());
-    }
-  }
-
-  size_t num_rows() const{
-    return graph_->size();
-  }
-
-  size_t num_cols() const{
-    return graph_->size();
-  }
-
-  size_t m_size() const{
-    return graph_->size() * graph_->size();
-  }
-
-private:
-  GraphType* graph_;
-  std::vector<double> elem_;
-  std::vector<size_t> indp_;
-  std::vector<size_t> indi_;
-};
-
-/* * The number of rows in the matrix . */
-inline std::size_t num_rows(const GraphSymmetricMatrix& A){
-  return A.num_rows();
-}
-
-/* * The number of columns in the matrix . */
-inline std::size_t num_cols(const GraphSymmetricMatrix& A){
-  return A.num_cols();
-}
-
-/* * The number of elements in the matrix . */
-inline std::size_t size(const GraphSymmetricMatrix& A){
-  return A.m_size();
-}
-
-/* * Traits that MTL uses to determine properties of our IdentityMatrix . */
-namespace mtl {
-  namespace ashape {
-    /* * Define IdentityMatrix to be a non - scalar type . */
-    template <>
-      struct ashape_aux <GraphSymmetricMatrix> {
-      typedef nonscal type ;
-      };
-  } // end namespace ashape
-
-  /* * IdentityMatrix implements the Collection concept
-  * with value_type and size_type */
-  template <>
-  struct Collection <GraphSymmetricMatrix> {
-    typedef double value_type ;
-    typedef unsigned size_type ;
-  };
-} // end namespace mtl
-
 namespace itl{
   template <class Real, typename Viewer, typename Vector>
   class visual_iteration : public cyclic_iteration<Real> {
@@ -212,38 +113,55 @@ namespace itl{
     typedef cyclic_iteration<Real> super;
     typedef visual_iteration self;
 
-    void visual_iter(){
-
-      // dispaly during iteration
-      auto node_map = viewer_->empty_node_map(*graph_);
-      viewer_->clear();
-      viewer_->add_nodes(graph_->node_begin(), graph_->node_end(), pcf_, Positionfunction<Vector>(*x_), node_map);
-      viewer_->add_edges(graph_->edge_begin(), graph_->edge_end(), node_map);
+    void visual_iter(bool force = false){
+
+      // display during iteration, at most as often as throttle_ allows
+      if(!throttle_.due() && !force) return;
+      CME212_PROFILE_SCOPE("render");
+      if(first_frame_){
+        // Full rebuild once; the topology never changes during the solve
+        auto node_map = viewer_->empty_node_map(*graph_);
+        viewer_->clear();
+        viewer_->add_nodes(graph_->node_begin(), graph_->node_end(), pcf_, Positionfunction<Vector>(*x_), node_map);
+        viewer_->add_edges(graph_->edge_begin(), graph_->edge_end(), node_map);
+        first_frame_ = false;
+      } else {
+        viewer_->update_nodes(graph_->node_begin(), graph_->node_end(), pcf_, Positionfunction<Vector>(*x_));
+      }
       viewer_->set_label(this->i);
       viewer_->center_view();
     }
 
   public:
 
+    /** @param throttle Chooses the iterations that get drawn; the first and
+     *  the last one always are. */
     visual_iteration(const Vector& r0, int max_iter_, Real tol_,
        const Viewer* viewer, const GraphType* graph,
-       const PositionColorFn pcf , const Vector* x, Real atol_ = Real(0), int cycle = 10)
+       const PositionColorFn pcf , const Vector* x, Real atol_ = Real(0), int cycle = 10,
+       CME212::RenderThrottle throttle = CME212::RenderThrottle())
      :super(r0, max_iter_, tol_, atol_, cycle), viewer_(const_cast<Viewer*>(viewer)),
-      graph_(const_cast<GraphType*>(graph)), pcf_(pcf), x_(const_cast<Vector*>(x)){
+      graph_(const_cast<GraphType*>(graph)), pcf_(pcf), x_(const_cast<Vector*>(x)),
+      throttle_(throttle), first_frame_(true), lap_("poisson.cg_iteration"){
         viewer_->launch();
-        visual_iter();
+        visual_iter(true);
+        lap_.restart();
       }
 
     bool finished() {
-      visual_iter();
-      return super::finished();
+      bool ret = super::finished();
+      visual_iter(ret);
+      return ret;
     }
 
+    /** Called by the solver once per iteration, which lap_ times. */
     template <typename T>
     bool finished(const T& r)
     {
+       lap_.lap();
        bool ret= super::finished(r);
-       visual_iter();
+       visual_iter(ret);
+       lap_.restart();
        return ret;
     }
   private:
@@ -251,21 +169,133 @@ namespace itl{
     GraphType* graph_;
     PositionColorFn pcf_;
     Vector* x_;
+    CME212::RenderThrottle throttle_;
+    bool first_frame_;
+    profile::LapTimer lap_;
+  };
+
+  /** cyclic_iteration which appends the iterate to a SnapshotWriter every
+   *  @a every iterations and when finished, for runs without a display. */
+  template <class Real, typename Vector>
+  class snapshot_iteration : public cyclic_iteration<Real> {
+
+    typedef cyclic_iteration<Real> super;
+
+    void snapshot(bool force){
+      if(this->i == last_ || (!force && this->i % every_ != 0)) return;
+      CME212_PROFILE_SCOPE("snapshot");
+      last_ = this->i;
+      const Vector& x = *x_;
+      if(!snapshot_->append(this->i, this->i, graph_->node_begin(), graph_->node_end(),
+                            [&x](const NodeType& n){ return double(x[n.index()]); })){
+        std::cerr << "Error writing snapshot" << std::endl;
+        exit(1);
+      }
+    }
+
+  public:
+
+    snapshot_iteration(const Vector& r0, int max_iter_, Real tol_,
+       SnapshotWriter* snapshot, const GraphType* graph, const Vector* x,
+       int every = 10, Real atol_ = Real(0), int cycle = 10)
+     :super(r0, max_iter_, tol_, atol_, cycle), snapshot_(snapshot),
+      graph_(const_cast<GraphType*>(graph)),
+      x_(x), every_(std::max(every, 1)), last_(-1), lap_("poisson.cg_iteration"){
+      }
+
+    bool finished() {
+      bool ret = super::finished();
+      snapshot(ret);
+      return ret;
+    }
+
+    /** Called by the solver once per iteration, which lap_ times. */
+    template <typename T>
+    bool finished(const T& r)
+    {
+       lap_.lap();
+       bool ret= super::finished(r);
+       snapshot(ret);
+       lap_.restart();
+       return ret;
+    }
+  private:
+    SnapshotWriter* snapshot_;
+    GraphType* graph_;
+    const Vector* x_;
+    int every_;
+    int last_;
+    profile::LapTimer lap_;
   };
 }
 
+/** Solve A @a x = @a b by preconditioned CG with @a iter and report how
+ *  many iterations and seconds it took. */
+template <typename Matrix, typename Vector, typename Preconditioner, typename Iteration>
+void solve_and_report(const Matrix& A, Vector& x, const Vector& b,
+                      const Preconditioner& P, Iteration& iter) {
+  CME212::Clock clock;
+  CME212_PROFILE_SCOPE("poisson.cg");
+  itl::cg(A, x, b, P, iter);
+  std::cout << iter.iterations() << " iterations in " << clock.seconds()
+            << " seconds" << std::endl;
+}
+
 
-/** Remove all the nodes in graph @a g whose posiiton is within Box3D @a bb.
- * @post For all i, 0 <= i < @a g.num_nodes(),
- *        not bb.contains(g.node(i).position())
+#ifdef CME212_USE_MPI
+/** Solve A x = @a b on the matrix of @a graph across the processes of
+ *  MPI_COMM_WORLD, and write x to @a snapshot_file from the first one.
+ *
+ *  Each process assembles the rows of its part of a Morton partition of the
+ *  graph and runs distributed_cg on them, with the Jacobi preconditioner:
+ *  the multigrid of the serial solve does not distribute. */
+template <typename Vector>
+void solve_distributed(GraphType& graph, const Vector& b,
+                       const char* snapshot_file) {
+  int rank, nprocs;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+  Subdomain sub(graph, morton_partition(graph, nprocs), rank);
+  GraphType local = sub.local_graph(graph);
+  GraphSymmetricMatrix A_local(&local, boundary);
+  A_local.tosparse();
+  DistributedMatrix<GraphSymmetricMatrix> A(A_local, sub);
+
+  std::vector<double> x(sub.size(), 0.0), b_local(sub.num_owned());
+  for(unsigned l = 0; l < sub.num_owned(); ++l){
+    b_local[l] = b[sub.global_index(l)];
+  }
+  CME212::Clock clock;
+  int iterations = distributed_cg(A, x, b_local, 1.e-11, 1000);
+  double seconds = clock.seconds();
+
+  std::vector<double> x_all = gather_globally<double>(sub, graph.num_nodes(),
+      [&x](unsigned l){ return x[l]; });
+  if(rank != 0) return;
+  std::cout << iterations << " iterations in " << seconds << " seconds on "
+            << nprocs << " processes" << std::endl;
+  SnapshotWriter snapshot(snapshot_file, graph, 1);
+  if(!snapshot.is_open() or
+     !snapshot.append(iterations, iterations, graph.node_begin(), graph.node_end(),
+                      [&x_all](const NodeType& n){ return x_all[n.index()]; })){
+    std::cerr << "Error writing " << snapshot_file << "\n";
+    exit(1);
+  }
+}
+#endif
+
+/** Remove all the nodes in graph @a g whose position is within any Box3D
+ *  of @a boxes, in a single pass over the graph.
+ * @post For all i, 0 <= i < @a g.num_nodes(), and all boxes b,
+ *        not b.contains(g.node(i).position())
  */
-void remove_box(GraphType& g, const Box3D& bb) {
-  for(auto i = g.node_begin(); i != g.node_end(); ++i){
-    auto n = *i;
-    if(bb.contains(n.position())){
-      g.remove_node(*i);
+void remove_boxes(GraphType& g, const std::vector<Box3D>& boxes) {
+  g.remove_nodes_if([&boxes](const NodeType& n){
+    for(auto& bb : boxes){
+      if(bb.contains(n.position())) return true;
     }
-  }
+    return false;
+  });
   return;
 }
 
@@ -288,31 +318,46 @@ double f(Point& p){
 int main(int argc, char** argv)
 {
   // Check arguments
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " NODES_FILE TETS_FILE\n";
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " NODES_FILE TETS_FILE [SNAPSHOT_FILE [K]]\n";
     exit(1);
   }
+  int rank = 0;
+#ifdef CME212_USE_MPI
+  // MPI is only called from the master thread, between parallel loops
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  if (argc < 4) {
+    if (rank == 0)
+      std::cerr << "With MPI, give a SNAPSHOT_FILE to run headless\n";
+    MPI_Finalize();
+    exit(1);
+  }
+#endif
 
   // Define an empty Graph
   GraphType graph;
 
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file(argv[1]);
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  std::vector<typename GraphType::node_type> node_vec;
-  Point p;
-  while (CME212::getline_parsed(nodes_file, p))
-    node_vec.push_back(graph.add_node(2*p - Point(1,1,0)));
-
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file(argv[2]);
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t)) {
-    graph.add_edge(node_vec[t[0]], node_vec[t[1]]);
-    graph.add_edge(node_vec[t[0]], node_vec[t[2]]);
-    graph.add_edge(node_vec[t[1]], node_vec[t[3]]);
-    graph.add_edge(node_vec[t[2]], node_vec[t[3]]);
+  // Read the nodes and tets files, text or binary, from the input arguments
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  {
+    CME212_PROFILE_SCOPE("load");
+    if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+      std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+      exit(1);
+    }
+  }
+
+  // Scale each Point to [-1,1]x[-1,1] and add it to the Graph, connecting
+  // the four sides (but not the diagonals) of each grid square
+  for (Point& p : points)
+    p = 2*p - Point(1,1,0);
+  {
+    CME212_PROFILE_SCOPE("build");
+    graph.build_from_tets(points, tets, {{0,1}, {0,2}, {1,3}, {2,3}});
   }
 
   // Get the edge length, should be the same for each edge
@@ -320,16 +365,26 @@ int main(int argc, char** argv)
   assert(it != graph.edge_end());
   double h = norm((*it).node1().position() - (*it).node2().position());
   // Make holes in our Graph
-  remove_box(graph, Box3D(Point(-0.8+h,-0.8+h,-1), Point(-0.4-h,-0.4-h,1)));
-  remove_box(graph, Box3D(Point( 0.4+h,-0.8+h,-1), Point( 0.8-h,-0.4-h,1)));
-  remove_box(graph, Box3D(Point(-0.8+h, 0.4+h,-1), Point(-0.4-h, 0.8-h,1)));
-  remove_box(graph, Box3D(Point( 0.4+h, 0.4+h,-1), Point( 0.8-h, 0.8-h,1)));
-  remove_box(graph, Box3D(Point(-0.6+h,-0.2+h,-1), Point( 0.6-h, 0.2-h,1)));
+  remove_boxes(graph, {Box3D(Point(-0.8+h,-0.8+h,-1), Point(-0.4-h,-0.4-h,1)),
+                       Box3D(Point( 0.4+h,-0.8+h,-1), Point( 0.8-h,-0.4-h,1)),
+                       Box3D(Point(-0.8+h, 0.4+h,-1), Point(-0.4-h, 0.8-h,1)),
+                       Box3D(Point( 0.4+h, 0.4+h,-1), Point( 0.8-h, 0.8-h,1)),
+                       Box3D(Point(-0.6+h,-0.2+h,-1), Point( 0.6-h, 0.2-h,1))});
+
+  // Renumber the nodes with Reverse Cuthill-McKee to keep the bandwidth of
+  // the system matrix small, then pack the adjacency into CSR form.
+  {
+    CME212_PROFILE_SCOPE("reorder");
+    graph.reorder(rcm_order(graph));
+    graph.freeze();
+  }
 
   // HW3: YOUR CODE HERE
   size_t node_num = graph.size();
-  mtl::vec::dense_vector<double> b(node_num, 0.0);
+  // Vectors are first touched by the same static row split as the matvec.
+  mtl::vec::dense_vector<double> b(node_num);
   int kk = 0;
+  #pragma omp parallel for schedule(static) reduction(+:kk)
   for(size_t i = 0; i < node_num; ++i){
     auto n = graph.node(i);
     auto x = n.position();
@@ -338,25 +393,53 @@ int main(int argc, char** argv)
       ++kk;
     }
     else{
-      double gxi = h * h * f(x);
+      // Interior rows of A are the positive Laplacian, hence the signs
+      double gxi = -h * h * f(x);
       for(auto ni = n.edge_begin(); ni != n.edge_end(); ++ni){
         auto n2 = (*ni).node2();
-        if(boundary(n2)) gxi -= g(n2.position());
+        if(boundary(n2)) gxi += g(n2.position());
       }
       b[i] = gxi;
     }
   }
-  std::cout << kk << std::endl;
-  std::cout << "norm(b) = " << mtl::two_norm(b) << std::endl;
+  if (rank == 0) {
+    std::cout << kk << std::endl;
+    std::cout << "norm(b) = " << mtl::two_norm(b) << std::endl;
+  }
+#ifdef CME212_USE_MPI
+  solve_distributed(graph, b, argv[3]);
+  MPI_Finalize();
+  return 0;
+#endif
 
-  GraphSymmetricMatrix A(&graph);
+  GraphSymmetricMatrix A(&graph, boundary);
   A.tosparse();
-  mtl::vec::dense_vector<double> x(node_num, 0.0);
+  mtl::vec::dense_vector<double> x(node_num);
+  #pragma omp parallel for schedule(static)
+  for(size_t i = 0; i < node_num; ++i){
+    x[i] = 0.0;
+  }
+  // Multigrid iterations stay few as the mesh grows; on grid4 it needs about
+  // 80 iterations, IC(0) about 500 and plain CG about 1600.
+  itl::pc::graph_multigrid P(A);
   //itl::cyclic_iteration<double> iter(b, 1000, 1.e-11, 0.0, 10);
-  CME212::SDLViewer viewer;
-  itl::visual_iteration<double, CME212::SDLViewer, mtl::vec::dense_vector<double>>
-    iter(b, 1000, 1.e-11, &viewer, &graph, PositionColorFn(), &x);
-  itl::cg(A, x, b, iter);
+  if (argc > 3) {
+    // Headless: no SDL at all, the iterates go to the snapshot file
+    SnapshotWriter snapshot(argv[3], graph, 1);
+    if (!snapshot.is_open()) {
+      std::cerr << "Error writing " << argv[3] << "\n";
+      exit(1);
+    }
+    itl::snapshot_iteration<double, mtl::vec::dense_vector<double>>
+      iter(b, 1000, 1.e-11, &snapshot, &graph, &x, argc > 4 ? atoi(argv[4]) : 10);
+    solve_and_report(A, x, b, P, iter);
+  } else {
+    CME212::SDLViewer viewer;
+    itl::visual_iteration<double, CME212::SDLViewer, mtl::vec::dense_vector<double>>
+      iter(b, 1000, 1.e-11, &viewer, &graph, PositionColorFn(), &x, 0.0, 10,
+           CME212::RenderThrottle(1, 30));
+    solve_and_report(A, x, b, P, iter);
+  }
 
   return 0;
 }
@@ -6,6 +6,9 @@
  * First file: 3D Points (one per line) defined by three doubles
  * Second file: Tetrahedra (one per line) defined by 4 indices into the point
  * list
+ *
+ * With a third argument, runs headless: no SDLViewer is launched and the path
+ * lengths are written to that snapshot file. View it with snapshot_view.
  */
 
 #include <vector>
@@ -17,6 +20,10 @@
 #include "CME212/Color.hpp"
 
 #include "Graph.hpp"
+#include "GraphOrdering.hpp"
+#include "GraphSearch.hpp"
+#include "MeshIO.hpp"
+#include "Snapshot.hpp"
 
 
 /** Comparator that compares the distance from a given point p.
@@ -36,6 +43,9 @@ struct MyComparator {
 };
 
 
+/** Breadth first search from @a root, defined below. */
+int shortest_path_lengths(Graph<int, int>& g, Graph<int, int>::node_type root);
+
 /** Calculate shortest path lengths in @a g from the nearest node to @a point.
  * @param[in,out] g Input graph
  * @param[in] point Point to find the nearest node to.
@@ -54,44 +64,28 @@ struct MyComparator {
 int shortest_path_lengths(Graph<int, int>& g, const Point& point) {
   MyComparator mc = MyComparator(point);
 
-  // Find the closest node to the given Point as root.
-  Graph<int, int>::node_iterator nifirst = g.node_begin();
-  Graph<int, int>::node_iterator nilast = g.node_end();
-  Graph<int, int>::node_iterator niroot = std::min_element(nifirst, nilast, mc);
-  Graph<int, int>::node_type root = *niroot;
+  // Find the closest node to the given Point as root. A single query is
+  // cheapest as one linear scan.
+  Graph<int, int>::node_iterator niroot = std::min_element(g.node_begin(), g.node_end(), mc);
+  return shortest_path_lengths(g, *niroot);
+}
 
-  // Set all the nodes' default values to -1 and the root's value to 0.
-  for(; nifirst != nilast; ++nifirst){
-    (*nifirst).value() = -1;
-  }
-  root.value() = 0;
+/** Breadth first search from @a root, see shortest_path_lengths(g, point).
+ *
+ * Runs the parallel GraphSearch::bfs() and copies its distances into the
+ * node values; callers with several roots or repeated searches should keep
+ * a GraphSearch and use bfs() directly.
+ */
+int shortest_path_lengths(Graph<int, int>& g, Graph<int, int>::node_type root) {
+  GraphSearch<Graph<int, int>> search(g);
+  std::vector<int> dist = search.bfs(root.index());
 
-  // Set the current longest distance from root.
+  // Unreachable nodes keep the value -1
   int max = 0;
-
-  /** The queue is to store the nodes needed to be evaluated.
-   *  For each node n in the queue, we iterate the adjent nodes and set their values,
-   *  push them into the queue and then pop n. In this process, update max.
-   */
-  std::queue<Graph<int, int>::node_type> waiting;
-  waiting.push(root);
-  while(!waiting.empty()){
-    Graph<int, int>::node_type r = waiting.front();
-    int cur = r.value();
-    Graph<int, int>::incident_iterator rbegin = r.edge_begin();
-    Graph<int, int>::incident_iterator rend = r.edge_end();
-    for(; rbegin != rend; ++rbegin){
-      if((*rbegin).node2().value() == -1){
-        (*rbegin).node2().value() = cur + 1;
-        if((*rbegin).node2().value() > max) max = (*rbegin).node2().value();
-        waiting.push((*rbegin).node2());
-      }
-      if((*rbegin).node2().value() > cur + 1){
-        (*rbegin).node2().value() = cur + 1;
-        if((*rbegin).node2().value() > max) max = (*rbegin).node2().value();
-      }
-    }
-    waiting.pop();
+  #pragma omp parallel for reduction(max:max) schedule(static)
+  for(unsigned i = 0; i < g.num_nodes(); ++i){
+    g.node(i).value() = dist[i];
+    max = std::max(max, dist[i]);
   }
   return max;
 }
@@ -131,41 +125,56 @@ int main(int argc, char** argv)
 {
   // Check arguments
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " NODES_FILE TETS_FILE\n";
+    std::cerr << "Usage: " << argv[0] << " NODES_FILE TETS_FILE [SNAPSHOT_FILE]\n";
     exit(1);
   }
 
   // Construct a Graph
   typedef Graph<int, int> GraphType;
   GraphType graph;
-  std::vector<GraphType::node_type> nodes;
-
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file(argv[1]);
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  Point p;
-  while (CME212::getline_parsed(nodes_file, p))
-    nodes.push_back(graph.add_node(p));
-
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file(argv[2]);
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t))
-    for (unsigned i = 1; i < t.size(); ++i)
-      for (unsigned j = 0; j < i; ++j)
-        graph.add_edge(nodes[t[i]], nodes[t[j]]);
+
+  // Read the nodes and tets files, text or binary, from the input arguments
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+    std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+    exit(1);
+  }
+
+  // Add each Point to the Graph and connect every pair of nodes in each tet
+  graph.build_from_tets(points, tets);
+
+  // Renumber the nodes along a Morton curve so neighbors are close in memory.
+  graph.reorder(morton_order(graph));
+
+  // The topology is fixed from here on, so pack the adjacency into CSR form.
+  graph.freeze();
 
   // Print out the stats
   std::cout << graph.num_nodes() << " " << graph.num_edges() << std::endl;
 
+  Point pref = Point(-1, 0, 1);
+  int path = shortest_path_lengths(graph, pref);
+
+  // Headless: write the path lengths, unreachable nodes as -1, and stop
+  if (argc > 3) {
+    SnapshotWriter snapshot(argv[3], graph, 1);
+    if (!snapshot.append(0, 0.0, graph.node_begin(), graph.node_end(),
+                         [](const Graph<int, int>::node_type& n) {
+                           return double(n.value());
+                         })) {
+      std::cerr << "Error writing " << argv[3] << "\n";
+      exit(1);
+    }
+    std::cout << "Longest path " << path << std::endl;
+    return 0;
+  }
+
   // Launch the SDLViewer
   CME212::SDLViewer viewer;
   viewer.launch();
   auto node_map = viewer.empty_node_map(graph);
 
-  Point pref = Point(-1, 0, 1);
-  int path = shortest_path_lengths(graph, pref);
   PathColorFn pcf = PathColorFn(path);
   viewer.add_nodes(graph.node_begin(), graph.node_end(), pcf, node_map);
 
@@ -0,0 +1,99 @@
+/**
+ * @file snapshot_view.cpp
+ * Play back a snapshot file written by a headless run
+ *
+ * @brief Reads the snapshot file specified on the command line, written by
+ * mass_spring, poisson or shortest_path when given a SNAPSHOT_FILE argument.
+ * The optional second argument is the playback rate in frames per second
+ * (default 30).
+ *
+ * Prints
+ * A B C
+ * where A = number of nodes
+ *       B = number of edges
+ *       C = number of frames
+ * and launches an SDLViewer. Frames of positions move the nodes; frames of
+ * one value per node color them from purple (smallest) to red (largest).
+ */
+
+#include <algorithm>
+
+#include "CME212/SDLViewer.hpp"
+#include "CME212/Util.hpp"
+#include "CME212/Color.hpp"
+
+#include "Graph.hpp"
+#include "Snapshot.hpp"
+
+
+int main(int argc, char** argv)
+{
+  // Check arguments
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " SNAPSHOT_FILE [FPS]\n";
+    exit(1);
+  }
+  double fps = argc > 2 ? std::max(atof(argv[2]), 1e-3) : 30;
+
+  SnapshotReader snapshot(argv[1]);
+  if (!snapshot.is_open()
+      || (snapshot.components() != 1 && snapshot.components() != 3)) {
+    std::cerr << "Error reading " << argv[1] << "\n";
+    exit(1);
+  }
+
+  // Rebuild the graph stored with the snapshot
+  typedef Graph<double, double> GraphType;
+  typedef GraphType::node_type Node;
+  GraphType graph;
+  for (const Point& p : snapshot.positions())
+    graph.add_node(p);
+  const std::vector<uint32_t>& edges = snapshot.edges();
+  for (std::size_t k = 0; k + 1 < edges.size(); k += 2)
+    graph.add_edge(graph.node(edges[k]), graph.node(edges[k+1]));
+
+  std::cout << graph.num_nodes() << " " << graph.num_edges() << " "
+            << snapshot.num_frames() << std::endl;
+
+  // Launch a viewer
+  CME212::SDLViewer viewer;
+  viewer.launch();
+
+  auto node_map = viewer.empty_node_map(graph);
+  viewer.add_nodes(graph.node_begin(), graph.node_end(), node_map);
+  viewer.add_edges(graph.edge_begin(), graph.edge_end(), node_map);
+  viewer.center_view();
+
+  std::vector<double> values;
+  for (std::size_t k = 0; k < snapshot.num_frames(); ++k) {
+    CME212::Clock clock;
+    if (!snapshot.read_frame(k, values)) {
+      std::cerr << "Error reading frame " << k << " of " << argv[1] << "\n";
+      exit(1);
+    }
+    if (snapshot.components() == 3) {
+      viewer.update_positions(graph.node_begin(), graph.node_end(),
+                              [&values](const Node& n) {
+                                const double* v = &values[3 * n.index()];
+                                return Point(v[0], v[1], v[2]);
+                              });
+    } else if (!values.empty()) {
+      // Node values carry the frame's scalar, scaled to [0,1] for the colors
+      auto mm = std::minmax_element(values.begin(), values.end());
+      double lo = *mm.first;
+      double range = std::max(*mm.second - lo, 1e-300);
+      for (auto it = graph.node_begin(); it != graph.node_end(); ++it)
+        (*it).value() = (values[(*it).index()] - lo) / range;
+      viewer.update_nodes(graph.node_begin(), graph.node_end(),
+                          [](const Node& n) {
+                            return CME212::Color::make_heat(n.value());
+                          },
+                          CME212::DefaultPosition());
+    }
+    viewer.set_label(snapshot.time(k));
+
+    CME212::sleep(std::max(1.0 / fps - clock.seconds(), 0.0));
+  }
+
+  return 0;
+}
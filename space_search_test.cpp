@@ -7,6 +7,7 @@
 
 #include "Graph.hpp"
 #include "SpaceSearcher.hpp"
+#include "MeshIO.hpp"
 
 int main()
 {
@@ -15,22 +16,16 @@ int main()
   using Node = typename GraphType::node_type;
   GraphType graph;
 
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file("data/large.nodes");
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  Point p;
-  std::vector<typename GraphType::node_type> nodes;
-  while (CME212::getline_parsed(nodes_file, p))
-    nodes.push_back(graph.add_node(p));
+  // Read the large mesh
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes("data/large.nodes", points) || !read_tets("data/large.tets", tets)) {
+    std::cerr << "Error reading data/large.nodes or data/large.tets\n";
+    exit(1);
+  }
 
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file("data/large.tets");
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t))
-    for (unsigned i = 1; i < t.size(); ++i)
-      for (unsigned j = 0; j < i; ++j)
-        graph.add_edge(nodes[t[i]], nodes[t[j]]);
+  // Add each Point to the Graph and connect every pair of nodes in each tet
+  graph.build_from_tets(points, tets);
 
   std::cout << graph.num_nodes() << "  " << graph.num_edges() << std::endl;
 
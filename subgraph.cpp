@@ -15,6 +15,7 @@
 #include "CME212/Util.hpp"
 
 #include "Graph.hpp"
+#include "MeshIO.hpp"
 
 /** An iterator that skips over elements of another iterator based on whether
  * those elements satisfy a predicate.
@@ -39,7 +40,7 @@ class filter_iterator
   // Constructor
   filter_iterator(const Pred& p, const It& first, const It& last)
       : p_(p), it_(first), end_(last) {
-    // HW1 #4: YOUR CODE HERE
+    skip();
   }
 
   value_type operator*() const {
@@ -48,7 +49,7 @@ class filter_iterator
 
   self_type& operator++(){
     ++it_;
-    if(!p_(it_) and it_ != end_) ++it_;
+    skip();
     return *this;
   }
 
@@ -60,6 +61,11 @@ class filter_iterator
   Pred p_;
   It it_;
   It end_;
+
+  // Move past every element that fails the predicate
+  void skip(){
+    while(it_ != end_ and !p_(*it_)) ++it_;
+  }
 };
 
 /** Helper function for constructing filter_iterators.
@@ -102,7 +108,7 @@ struct ProbPredicate {
   template <typename NODE>
   bool operator()(const NODE& ni) {
     (void) ni;
-    return rand() % 1 > 0.9;
+    return rand() % 10 == 0;
   }
 };
 
@@ -126,23 +132,17 @@ int main(int argc, char** argv)
   // Construct a Graph
   typedef Graph<int, double> GraphType;
   GraphType graph;
-  std::vector<GraphType::node_type> nodes;
-
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file(argv[1]);
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  Point p;
-  while (CME212::getline_parsed(nodes_file, p))
-    nodes.push_back(graph.add_node(p));
-
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file(argv[2]);
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t))
-    for (unsigned i = 1; i < t.size(); ++i)
-      for (unsigned j = 0; j < i; ++j)
-        graph.add_edge(nodes[t[i]], nodes[t[j]]);
+
+  // Read the nodes and tets files, text or binary, from the input arguments
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+    std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+    exit(1);
+  }
+
+  // Add each Point to the Graph and connect every pair of nodes in each tet
+  graph.build_from_tets(points, tets);
 
   // Print out the stats
   std::cout << graph.num_nodes() << " " << graph.num_edges() << std::endl;
@@ -162,13 +162,18 @@ int main(int argc, char** argv)
   // filter_iterator<BelowPredicate, GraphType::node_iterator> filter_end = make_filtered(graph.node_end(), graph.node_end(), bp);
 
   // Test the ProbPredicate.
-  ProbPredicate pp;
-  filter_iterator<ProbPredicate, GraphType::node_iterator> filter_begin = make_filtered(graph.node_begin(), graph.node_end(), pp);
-  filter_iterator<ProbPredicate, GraphType::node_iterator> filter_end = make_filtered(graph.node_end(), graph.node_end(), pp);
+  //ProbPredicate pp;
+  //filter_iterator<ProbPredicate, GraphType::node_iterator> filter_begin = make_filtered(graph.node_begin(), graph.node_end(), pp);
+  //filter_iterator<ProbPredicate, GraphType::node_iterator> filter_end = make_filtered(graph.node_end(), graph.node_end(), pp);
+
+  // The SlicePredicate as a view: the predicate runs once per node, in
+  // parallel, and only the edges inside the slice are handed to the viewer.
+  auto slice = graph.view(SlicePredicate());
+  std::cout << slice.num_nodes() << " " << slice.num_edges() << std::endl;
 
   auto node_map = viewer.empty_node_map(graph);
-  viewer.add_nodes(filter_begin, filter_end, node_map);
-  viewer.add_edges(graph.edge_begin(), graph.edge_end(), node_map);
+  viewer.add_nodes(slice.node_begin(), slice.node_end(), node_map);
+  viewer.add_edges(slice.edge_begin(), slice.edge_end(), node_map);
   viewer.center_view();
 
   return 0;
@@ -0,0 +1,137 @@
+/**
+ * @file test_distributed.cpp
+ * Tests of Distributed.hpp on two or more processes, e.g.
+ *
+ *   mpirun -np 2 ./test_distributed
+ *
+ * Needs -DCME212_USE_MPI, see the Makefile.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <omp.h>
+#include <mpi.h>
+
+#include "Distributed.hpp"
+#include "Graph.hpp"
+#include "GraphOrdering.hpp"
+#include "MassSpring.hpp"
+#include "MeshIO.hpp"
+#include "Partition.hpp"
+
+
+static unsigned fail_count = 0;
+static int rank = 0;
+
+/** Report @a sf, which must hold on every process, from the first one. */
+void sf_print(bool sf, std::string msg = "") {
+  sf = all_min(sf ? 1 : 0) == 1;
+  if (rank != 0)
+    return;
+  if (sf)
+    std::cerr << msg << " [Success]" << std::endl;
+  else {
+    std::cerr << msg << " [FAIL]" << std::endl;
+    ++fail_count;
+  }
+}
+
+/** Node and edge data of a MassSpringSystem, as in mass_spring.cpp */
+struct NodeData {
+  Point vel;
+  double mass;
+};
+struct EdgeData {
+  double K;
+  double L;
+};
+typedef Graph<NodeData, EdgeData> SpringGraph;
+
+/** Load data/grid1 as mass_spring does, stretched by a tenth and moving
+ * the same way on every process. */
+bool load_cloth(SpringGraph& g) {
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes("data/grid1.nodes", points) || !read_tets("data/grid1.tets", tets))
+    return false;
+  g.build_from_tets(points, tets);
+  g.reorder(morton_order(g));
+  for (auto it = g.node_begin(); it != g.node_end(); ++it) {
+    const double i = (*it).index();
+    (*it).value() = NodeData{0.1 * Point(std::sin(i), std::cos(i), std::sin(2 * i)),
+                             1.0 / g.num_nodes()};
+  }
+  for (auto it = g.edge_begin(); it != g.edge_end(); ++it) {
+    (*it).value() = EdgeData{100, (*it).length()};
+    (*it).dual().value() = EdgeData{100, (*it).length()};
+  }
+  for (auto it = g.node_begin(); it != g.node_end(); ++it)
+    (*it).position() *= 1.1;
+  g.freeze();
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  int provided, nprocs;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+  SpringGraph graph;
+  sf_print(load_cloth(graph), "Load data/grid1");
+  Subdomain sub(graph, morton_partition(graph, nprocs), rank);
+  sf_print(nprocs == 1 || sub.num_ghosts() > 0, "Subdomain has ghosts");
+
+  // Every ghost receives the global index its owner sends
+  {
+    typedef Subdomain::size_type size_type;
+    HaloExchange<size_type> halo(sub);
+    std::vector<size_type> got(sub.size(), size_type(-1));
+    halo.begin([&sub](size_type l) { return sub.global_index(l); });
+    halo.end([&got](size_type l, size_type v) { got[l] = v; });
+    bool ok = true;
+    for (size_type l = sub.num_owned(); l < sub.size(); ++l)
+      ok &= got[l] == sub.global_index(l);
+    for (size_type l = 0; l < sub.num_owned(); ++l)
+      ok &= got[l] == size_type(-1);
+    sf_print(ok, "HaloExchange fills the ghosts from their owners");
+  }
+
+  // Steps of the distributed system match those of the whole system, up to
+  // summation order
+  auto is_fixed = [](const SpringGraph::node_type& n) {
+    return n.position() == Point(0, 0, 0) || n.position() == Point(1.1, 0, 0);
+  };
+  auto force = GravityTerm() + SpringTerm() + DampingTerm(0.1);
+  MassSpringSystem whole(graph, is_fixed);
+  SpringGraph local = sub.local_graph(graph);
+  MassSpringSystem part(local, is_fixed);
+  DistributedMassSpring distributed(part, sub);
+  const double dt = whole.stable_dt();
+  sf_print(distributed.stable_dt() == dt, "DistributedMassSpring::stable_dt");
+  double t = 0, td = 0;
+  for (int k = 0; k < 20; ++k) {
+    t = whole.step(t, dt, force);
+    td = distributed.step(td, dt, force);
+  }
+  double err = 0, scale = 0;
+  for (unsigned l = 0; l < sub.size(); ++l) {
+    const unsigned i = sub.global_index(l);
+    err = std::max(err, norm_inf(part.position(l) - whole.position(i)));
+    err = std::max(err, norm_inf(part.velocity(l) - whole.velocity(i)));
+    scale = std::max(scale, norm_inf(whole.velocity(i)));
+  }
+  sf_print(td == t && scale > 0 && err <= 1e-12 * scale,
+           "DistributedMassSpring::step against MassSpringSystem::step");
+
+  MPI_Finalize();
+  if (fail_count) {
+    std::cerr << "\n" << fail_count
+              << (fail_count > 1 ? " FAILURES" : " FAILURE") << std::endl;
+    return 1;
+  } else
+    return 0;
+}
@@ -1,6 +1,16 @@
+#include <thrust/iterator/counting_iterator.h>
+
 #include "CME212/Util.hpp"
 
+#include "Constraints.hpp"
 #include "Graph.hpp"
+#include "GraphOrdering.hpp"
+#include "GraphSearch.hpp"
+#include "MassSpring.hpp"
+#include "MeshIO.hpp"
+#include "Partition.hpp"
+#include "Snapshot.hpp"
+#include "SpaceSearcher.hpp"
 
 
 static unsigned fail_count = 0;
@@ -21,6 +31,488 @@ void sf_print(bool sf, std::string msg = "") {
 }
 
 
+/** Spread the low @a bits bits of @a x two zeros apart, one bit at a time. */
+template <typename C>
+C spread_reference(C x, int bits) {
+  C r = 0;
+  for (int b = 0; b < bits; ++b)
+    r |= ((x >> b) & 1) << (3 * b);
+  return r;
+}
+
+/** A uniform random unsigned integer below 2^@a bits, @a bits <= 53. */
+uint64_t random_bits(int bits) {
+  return uint64_t(CME212::random(0, 1) * double(uint64_t(1) << bits))
+         & ((uint64_t(1) << bits) - 1);
+}
+
+
+/** Check MortonCoder<L, C>: the code type, code() round trips through
+ * cell(), i.e. deinterleave(interleave(x)) == x, the batched code(), and
+ * clamping on the upper faces of the box. */
+template <int L, typename C = typename detail::morton_code_type<L>::type>
+bool check_morton_coder() {
+  typedef MortonCoder<L, C> MC;
+  typedef typename MC::code_type code_type;
+  const uint64_t last = uint64_t(MC::end_code) - 1;
+  bool ok = true;
+  MC mc(Box3D(Point(-1, 2, 0.5), Point(3, 2.5, 4)));
+  const Box3D bb = mc.bounding_box();
+  std::vector<Point> points;
+  for (unsigned k = 0; k < 1000; ++k) {
+    code_type c = code_type(((random_bits(32) << 32) | random_bits(32)) & last);
+    Box3D cell = mc.cell(c);
+    ok = ok && mc.code((cell.min() + cell.max()) / 2) == c;
+    Point p(CME212::random(bb.min().x, bb.max().x),
+            CME212::random(bb.min().y, bb.max().y),
+            CME212::random(bb.min().z, bb.max().z));
+    ok = ok && mc.cell(mc.code(p)).contains(p);
+    points.push_back(p);
+  }
+  std::vector<code_type> codes(points.size());
+  mc.code(points.data(), codes.data(), points.size());
+  for (unsigned k = 0; k < points.size(); ++k)
+    ok = ok && codes[k] == mc.code(points[k]);
+  // Points on the upper faces belong to the last cell along that axis
+  Point corner(bb.max().x, bb.min().y, bb.max().z);
+  ok = ok && mc.code(bb.min()) == 0 && uint64_t(mc.code(bb.max())) == last
+       && uint64_t(mc.code(corner)) == (uint64_t(MC::x_mask | MC::z_mask) & last);
+  return ok;
+}
+
+/** True if walking @a searcher over the whole of @a bb, the box it was
+ * built with, visits every index into @a points once, by increasing Morton
+ * code of its point. With @a stable, equal codes come by increasing index,
+ * the order of construction. */
+template <int L>
+bool searcher_sorted(const SpaceSearcher<unsigned, L>& searcher, const Box3D& bb,
+                     const std::vector<Point>& points, bool stable) {
+  MortonCoder<L> mc(bb);
+  std::vector<unsigned> seen(points.size(), 0);
+  bool ok = true, first = true;
+  unsigned prev = 0;
+  auto end = searcher.end(searcher.bounding_box());
+  for (auto it = searcher.begin(searcher.bounding_box()); ok && it != end; ++it) {
+    unsigned i = *it;
+    ok = i < points.size() && ++seen[i] == 1;
+    if (ok && !first) {
+      auto a = mc.code(points[prev]), b = mc.code(points[i]);
+      ok = a < b || (a == b && (!stable || prev < i));
+    }
+    prev = i;
+    first = false;
+  }
+  return ok && std::count(seen.begin(), seen.end(), 1u) == long(points.size());
+}
+
+/** Random points in a box, as a SpaceSearcher<unsigned, L> over their
+ * indices sees them, each built with 1 and 3 threads. */
+template <int L>
+bool check_searcher_sort(unsigned n) {
+  Box3D bb(Point(0, 0, 0), Point(1, 2, 0.5));
+  std::vector<Point> points;
+  for (unsigned k = 0; k < n; ++k)
+    points.push_back(Point(CME212::random(0, 1), CME212::random(0, 2),
+                           CME212::random(0, 0.5)));
+  auto i2p = [&points](unsigned i) { return points[i]; };
+  const int threads = omp_get_max_threads();
+  bool ok = true;
+  for (int t : {1, 3}) {
+    omp_set_num_threads(t);
+    SpaceSearcher<unsigned, L> searcher(bb, thrust::counting_iterator<unsigned>(0),
+                                        thrust::counting_iterator<unsigned>(n), i2p);
+    ok = ok && searcher_sorted(searcher, bb, points, true);
+  }
+  omp_set_num_threads(threads);
+  return ok;
+}
+
+/** A SpaceSearcher<unsigned, L> refreshed with update() after its points
+ * move a little, which the insertion sort handles, then after they are
+ * shuffled, which hands over to the radix sort. */
+template <int L>
+bool check_searcher_update(unsigned n) {
+  Box3D bb(Point(0, 0, 0), Point(1, 1, 1));
+  std::vector<Point> points;
+  for (unsigned k = 0; k < n; ++k)
+    points.push_back(Point(CME212::random(), CME212::random(), CME212::random()));
+  auto i2p = [&points](unsigned i) { return points[i]; };
+  SpaceSearcher<unsigned, L> searcher(bb, thrust::counting_iterator<unsigned>(0),
+                                      thrust::counting_iterator<unsigned>(n), i2p);
+  for (Point& p : points) {
+    for (int d = 0; d < 3; ++d)
+      p[d] = std::min(std::max(p[d] + CME212::random(-0.01, 0.01), 0.0), 1.0);
+  }
+  searcher.update(i2p);
+  bool ok = searcher_sorted(searcher, bb, points, false);
+  std::reverse(points.begin(), points.end());
+  std::random_shuffle(points.begin(), points.begin() + n / 2);
+  searcher.update(i2p);
+  return ok && searcher_sorted(searcher, bb, points, false);
+}
+
+/** The radius and k-nearest-neighbor queries of a SpaceSearcher<unsigned, L>
+ * against brute force over @a n random points of [0,1]^2 x [0,@a depth].
+ * With @a depth == 0 the box is flat and has no volume. */
+template <int L>
+bool check_searcher_queries(unsigned n, double depth) {
+  Box3D bb(Point(0, 0, 0), Point(1, 1, depth));
+  std::vector<Point> points;
+  for (unsigned k = 0; k < n; ++k)
+    points.push_back(Point(CME212::random(), CME212::random(), depth * CME212::random()));
+  auto i2p = [&points](unsigned i) { return points[i]; };
+  SpaceSearcher<unsigned, L> searcher(bb, thrust::counting_iterator<unsigned>(0),
+                                      thrust::counting_iterator<unsigned>(n), i2p);
+  auto brute = [&points](const Point& c, double r) {
+    std::vector<unsigned> in;
+    for (unsigned i = 0; i < points.size(); ++i)
+      if (normSq(points[i] - c) <= r * r)
+        in.push_back(i);
+    return in;
+  };
+
+  bool ok = true;
+  for (int q = 0; ok && q < 50; ++q) {
+    Point c(CME212::random(-0.1, 1.1), CME212::random(-0.1, 1.1), depth * CME212::random());
+    double r = CME212::random(0, 0.3);
+    std::vector<unsigned> expect = brute(c, r), found, listed;
+    searcher.for_each_in_radius(c, r, [&found](unsigned i) { found.push_back(i); });
+    searcher.radius_query(c, r, std::back_inserter(listed));
+    std::sort(found.begin(), found.end());
+    std::sort(listed.begin(), listed.end());
+    ok = found == expect && listed == expect;
+
+    for (std::size_t k : {std::size_t(1), std::size_t(7), std::size_t(n + 1)}) {
+      std::vector<double> dist;
+      for (const Point& p : points)
+        dist.push_back(normSq(p - c));
+      std::sort(dist.begin(), dist.end());
+      std::vector<unsigned> nearest;
+      searcher.knn(c, k, std::back_inserter(nearest));
+      ok = ok && nearest.size() == std::min<std::size_t>(k, n);
+      // Nearest first, at the brute-force distances; ties may come in any order
+      for (std::size_t m = 0; ok && m < nearest.size(); ++m)
+        ok = normSq(points[nearest[m]] - c) == dist[m];
+    }
+  }
+
+  std::vector<std::vector<unsigned>> within(n);
+  auto radius = [](unsigned i) { return 0.05 + 0.1 * (i % 3); };
+  searcher.radius_query_all(radius, [&within](unsigned t, unsigned s) {
+    within[t].push_back(s);
+  });
+  for (unsigned i = 0; ok && i < n; ++i) {
+    std::sort(within[i].begin(), within[i].end());
+    ok = within[i] == brute(points[i], radius(i));
+  }
+  return ok;
+}
+
+/** True if detail::parse_number reads every string of @a text to the same
+ * bits as strtod, and stops at the same character. */
+bool check_parse_number(std::initializer_list<const char*> text) {
+  bool ok = true;
+  for (const char* t : text) {
+    const char* end = t + std::strlen(t);
+    const char* p = t;
+    double v = 1;
+    char* stop;
+    double expect = std::strtod(t, &stop);
+    ok = ok && detail::parse_number(p, end, v) && p == stop
+         && std::memcmp(&v, &expect, sizeof(double)) == 0;
+  }
+  return ok;
+}
+
+/** A text mesh read with read_nodes/read_tets, split between 1 and 3
+ * threads, then written with write_nodes_binary/write_tets_binary and
+ * read back. The files are made in the current directory and removed. */
+bool check_mesh_io(unsigned n) {
+  const std::string nodes_path = "test_edges_mesh.nodes";
+  const std::string tets_path = "test_edges_mesh.tets";
+  std::vector<Point> nodes;
+  std::vector<tet_type> tets;
+  {
+    std::ofstream nf(nodes_path), tf(tets_path);
+    nf << "# x y z\n\n";
+    char buf[128];
+    for (unsigned k = 0; k < n; ++k) {
+      nodes.push_back(Point(CME212::random(-1, 1), std::ldexp(CME212::random(), int(k % 40) - 20),
+                            k % 7 == 0 ? -0.0 : CME212::random()));
+      std::snprintf(buf, sizeof(buf), k % 2 ? "%.17g %.17e\t%.6g\n" : "%.15g  %.20g %g\n",
+                    nodes.back().x, nodes.back().y, nodes.back().z);
+      // Take the values back from the text, as strtod rounds them
+      char* q = buf;
+      for (int d = 0; d < 3; ++d)
+        nodes.back()[d] = std::strtod(q, &q);
+      nf << buf;
+      tets.push_back(tet_type{{k, 3 * k + 1, k % 11, 4000000000u - k}});
+      tf << k << " " << 3 * k + 1 << "   " << k % 11 << "\t" << 4000000000u - k << "\n";
+      if (k % 100 == 0) {
+        nf << "# comment\n";
+        tf << "\n";
+      }
+    }
+  }
+
+  auto same_nodes = [&nodes](const std::vector<Point>& read) {
+    return read.size() == nodes.size()
+        && std::memcmp(read.data(), nodes.data(), nodes.size() * sizeof(Point)) == 0;
+  };
+  const int threads = omp_get_max_threads();
+  bool ok = true;
+  for (int t : {1, 3}) {
+    omp_set_num_threads(t);
+    std::vector<Point> read_n;
+    std::vector<tet_type> read_t;
+    ok = ok && read_nodes(nodes_path, read_n) && same_nodes(read_n)
+         && read_tets(tets_path, read_t) && read_t == tets;
+  }
+  omp_set_num_threads(threads);
+
+  std::vector<Point> read_n;
+  std::vector<tet_type> read_t;
+  ok = ok && write_nodes_binary(nodes_path, nodes) && write_tets_binary(tets_path, tets)
+       && read_nodes(nodes_path, read_n) && same_nodes(read_n)
+       && read_tets(tets_path, read_t) && read_t == tets;
+  std::remove(nodes_path.c_str());
+  std::remove(tets_path.c_str());
+  return ok;
+}
+
+/** Write three frames of a graph to a snapshot with @a flags and read them
+ * back with SnapshotReader.
+ * @return the size of the file, or 0 if anything read back differs. */
+std::size_t check_snapshot(uint32_t flags) {
+  const std::string path = "test_edges.snap";
+  Graph<int, int> g;
+  for (int k = 0; k < 300; ++k)
+    g.add_node(Point(CME212::random(), CME212::random(), 0));
+  for (unsigned k = 0; k + 1 < g.num_nodes(); ++k)
+    g.add_edge(g.node(k), g.node(k + 1));
+  // Smooth values compress, as real frames do
+  auto value = [](const Graph<int, int>::node_type& n, int frame) {
+    return double(frame) + 0.25 * (n.index() / 10);
+  };
+  {
+    SnapshotWriter snap(path, g, 1, flags);
+    for (int frame = 0; frame < 3; ++frame)
+      snap.append(10 * frame, 0.5 * frame, g.node_begin(), g.node_end(),
+                  [&](const Graph<int, int>::node_type& n) { return value(n, frame); });
+    if (!snap.is_open())
+      return 0;
+  }
+
+#ifndef CME212_USE_ZLIB
+  flags &= ~uint32_t(SNAPSHOT_ZLIB);
+#endif
+  SnapshotReader reader(path);
+  bool ok = reader.is_open() && reader.flags() == flags && reader.num_frames() == 3
+            && reader.num_nodes() == g.num_nodes() && reader.components() == 1
+            && reader.edges().size() == 2 * g.num_edges();
+  for (unsigned i = 0; ok && i < g.num_nodes(); ++i)
+    ok = reader.positions()[i] == g.node(i).position();
+  std::vector<double> values;
+  for (int frame = 0; ok && frame < 3; ++frame) {
+    ok = reader.step(frame) == uint64_t(10 * frame) && reader.time(frame) == 0.5 * frame
+         && reader.read_frame(frame, values) && values.size() == g.num_nodes();
+    for (unsigned i = 0; ok && i < g.num_nodes(); ++i)
+      ok = values[i] == value(g.node(i), frame);
+  }
+  std::ifstream f(path, std::ios::binary | std::ios::ate);
+  std::size_t bytes = ok ? std::size_t(f.tellg()) : 0;
+  std::remove(path.c_str());
+  return bytes;
+}
+
+/** Node and edge values as MassSpringSystem reads them. */
+struct SpringNode {
+  Point vel;
+  double mass;
+};
+struct SpringEdge {
+  double K;
+  double L;
+};
+typedef Graph<SpringNode, SpringEdge> SpringGraph;
+
+/** Two nodes joined by one spring of K = 100 stretched from L = 1 to 1.5,
+ * the first with mass 1 moving along y, the second with mass 2 along z. */
+SpringGraph two_node_spring() {
+  SpringGraph g;
+  g.add_node(Point(0, 0, 0), SpringNode{Point(0, 1, 0), 1});
+  g.add_node(Point(1.5, 0, 0), SpringNode{Point(0, 0, 0.5), 2});
+  g.add_edge(g.node(0), g.node(1));
+  for (auto n = g.node_begin(); n != g.node_end(); ++n)
+    for (auto e = (*n).edge_begin(); e != (*n).edge_end(); ++e)
+      (*e).value() = SpringEdge{100, 1};
+  return g;
+}
+
+bool near(const Point& a, const Point& b) {
+  return norm_inf(a - b) < 1e-12;
+}
+
+/** One step() of the two-node spring against the kick then drift done by
+ * hand, with gravity g = 10 and damping c = 0.1 at dt = 0.01:
+ *   F0 = (50, 0, 0) + (0, 0, -10) - 0.1 (0, 1, 0)  = (50, -0.1, -10)
+ *   F1 = (-50, 0, 0) + (0, 0, -20) - 0.1 (0, 0, 0.5) = (-50, 0, -20.05)
+ * and v' = v + dt F / m, x' = x + dt v'. With node 0 fixed it stays put
+ * and node 1 moves the same, forces being read at the old positions. */
+bool check_mass_spring_step() {
+  SpringGraph g = two_node_spring();
+  auto force = SpringTerm() + GravityTerm(10) + DampingTerm(0.1);
+  MassSpringSystem free(g, [](const SpringGraph::node_type&) { return false; });
+  MassSpringSystem pinned(g, [](const SpringGraph::node_type& n) { return n.index() == 0; });
+  bool ok = free.step(1, 0.01, force) == 1.01 && pinned.step(1, 0.01, force) == 1.01;
+  const Point v1(-0.25, 0, 0.39975), x1(1.4975, 0, 0.0039975);
+  return ok
+      && near(free.velocity(0), Point(0.5, 0.999, -0.1))
+      && near(free.position(0), Point(0.005, 0.00999, -0.001))
+      && near(free.velocity(1), v1) && near(free.position(1), x1)
+      && pinned.velocity(0) == Point(0) && pinned.position(0) == Point(0)
+      && near(pinned.velocity(1), v1) && near(pinned.position(1), x1);
+}
+
+/** stable_dt and adaptive_dt of the two-node spring. The largest 2 K / m of
+ * a free node is 200, or 100 with node 0 fixed; the strain rate
+ * |v0 - v1| / L is sqrt(1.25), or 0.5 with node 0 at rest. */
+bool check_mass_spring_dt() {
+  SpringGraph g = two_node_spring();
+  MassSpringSystem free(g, [](const SpringGraph::node_type&) { return false; });
+  MassSpringSystem pinned(g, [](const SpringGraph::node_type& n) { return n.index() == 0; });
+  auto same = [](double a, double b) { return std::abs(a - b) <= 1e-15 * b; };
+  bool ok = same(free.stable_dt(0.5), 1 / std::sqrt(200.0))
+         && same(free.stable_dt(1), 2 / std::sqrt(200.0))
+         && same(pinned.stable_dt(0.5), 0.1)
+         // The strain limit only binds below the stability limit
+         && free.adaptive_dt(0.5, 0.1) == free.stable_dt(0.5)
+         && same(free.adaptive_dt(0.5, 0.05), 0.05 / std::sqrt(1.25))
+         && same(pinned.adaptive_dt(0.5, 0.04), 0.08)
+         && pinned.adaptive_dt(0.5, 0.1) == pinned.stable_dt(0.5);
+  // At rest only stability limits the step
+  for (auto n = g.node_begin(); n != g.node_end(); ++n)
+    (*n).value().vel = Point(0);
+  MassSpringSystem rest(g, [](const SpringGraph::node_type&) { return false; });
+  return ok && rest.adaptive_dt(0.5, 1e-6) == rest.stable_dt(0.5);
+}
+
+/** @a n nodes at random points of the unit cube, moving at random, without
+ * springs. */
+SpringGraph random_particles(unsigned n) {
+  SpringGraph g;
+  for (unsigned k = 0; k < n; ++k) {
+    Point x(CME212::random(), CME212::random(), CME212::random());
+    Point v(CME212::random(-1, 1), CME212::random(-1, 1), CME212::random(-1, 1));
+    g.add_node(x, SpringNode{v, 1});
+  }
+  return g;
+}
+
+/** A ConstraintPass with a plane, a sphere and a box obstacle against the
+ * same expression applied serially to every free node. The candidates
+ * must hold every node inside the obstacles' bounds, once. */
+bool check_constraint_pass(unsigned n) {
+  SpringGraph g = random_particles(n);
+  auto fixed = [](const SpringGraph::node_type& node) { return node.index() % 7 == 0; };
+  MassSpringSystem s(g, fixed), expect(g, fixed);
+  auto obstacles = PlaneObstacle(0.3) + SphereObstacle(Point(0.5, 0.5, 0.5), 0.2)
+                 + BoxObstacle(Box3D(Point(0.6, 0.1, 0.1), Point(0.9, 0.4, 0.9)));
+  std::vector<Box3D> bounds;
+  obstacles.for_each_bounds([&bounds](const Box3D& b) { bounds.push_back(b); });
+  std::vector<unsigned> inside;
+  for (unsigned i = 0; i < n; ++i) {
+    bool in = false;
+    for (const Box3D& b : bounds)
+      in = in || b.contains(s.position(i));
+    if (in)
+      inside.push_back(i);
+  }
+
+  auto i2p = [&s](unsigned i) { return s.position(i); };
+  SpaceSearcher<unsigned, 8> searcher(Box3D(Point(-1, -1, -1), Point(2, 2, 2)),
+                                      thrust::counting_iterator<unsigned>(0),
+                                      thrust::counting_iterator<unsigned>(n), i2p);
+  ConstraintPass<decltype(obstacles)> constrain(obstacles);
+  constrain(s, searcher);
+  for (unsigned i = 0; i < n; ++i)
+    if (!expect.is_fixed(i))
+      obstacles(expect, i);
+
+  const std::vector<unsigned>& c = constrain.candidates();
+  bool ok = std::adjacent_find(c.begin(), c.end(), std::greater_equal<unsigned>()) == c.end()
+         && std::includes(c.begin(), c.end(), inside.begin(), inside.end())
+         && inside.size() > n / 4 && inside.size() < n;
+  for (unsigned i = 0; ok && i < n; ++i)
+    ok = s.position(i) == expect.position(i) && s.velocity(i) == expect.velocity(i);
+  return ok;
+}
+
+/** SelfCollisionPass against the SelfCollisionTest of mass_spring.cpp, a
+ * loop over all node pairs, on data/grid1 folded in half so that the two
+ * halves lie a fifth of a spring apart, with jittered positions and random
+ * velocities. Both remove the velocity towards each collider in turn; the
+ * pass meets them in Morton order, so the loop takes them in that order
+ * too.
+ * @return the number of nodes with exactly one collider, or 0 on failure. */
+unsigned check_self_collisions() {
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes("data/grid1.nodes", points) || !read_tets("data/grid1.tets", tets))
+    return 0;
+  SpringGraph g;
+  g.build_from_tets(points, tets);
+  const double h = 1.0 / 24;
+  for (auto it = g.node_begin(); it != g.node_end(); ++it) {
+    auto n = *it;
+    Point& x = n.position();
+    if (x.x > 0.5)
+      x = Point(1 - x.x, x.y, 0.2 * h);
+    x += Point(CME212::random(-0.05, 0.05), CME212::random(-0.05, 0.05), 0) * h;
+    n.value() = SpringNode{Point(CME212::random(-1, 1), CME212::random(-1, 1),
+                                 CME212::random(-1, 1)), 1};
+  }
+  for (auto it = g.edge_begin(); it != g.edge_end(); ++it) {
+    (*it).value() = SpringEdge{1, 1};
+    (*it).dual().value() = SpringEdge{1, 1};
+  }
+
+  MassSpringSystem s(g, [](const SpringGraph::node_type&) { return false; });
+  auto i2p = [&s](unsigned i) { return s.position(i); };
+  SpaceSearcher<unsigned, 10> searcher(Box3D(Point(-1, -1, -1), Point(2, 2, 2)),
+                                       thrust::counting_iterator<unsigned>(0),
+                                       thrust::counting_iterator<unsigned>(s.size()), i2p);
+  SelfCollisionPass collisions;
+  collisions(s, searcher);
+
+  MortonCoder<10> mc(searcher.bounding_box());
+  unsigned single = 0;
+  for (auto i = g.node_begin(); i != g.node_end(); ++i) {
+    auto n = *i;
+    const Point& center = n.position();
+    double radius2 = std::numeric_limits<double>::max();
+    for (auto j = n.edge_begin(); j != n.edge_end(); ++j)
+      radius2 = std::min(radius2, normSq((*j).node2().position() - center));
+    radius2 *= 0.9;
+    std::vector<std::pair<MortonCoder<10>::code_type, unsigned>> hits;
+    for (auto k = g.node_begin(); k != g.node_end(); ++k) {
+      double l2 = normSq(center - (*k).position());
+      if (n != *k && l2 < radius2)
+        hits.push_back(std::make_pair(mc.code((*k).position()), (*k).index()));
+    }
+    std::sort(hits.begin(), hits.end());
+    Point vel = n.value().vel;
+    for (auto& hit : hits) {
+      Point r = center - g.node(hit.second).position();
+      vel -= (dot(r, vel) / normSq(r)) * r;
+    }
+    if (norm_inf(s.velocity(n.index()) - vel) > 1e-14)
+      return 0;
+    single += hits.size() == 1;
+  }
+  return single;
+}
+
 int main()
 {
   using GraphType = Graph<int, int>;
@@ -130,6 +622,21 @@ int main()
 
   sf_print(count_edges == g.num_edges(), "Edge count agrees");
 
+  // Freeze the adjacency and check nothing observable changed
+  Edge e0 = *g.edge_begin();
+  unsigned e0_n1 = e0.node1().index(), e0_n2 = e0.node2().index();
+  g.freeze();
+  sf_print(g.is_frozen() && g.num_edges() == 50, "Frozen graph has 50 Edges");
+  sf_print(e0.node1().index() == e0_n1 && e0.node2().index() == e0_n2,
+           "Edge survives freeze");
+  unsigned frozen_count = 0;
+  for (auto it = g.edge_begin(); it != g.edge_end(); ++it)
+    ++frozen_count;
+  sf_print(frozen_count == 50, "Frozen edge iteration count agrees");
+  g.remove_edge(e0.node1(), e0.node2());
+  sf_print(!g.is_frozen() && g.num_edges() == 49, "remove_edge thaws graph");
+  g.add_edge(g.node(e0_n1), g.node(e0_n2));
+
   // Remove 50 Nodes...
   for (unsigned k = 0; k < 50; ++k) {
     unsigned n = (unsigned) CME212::random(0, g.num_nodes());
@@ -148,6 +655,115 @@ int main()
 
   sf_print(count_edges == g.num_edges(), "Edge count agrees");
 
+  // The edge index is random access and agrees with edge iteration
+  bool index_ok = unsigned(g.edge_end() - g.edge_begin()) == g.num_edges();
+  unsigned idx = 0;
+  for (auto it = g.edge_begin(); it != g.edge_end(); ++it, ++idx)
+    index_ok = index_ok && *it == g.edge(idx) && *(g.edge_begin() + idx) == *it;
+  sf_print(index_ok, "Edge index agrees with edge iteration");
+
+  // Renumbering keeps positions and topology, both unfrozen and frozen
+  for (int pass = 0; pass < 2; ++pass) {
+    unsigned n = g.num_nodes(), m = g.num_edges();
+    std::vector<Point> old_pos;
+    std::vector<bool> old_adj(n * n);
+    for (unsigned k = 0; k < n; ++k) {
+      old_pos.push_back(g.node(k).position());
+      for (unsigned j = 0; j < n; ++j)
+        old_adj[k*n + j] = g.has_edge(g.node(k), g.node(j));
+    }
+    auto order = pass == 0 ? morton_order(g) : rcm_order(g);
+    if (pass == 1) g.freeze();
+    g.reorder(order);
+    bool reorder_ok = g.num_edges() == m && g.is_frozen() == (pass == 1);
+    for (unsigned k = 0; k < n; ++k) {
+      reorder_ok = reorder_ok && g.node(k).position() == old_pos[order[k]];
+      for (unsigned j = 0; j < n; ++j)
+        reorder_ok = reorder_ok && g.has_edge(g.node(k), g.node(j))
+                                   == old_adj[order[k]*n + order[j]];
+    }
+    sf_print(reorder_ok, pass == 0 ? "Morton reorder keeps the Graph"
+                                   : "Frozen RCM reorder keeps the Graph");
+  }
+
+  // Batched removal renumbers the survivors in order, frozen and unfrozen
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) g.thaw();
+    unsigned n = g.num_nodes();
+    std::vector<Point> old_pos;
+    std::vector<bool> old_adj(n * n);
+    for (unsigned k = 0; k < n; ++k) {
+      old_pos.push_back(g.node(k).position());
+      for (unsigned j = 0; j < n; ++j)
+        old_adj[k*n + j] = g.has_edge(g.node(k), g.node(j));
+    }
+    auto new_id = g.remove_nodes_if([](const GraphType::node_type& x) {
+      return x.index() % 3 == 1;
+    });
+    unsigned kept = 0, kept_edges = 0;
+    bool remove_ok = new_id.size() == n;
+    for (unsigned k = 0; k < n; ++k) {
+      if (k % 3 == 1) {
+        remove_ok = remove_ok && new_id[k] == unsigned(-1);
+        continue;
+      }
+      remove_ok = remove_ok && new_id[k] == kept++
+                  && g.node(new_id[k]).position() == old_pos[k];
+      for (unsigned j = k+1; j < n; ++j) {
+        if (j % 3 == 1) continue;
+        kept_edges += old_adj[k*n + j];
+        remove_ok = remove_ok && g.has_edge(g.node(new_id[k]), g.node(new_id[j]))
+                                 == old_adj[k*n + j];
+      }
+    }
+    remove_ok = remove_ok && g.num_nodes() == kept && g.num_edges() == kept_edges;
+    sf_print(remove_ok, pass == 0 ? "Frozen remove_nodes_if keeps the rest"
+                                  : "remove_nodes_if keeps the rest");
+  }
+
+  // A view holds the nodes passing the predicate and the edges between them
+  {
+    auto keep = [](const GraphType::node_type& x) { return x.position().x < 0.5; };
+    auto v = g.view(keep);
+    unsigned n = g.num_nodes(), kept = 0, kept_edges = 0;
+    std::vector<unsigned> kept_ids;
+    for (unsigned k = 0; k < n; ++k) {
+      if (!keep(g.node(k))) continue;
+      kept_ids.push_back(k);
+      for (unsigned j = k+1; j < n; ++j)
+        kept_edges += keep(g.node(j)) && g.has_edge(g.node(k), g.node(j));
+    }
+    bool view_ok = v.num_nodes() == kept_ids.size() && v.num_edges() == kept_edges;
+    for (auto it = v.node_begin(); it != v.node_end(); ++it, ++kept)
+      view_ok = view_ok && kept < kept_ids.size() && (*it).index() == kept_ids[kept];
+    unsigned visited = 0;
+    for (auto it = v.edge_begin(); it != v.edge_end(); ++it, ++visited) {
+      Edge ve = *it;
+      view_ok = view_ok && v.contains(ve.node1()) && v.contains(ve.node2())
+                && g.has_edge(ve.node1(), ve.node2());
+    }
+    sf_print(view_ok && kept == kept_ids.size() && visited == kept_edges,
+             "Graph view iterates the induced subgraph");
+
+    GraphType sub = v.subgraph();
+    bool sub_ok = sub.num_nodes() == kept_ids.size() && sub.num_edges() == kept_edges
+                  && sub.is_frozen();
+    for (unsigned k = 0; sub_ok && k < sub.num_nodes(); ++k) {
+      sub_ok = sub.node(k).position() == g.node(kept_ids[k]).position();
+      for (unsigned j = 0; j < sub.num_nodes(); ++j)
+        sub_ok = sub_ok && sub.has_edge(sub.node(k), sub.node(j))
+                           == g.has_edge(g.node(kept_ids[k]), g.node(kept_ids[j]));
+    }
+    sf_print(sub_ok, "Graph view subgraph is compact");
+  }
+
+  // Removing through an edge_iterator visits every remaining edge
+  auto eit = g.edge_begin();
+  while (eit != g.edge_end())
+    eit = g.remove_edge(eit);
+  sf_print(g.num_edges() == 0 && g.edge_begin() == g.edge_end(),
+           "Removed all Edges through edge_iterator");
+
   std::cerr << "Clearing...";
   g.clear();
   sf_print(g.num_nodes() == 0 && g.num_edges() == 0);
@@ -167,6 +783,183 @@ int main()
   sf_print(e1 != e2, "G1-G2 Edge comparison !=");
   sf_print(e1 < e2 || e2 < e1, "G1-G2 Edge comparison < >");
 
+  // Bulk construction: two tets sharing a face have 9 distinct edges
+  std::vector<Point> tet_points;
+  for (unsigned k = 0; k < 5; ++k)
+    tet_points.push_back(Point(CME212::random(), CME212::random(), CME212::random()));
+  std::vector<std::array<unsigned,4>> tets = {{0, 1, 2, 3}, {3, 2, 1, 4}};
+  g.build_from_tets(tet_points, tets);
+  sf_print(g.num_nodes() == 5 && g.num_edges() == 9 && g.is_frozen(),
+           "build_from_tets has 5 Nodes, 9 Edges");
+  sf_print(!g.has_edge(g.node(0), g.node(4)) && g.has_edge(g.node(4), g.node(1))
+           && g.node(2).position() == tet_points[2],
+           "build_from_tets Edges check out");
+
+  // Searches: node 4 is two edges from node 0, one from node 1
+  GraphSearch<GraphType> search(g);
+  std::vector<int> hops = search.bfs(0);
+  sf_print(hops == std::vector<int>({0, 1, 1, 1, 2}), "GraphSearch bfs");
+  hops = search.bfs({0, 4});
+  sf_print(hops == std::vector<int>({0, 1, 1, 1, 0}), "GraphSearch multi-source bfs");
+  std::vector<double> lengths = search.dijkstra(0);
+  sf_print(lengths[1] == norm(tet_points[1] - tet_points[0])
+           && lengths[4] <= lengths[1] + norm(tet_points[4] - tet_points[1]),
+           "GraphSearch dijkstra");
+
+  g.build_from_tets(tet_points, tets, {{0, 1}, {2, 3}});
+  sf_print(g.num_edges() == 3, "build_from_tets with edge pattern");
+  hops = GraphSearch<GraphType>(g).bfs(0);
+  sf_print(hops == std::vector<int>({0, 1, -1, -1, 2}), "GraphSearch bfs unreachable");
+
+  // A hub whose row outgrows several blocks, next to rows that stay small
+  GraphType star;
+  star.reserve(100, 4);
+  for (unsigned k = 0; k < 100; ++k)
+    star.add_node(Point(k, 0, 0));
+  for (unsigned k = 1; k < 100; ++k) {
+    star.add_edge(star.node(0), star.node(k));
+    if (k > 1)
+      star.add_edge(star.node(k - 1), star.node(k));
+  }
+  for (unsigned k = 1; k < 100; k += 2)
+    star.remove_edge(star.node(0), star.node(k));
+  GraphType star_copy = star;
+  sf_print(star.num_edges() == 99 + 98 - 50 && star.node(0).degree() == 49
+           && star.node(50).degree() == 3 && star_copy.node(0).degree() == 49
+           && star_copy.has_edge(star_copy.node(98), star_copy.node(0))
+           && !star_copy.has_edge(star_copy.node(0), star_copy.node(99)),
+           "Graph reserve and growing rows");
+
+  // Subdomains of a grid cover it once and agree on what they exchange
+  {
+    GraphType grid;
+    const unsigned w = 9;
+    for (unsigned k = 0; k < w * w; ++k)
+      grid.add_node(Point(k % w, k / w, 0));
+    for (unsigned k = 0; k < w * w; ++k) {
+      if (k % w + 1 < w) grid.add_edge(grid.node(k), grid.node(k + 1));
+      if (k + w < w * w) grid.add_edge(grid.node(k), grid.node(k + w));
+    }
+    const unsigned parts = 3;
+    std::vector<unsigned> owner = morton_partition(grid, parts);
+    std::vector<Subdomain> subs;
+    for (unsigned p = 0; p < parts; ++p)
+      subs.emplace_back(grid, owner, p);
+
+    std::vector<unsigned> seen(grid.num_nodes(), 0);
+    bool part_ok = true;
+    for (auto& s : subs) {
+      GraphType local = s.local_graph(grid);
+      part_ok = part_ok && s.num_owned() > 0 && local.num_nodes() == s.size();
+      for (unsigned l = 0; part_ok && l < s.size(); ++l) {
+        auto node = grid.node(s.global_index(l));
+        part_ok = local.node(l).position() == node.position()
+                  && (owner[node.index()] == s.part()) == (l < s.num_owned());
+        if (l >= s.num_owned()) continue;
+        ++seen[node.index()];
+        // Own nodes keep all their edges, boundary ones reach a ghost
+        bool reaches_ghost = false;
+        auto ln = local.node(l);
+        for (auto it = ln.edge_begin(); it != ln.edge_end(); ++it)
+          reaches_ghost = reaches_ghost || (*it).node2().index() >= s.num_owned();
+        part_ok = part_ok && ln.degree() == node.degree()
+                  && reaches_ghost == (l < s.num_boundary());
+      }
+      // What s sends to q is what q receives from s, in the same order
+      for (unsigned k = 0; part_ok && k < s.neighbors().size(); ++k) {
+        const Subdomain& q = subs[s.neighbors()[k]];
+        auto qk = std::find(q.neighbors().begin(), q.neighbors().end(), s.part())
+                - q.neighbors().begin();
+        part_ok = unsigned(qk) < q.neighbors().size()
+                  && s.send_end(k) - s.send_begin(k) == q.recv_end(qk) - q.recv_begin(qk);
+        for (unsigned j = 0; part_ok && j < s.send_end(k) - s.send_begin(k); ++j)
+          part_ok = s.global_index(s.send_ids()[s.send_begin(k) + j])
+                    == q.global_index(q.recv_begin(qk) + j);
+      }
+    }
+    part_ok = part_ok && std::count(seen.begin(), seen.end(), 1u) == long(seen.size());
+    sf_print(part_ok, "Subdomains cover the graph and match their halos");
+  }
+
+  // The magic-mask and PDEP/PEXT interleave kernels agree with each other
+  // and with spreading one bit at a time, set bits outside the mask or
+  // above the coordinate bits notwithstanding
+  {
+    bool bits_ok = true;
+    for (unsigned k = 0; k < 10000; ++k) {
+      uint32_t x = random_bits(10), junk32 = random_bits(32);
+      uint32_t s = spread_reference(x, 10);
+      bits_ok = bits_ok && detail::spread_bits_mask(x) == s
+                && detail::spread_bits(x) == s
+                && detail::spread_bits_mask(x | (junk32 << 10)) == s
+                && detail::spread_bits(x | (junk32 << 10)) == s
+                && detail::compact_bits_mask(s | (junk32 & ~0x09249249u)) == x
+                && detail::compact_bits(s | (junk32 & ~0x09249249u)) == x;
+      uint64_t y = random_bits(21), junk64 = random_bits(43) << 21;
+      uint64_t t = spread_reference(y, 21);
+      uint64_t off = (junk64 | random_bits(21)) & ~uint64_t(0x1249249249249249);
+      bits_ok = bits_ok && detail::spread_bits_mask(y) == t
+                && detail::spread_bits(y) == t
+                && detail::spread_bits_mask(y | junk64) == t
+                && detail::spread_bits(y | junk64) == t
+                && detail::compact_bits_mask(t | off) == y
+                && detail::compact_bits(t | off) == y;
+    }
+#if defined(__BMI2__)
+    sf_print(bits_ok, "Morton interleave kernels (mask and PDEP/PEXT)");
+#else
+    sf_print(bits_ok, "Morton interleave kernels (mask)");
+#endif
+  }
+
+  // Morton codes from 1 to 21 levels, 64-bit from 11 on
+  sf_print(check_morton_coder<1>() && check_morton_coder<5>()
+           && check_morton_coder<10>() && check_morton_coder<5, uint64_t>()
+           && sizeof(MortonCoder<10>::code_type) == 4,
+           "MortonCoder with 32-bit codes");
+  sf_print(check_morton_coder<11>() && check_morton_coder<16>()
+           && check_morton_coder<20>() && check_morton_coder<21>()
+           && sizeof(MortonCoder<11>::code_type) == 8,
+           "MortonCoder with 64-bit codes");
+
+  // The radix sort of the SpaceSearcher is stable, whatever the number of
+  // passes: few levels give many equal codes
+  sf_print(check_searcher_sort<2>(3000) && check_searcher_sort<7>(3000)
+           && check_searcher_sort<10>(3000) && check_searcher_sort<11>(3000)
+           && check_searcher_sort<21>(3000) && check_searcher_sort<7>(1),
+           "SpaceSearcher radix sort");
+  sf_print(check_searcher_update<5>(3000) && check_searcher_update<10>(3000)
+           && check_searcher_update<16>(3000),
+           "SpaceSearcher update after small and large moves");
+  sf_print(check_searcher_queries<2>(1000, 1) && check_searcher_queries<7>(1000, 0.5)
+           && check_searcher_queries<10>(1000, 1) && check_searcher_queries<16>(1000, 1)
+           && check_searcher_queries<7>(1000, 0),
+           "SpaceSearcher radius and nearest neighbor queries");
+  sf_print(check_parse_number({"0.1", "-0", "-0.0", "+2.5", "1e22", "1e23", "1e-22", "1e-30",
+                               "5e-324", "1.7976931348623157e308", "1.2345678901234567",
+                               "0.30000000000000004", "12345678901234567890",
+                               "123456789012345678901234", "9007199254740993",
+                               "1.00000000000000000000001", "0.000001e-300", "3.25 4",
+                               "7e+2,", "-.5", "1.e3"}),
+           "MeshIO parse_number matches strtod");
+  sf_print(check_mesh_io(2000), "MeshIO text and binary round trip");
+  std::size_t snap_double = check_snapshot(0);
+  std::size_t snap_single = check_snapshot(SNAPSHOT_SINGLE);
+  std::size_t snap_zlib = check_snapshot(SNAPSHOT_SINGLE | SNAPSHOT_ZLIB);
+  sf_print(snap_double > 0 && snap_single > 0 && snap_zlib > 0 && snap_single < snap_double,
+           "Snapshot frames read back");
+#ifdef CME212_USE_ZLIB
+  sf_print(snap_zlib < snap_single && (SNAPSHOT_DEFAULT & SNAPSHOT_ZLIB),
+           "Snapshot frames deflated with zlib");
+#endif
+
+  sf_print(check_mass_spring_step(), "MassSpringSystem step on a two-node spring");
+  sf_print(check_mass_spring_dt(), "MassSpringSystem stable_dt and adaptive_dt");
+
+  sf_print(check_constraint_pass(5000), "ConstraintPass against a serial sweep");
+
+  sf_print(check_self_collisions() > 100, "SelfCollisionPass against SelfCollisionTest");
+
   if (fail_count) {
     std::cerr << "\n" << fail_count
 	      << (fail_count > 1 ? " FAILURES" : " FAILURE") << std::endl;
@@ -19,6 +19,7 @@
 #include "CME212/Util.hpp"
 
 #include "Graph.hpp"
+#include "MeshIO.hpp"
 
 
 int main(int argc, char** argv)
@@ -31,23 +32,17 @@ int main(int argc, char** argv)
 
   // Construct a Graph
   Graph<double, double> graph;
-  std::vector<typename Graph<double, double>::node_type> nodes;
 
-  // Create a nodes_file from the first input argument
-  std::ifstream nodes_file(argv[1]);
-  // Interpret each line of the nodes_file as a 3D Point and add to the Graph
-  Point p;
-  while (CME212::getline_parsed(nodes_file, p))
-    nodes.push_back(graph.add_node(p));
+  // Read the nodes and tets files, text or binary, from the input arguments
+  std::vector<Point> points;
+  std::vector<tet_type> tets;
+  if (!read_nodes(argv[1], points) || !read_tets(argv[2], tets)) {
+    std::cerr << "Error reading " << argv[1] << " or " << argv[2] << "\n";
+    exit(1);
+  }
 
-  // Create a tets_file from the second input argument
-  std::ifstream tets_file(argv[2]);
-  // Interpret each line of the tets_file as four ints which refer to nodes
-  std::array<int,4> t;
-  while (CME212::getline_parsed(tets_file, t))
-    for (unsigned i = 1; i < t.size(); ++i)
-      for (unsigned j = 0; j < i; ++j)
-        graph.add_edge(nodes[t[i]], nodes[t[j]]);
+  // Add each Point to the Graph and connect every pair of nodes in each tet
+  graph.build_from_tets(points, tets);
 
   // Print number of nodes and edges
   std::cout << graph.num_nodes() << " " << graph.num_edges() << std::endl;